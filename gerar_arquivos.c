@@ -1,568 +1,2147 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
-#define MAX_EVENT_TIME_LEN 64
 #define MAX_EVENT_TYPE_LEN 32
 #define MAX_USER_SESSION_LEN 256
 #define MAX_CATEGORY_CODE_LEN 64
 #define MAX_BRAND_LEN 32
 
-#define CHUNK_SIZE 131700
+#define DEFAULT_MEMORY_BUDGET (256LL * 1024 * 1024)  // Orçamento padrão de memória (--mem)
+#define MIN_MEMORY_BUDGET (16LL * 1024 * 1024)
+#define READ_BLOCK_SIZE (16 * 1024 * 1024)  // Máximo de bytes do CSV tokenizados por bloco
+#define MIN_READ_BLOCK_SIZE (1024 * 1024)
+#define MAX_PARSE_THREADS 64
+#define RUN_WRITE_BUFFER 4096               // Registros por escrita nos arquivos temporários
+#define MERGE_BLOCK_SIZE (1024 * 1024)      // Bytes por leitura/escrita na mesclagem
+#define BLOCK_ALIGNMENT 4096
+#define MERGE_SAMPLES_PER_PARTITION 64      // Chaves amostradas por partição da mesclagem paralela
+#define MERGE_RESERVED_FDS 8                // Descritores fora dos runs: stdio, arquivo de saída e folga
+
+#define ACCESS_FILE_MAGIC "ACCS"
+#define ACCESS_FILE_VERSION 2
+#define MAX_EVENT_TYPES 256                 // Códigos de tipo de evento cabem em 1 byte
+#define EVENT_TIME_UNKNOWN LLONG_MIN        // Hora do evento ausente ou fora do formato
+#define SESSION_BYTES 16
+#define SESSION_UUID 0                      // user_session guarda os 16 bytes do UUID
+#define SESSION_TEXT 1                      // user_session guarda o texto (até 16 bytes, completado com zeros)
+#define SESSION_OVERFLOW 2                  // user_session guarda deslocamento e tamanho no arquivo de sessões
+
+#define PRODUCT_FILE_MAGIC "PRDS"
+#define PRODUCT_FILE_VERSION 5
+#define COLUMN_FILE_MAGIC "PCOL"
+#define COLUMN_FILE_VERSION 1
+#define COLUMN_HEADER_SIZE 64               // Início das colunas em products.col
+#define COLUMN_CHUNK_RECORDS 16384          // Registros convertidos para colunas por leitura
+#define DICTIONARY_ENTRY_LEN MAX_CATEGORY_CODE_LEN  // Bytes por string no dicionário de products.bin
+#define DICTIONARY_MIN_CAPACITY 1024        // Entradas reservadas no mínimo, para inserções futuras
 
+/**
+ * Cabeçalho de products.bin (formato v5). Depois dele vem o dicionário de
+ * strings (marcas e códigos de categoria), com espaço reservado para novas
+ * entradas, e então os registros a partir de data_offset. Os base_count
+ * primeiros registros estão em ordem de product_id, o que permite buscá-los
+ * por bisseção sem índice; os removidos dessa região ficam no lugar, inativos.
+ * Os demais registros removidos formam uma lista de posições livres, ligada
+ * pelo campo elo.
+ */
 typedef struct {
-    long long head_index;
+    long long head_index;                    // Índice do primeiro registro da lista (-1 se vazia)
+    char magic[4];                           // PRODUCT_FILE_MAGIC
+    unsigned int version;                    // PRODUCT_FILE_VERSION
+    unsigned int record_size;                // sizeof(ProductRecord)
+    unsigned int dict_count;                 // Entradas usadas no dicionário
+    long long dict_offset;                   // Início do dicionário
+    long long dict_capacity;                 // Entradas reservadas para o dicionário
+    long long data_offset;                   // Início dos registros
+    long long free_head;                     // Primeira posição livre (-1 se nenhuma)
+    long long base_count;                    // Registros da região ordenada por product_id
+    long long base_free;                     // Registros inativos na região ordenada
 } Header;
 
 
+/**
+ * Cabeçalho de access.bin (formato v2). O dicionário de tipos de evento é
+ * reescrito no final da geração, quando todos os tipos são conhecidos.
+ */
+typedef struct {
+    char magic[4];                           // ACCESS_FILE_MAGIC
+    unsigned int version;                    // ACCESS_FILE_VERSION
+    unsigned int event_type_count;           // Entradas usadas em event_types
+    unsigned int record_size;                // sizeof(AccessRecord)
+    char event_types[MAX_EVENT_TYPES][MAX_EVENT_TYPE_LEN]; // Nome de cada código de tipo de evento
+} AccessFileHeader;
+
 typedef struct {
-    char event_time[MAX_EVENT_TIME_LEN];     // Hora do evento
-    char event_type[MAX_EVENT_TYPE_LEN];     // Tipo do evento
+    long long event_time;                    // Hora do evento (segundos desde 1970, UTC)
     long long product_id;                    // ID do produto
     long long user_id;                       // ID do usuário
-    char user_session[MAX_USER_SESSION_LEN]; // Sessão do usuário
-    long long seq_key;                       // Chave sequencial                          // Elo, inicializado como 0
-    int ativo;                              // Status ativo, inicializado como true
+    long long seq_key;                       // Chave sequencial
+    unsigned char user_session[SESSION_BYTES]; // Sessão do usuário, conforme session_kind
+    unsigned char event_type;                // Código no dicionário do cabeçalho
+    unsigned char session_kind;              // SESSION_UUID, SESSION_TEXT ou SESSION_OVERFLOW
+    unsigned char ativo;                     // Status ativo, inicializado como true
+    unsigned char reserved[5];
 } AccessRecord;
 
+typedef struct {
+    unsigned int count;
+    char names[MAX_EVENT_TYPES][MAX_EVENT_TYPE_LEN];
+} EventTypeDictionary;
+
+typedef struct {
+    char (*entries)[DICTIONARY_ENTRY_LEN];   // Strings na ordem dos códigos
+    unsigned int *slots;                     // Tabela hash: código + 1, ou 0 se vazia
+    unsigned int slot_mask;
+    unsigned int count;
+    unsigned int capacity;                   // Entradas alocadas em entries
+} StringDictionary;
+
 typedef struct {
     long long product_id;                    // ID do produto (chave)
     long long category_id;                   // ID da categoria
-    char category_code[MAX_CATEGORY_CODE_LEN]; // Código da categoria
-    char brand[MAX_BRAND_LEN];               // Marca
     float price;                             // Preço
+    unsigned int category_code;              // Código da categoria (índice no dicionário)
+    unsigned int brand;                      // Marca (índice no dicionário)
     int ativo;                              // Status ativo, inicializado como true
     long long seq_key;                       // Chave sequencial
     long long elo;                           // Elo, inicializado como 0
 } ProductRecord;
 
+/**
+ * Tamanho e data de modificação de products.bin, no formato usado pelo
+ * gerenciador para detectar arquivos derivados desatualizados.
+ */
+typedef struct {
+    long long size;
+    long long mtime_sec;
+    long long mtime_nsec;
+} DataStamp;
+
+/**
+ * Cabeçalho de products.col, a cópia em colunas de products.bin com um
+ * elemento por posição de registro. A partir de COLUMN_HEADER_SIZE vêm as
+ * colunas product_id (int64), category_id (int64) e price (float), cada uma
+ * com capacity elementos, e o bitmap de registros ativos (1 bit por registro).
+ */
+typedef struct {
+    char magic[4];                           // COLUMN_FILE_MAGIC
+    unsigned int version;                    // COLUMN_FILE_VERSION
+    long long count;                         // Registros em products.bin
+    long long capacity;                      // Elementos reservados por coluna (múltiplo de 64)
+    DataStamp data;                          // products.bin quando as colunas foram gravadas
+} ColumnHeader;
+
+typedef struct {
+    AccessRecord *access_records;            // Acessos do bloco, na ordem do arquivo
+    ProductRecord *product_records;          // Produtos do bloco, na ordem do arquivo
+    size_t count;                            // Linhas tokenizadas no bloco
+    size_t capacity;                         // Capacidade dos arrays
+} ParsedBlock;
+
+typedef struct {
+    const char *begin;                       // Início da faixa (início de linha)
+    const char *end;                         // Fim da faixa (após uma quebra de linha)
+    size_t line_count;                       // Linhas na faixa
+    size_t first_record;                     // Posição da primeira linha no bloco
+    long long first_seq_key;                 // Chave sequencial da primeira linha
+    ParsedBlock *block;
+    EventTypeDictionary *event_types;        // Tipos de evento da faixa, na ordem em que aparecem
+    StringDictionary *strings;               // Marcas e categorias da faixa, na ordem em que aparecem
+} ParseRange;
+
+typedef struct {
+    long long *keys;                         // product_ids (endereçamento aberto)
+    unsigned int *stamps;                    // Entrada ocupada se stamps[i] == stamp
+    unsigned int stamp;                      // Geração atual; incrementada ao esvaziar
+    int bits;                                // log2 do número de entradas
+} ProductIdSet;
+
+typedef struct {
+    long long product_id;                    // Chave de ordenação
+    long long order;                         // Ordem de leitura (desempate: mantém o primeiro)
+    unsigned int run;                        // Run ao qual o registro pertence
+    unsigned int slot;                       // Posição do registro em RunBuilder.slots
+} HeapEntry;
+
+typedef struct {
+    ProductRecord *slots;                    // Registros em memória
+    unsigned int *free_slots;                // Pilha de posições livres em slots
+    size_t free_count;
+    HeapEntry *heap;                         // Heap mínimo por (run, product_id, ordem)
+    size_t heap_size;
+    size_t capacity;                         // Registros que cabem no orçamento
+    ProductIdSet run_ids[2];                 // Chaves no heap do run atual e do próximo (por paridade)
+    unsigned int current_run;
+    long long last_output;                   // Última chave gravada no run atual
+    int has_output;
+    long long order;
+    int run_fd;                              // Arquivo do run atual (-1 se fechado)
+    ProductRecord *write_buffer;
+    size_t buffered;
+    char **temp_files;                       // Nomes dos arquivos temporários
+    int temp_file_count;
+} RunBuilder;
+
+typedef struct {
+    ParsedBlock blocks[2];                   // Blocos alternados entre tokenização e consumo
+    int ready[2];                            // Bloco tokenizado aguardando consumo
+    int done;                                // Não há mais blocos a tokenizar
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    FILE *access_fp;
+    FILE *sessions_fp;                       // Sessões que não cabem no registro
+    long long sessions_size;
+    RunBuilder builder;
+} IngestPipeline;
+
+typedef struct {
+    int fd;                                  // Arquivo temporário ordenado
+    off_t offset;                            // Próximo byte a ler
+    off_t end;                               // Fim da faixa lida do arquivo
+    char *buffer;                            // Bloco lido do arquivo
+    size_t capacity;                         // Tamanho do bloco em bytes
+    size_t count;                            // Registros válidos no bloco
+    size_t pos;                              // Próximo registro do bloco
+    int active;                              // Ainda há registros nesta faixa
+} RunReader;
+
+typedef struct {
+    RunReader *runs;
+    int num_runs;
+    int *losers;                             // Perdedor de cada nó interno (1..k-1)
+    size_t record_size;
+    int (*compare)(const void *, const void *);
+} MergeState;
+
+typedef struct {
+    char **temp_files;                       // Runs de entrada
+    int num_runs;
+    off_t *begin;                            // Faixa [begin, end) de cada run nesta partição
+    off_t *end;
+    size_t block_bytes;                      // Tamanho dos blocos de leitura e escrita
+    int counting;                            // Passada que só conta os registros da partição
+    long long count;                         // Registros da partição, sem duplicatas
+    long long base;                          // Registros de todas as partições anteriores
+    int last;                                // Última partição não vazia (recebe elo = -1)
+    int output_fd;                           // Arquivo final
+    off_t data_offset;                       // Início dos registros no arquivo final
+} MergePartition;
+
 
 // Protótipos das funções
-void external_sort_access(const char *input_filename, const char *output_filename);
-void external_sort_products(const char *input_filename, const char *output_filename);
-void merge_files(const char *output_filename, char **temp_files, int num_temp_files, size_t record_size, int (*compare)(const void *, const void *), int eliminate_duplicates);
+size_t parse_memory_size(const char *text);
+void process_input_file(const char *input_filename, const char *access_filename, const char *sessions_filename, const char *products_filename, const char *columns_filename, int num_threads, size_t memory_budget);
+void write_product_columns(const char *products_filename, const char *columns_filename);
+void pwrite_all(int fd, const void *data, size_t len, off_t offset);
+void parse_block(const char *begin, const char *end, int num_threads, long long first_seq_key, EventTypeDictionary *event_types, StringDictionary *strings, ParsedBlock *block);
+void *consume_parsed_blocks(void *arg);
+void *count_range_lines(void *arg);
+void *parse_range_lines(void *arg);
+const char *parse_line(const char *p, const char *end, EventTypeDictionary *event_types, StringDictionary *strings, AccessRecord *access_rec, ProductRecord *product_rec);
+unsigned char event_type_code(EventTypeDictionary *dictionary, const char *name, size_t len);
+long long parse_event_time(const char *p, const char *end);
+int two_digits(const char *p);
+long long days_from_civil(long long year, unsigned month, unsigned day);
+void encode_session(AccessRecord *record, const char *p, size_t len);
+int parse_uuid(const char *p, unsigned char *out);
+void write_access_header(FILE *fp, const EventTypeDictionary *event_types);
+const char *find_delimiter(const char *p, const char *end);
+const char *find_newline(const char *p, const char *end);
+size_t count_newlines(const char *p, const char *end);
+void string_dictionary_init(StringDictionary *dictionary);
+unsigned int string_dictionary_code(StringDictionary *dictionary, const char *text, size_t len);
+void string_dictionary_free(StringDictionary *dictionary);
+char *build_product_file_prefix(const StringDictionary *strings, size_t *prefix_size);
+long long parse_int64(const char *p, const char *end);
+float parse_price(const char *p, const char *end);
+void product_id_set_init(ProductIdSet *set, size_t max_keys);
+int product_id_set_insert(ProductIdSet *set, long long key);
+void product_id_set_remove(ProductIdSet *set, long long key);
+void product_id_set_clear(ProductIdSet *set);
+void product_id_set_free(ProductIdSet *set);
+void run_builder_init(RunBuilder *builder, size_t memory_budget);
+void run_builder_add(RunBuilder *builder, const ProductRecord *record);
+void run_builder_finish(RunBuilder *builder);
+void run_builder_emit_min(RunBuilder *builder);
+void run_builder_close_run(RunBuilder *builder);
+int heap_entry_less(const HeapEntry *a, const HeapEntry *b);
+char *new_temp_filename(char ***temp_files, int *temp_file_count);
+void merge_product_runs(const char *output_filename, char ***temp_files, int *temp_file_count, size_t memory_budget, int num_threads, const StringDictionary *strings);
+size_t merge_descriptor_budget(void);
+int compute_merge_fan_in(size_t memory_budget, size_t descriptors, int partitions);
+void merge_files(const char *output_filename, char **temp_files, int num_temp_files, size_t record_size, int (*compare)(const void *, const void *), int eliminate_duplicates, const char *prefix, size_t prefix_size);
+long long merge_runs(RunReader *runs, int num_runs, size_t record_size, int (*compare)(const void *, const void *), int output_fd, off_t output_offset, size_t block_bytes, int eliminate_duplicates, long long first_seq_key, int last);
+void open_run_reader(RunReader *run, const char *filename, off_t begin, off_t end, size_t block_bytes);
+void close_run_reader(RunReader *run);
+void parallel_merge_files(const char *output_filename, char **temp_files, int num_temp_files, int num_partitions, size_t memory_budget, char *prefix, size_t prefix_size);
+off_t lower_bound_in_run(int fd, long long num_records, long long key);
+void *merge_partition(void *arg);
+int compare_long_long(const void *a, const void *b);
+void refill_run(RunReader *run, size_t record_size);
+int run_precedes(const MergeState *merge, int a, int b);
+int build_loser_tree(MergeState *merge, int node);
+int replay_loser_tree(MergeState *merge, int winner);
+void write_all(int fd, const void *data, size_t len);
 int compare_access_records(const void *a, const void *b);
 int compare_product_records(const void *a, const void *b);
-void pad_string(char *str, int size);
-void quicksort(void *arr, int left, int right, size_t size, int (*compare)(const void *, const void *));
-int partition(void *arr, int left, int right, size_t size, int (*compare)(const void *, const void *));
-void swap_records(void *a, void *b, size_t size);
 
-int main() {
+int main(int argc, char *argv[]) {
     const char *input_filename = "dados.csv"; // Substitua pelo nome do seu arquivo
-    // Processa e ordena os registros de acesso
-    external_sort_access(input_filename, "access.bin");
 
-    // Processa e ordena os registros de produtos
-    external_sort_products(input_filename, "products.bin");
+    // Número de threads de parsing: --threads N (padrão: núcleos disponíveis)
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            num_threads = atol(argv[++i]);
+        }
+    }
+    if (num_threads < 1) num_threads = 1;
+    if (num_threads > MAX_PARSE_THREADS) num_threads = MAX_PARSE_THREADS;
+
+    // Orçamento de memória da ordenação externa: --mem 8G (sufixos K, M, G, T)
+    size_t memory_budget = DEFAULT_MEMORY_BUDGET;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--mem") == 0 && i + 1 < argc) {
+            memory_budget = parse_memory_size(argv[++i]);
+            if (memory_budget == 0) {
+                fprintf(stderr, "Tamanho de memória inválido: %s\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    if (memory_budget < MIN_MEMORY_BUDGET) memory_budget = MIN_MEMORY_BUDGET;
+
+    // Lê o arquivo de entrada uma única vez, gerando os registros de acesso
+    // e os registros de produtos ordenados
+    process_input_file(input_filename, "access.bin", "access.sess", "products.bin", "products.col", (int)num_threads, memory_budget);
 
     return 0;
 }
 
 /**
- * Lê o arquivo de entrada, extrai registros de acesso, atribui uma chave sequencial
- * e grava diretamente no arquivo de saída.
+ * Converte um tamanho como "512M" ou "8G" (sufixos K, M, G e T, base 1024) em
+ * bytes. Retorna 0 se o texto for inválido.
  */
-void external_sort_access(const char *input_filename, const char *output_filename) {
-    // Abre o arquivo de entrada
-    FILE *fp = fopen(input_filename, "r");
-    if (!fp) {
+size_t parse_memory_size(const char *text) {
+    char *suffix;
+    double value = strtod(text, &suffix);
+    if (suffix == text || value <= 0) {
+        return 0;
+    }
+    switch (*suffix) {
+        case 'T': case 't': value *= 1024.0; /* fall through */
+        case 'G': case 'g': value *= 1024.0; /* fall through */
+        case 'M': case 'm': value *= 1024.0; /* fall through */
+        case 'K': case 'k': value *= 1024.0; suffix++; break;
+        case '\0': break;
+        default: return 0;
+    }
+    if (*suffix == 'B' || *suffix == 'b') suffix++;
+    return *suffix == '\0' ? (size_t)value : 0;
+}
+
+/**
+ * Mapeia o arquivo de entrada em memória e o lê uma única vez, em blocos cujo
+ * tamanho sai do orçamento de memória. Cada bloco é dividido em faixas alinhadas
+ * em quebras de linha que são tokenizadas em paralelo por num_threads threads;
+ * cada linha alimenta ao mesmo tempo o arquivo de acesso (gravado na ordem do
+ * arquivo, com chave sequencial) e a formação de runs de produtos por seleção
+ * com substituição. A gravação dos acessos e a formação de runs acontecem em uma
+ * thread própria, em paralelo com a tokenização do bloco seguinte. Os runs são
+ * mesclados no final, em uma ou mais passadas, e products.bin é copiado em
+ * colunas para columns_filename.
+ */
+void process_input_file(const char *input_filename, const char *access_filename, const char *sessions_filename, const char *products_filename, const char *columns_filename, int num_threads, size_t memory_budget) {
+    // Abre e mapeia o arquivo de entrada
+    int fd = open(input_filename, O_RDONLY);
+    if (fd < 0) {
         perror("Não foi possível abrir o arquivo de entrada");
         exit(EXIT_FAILURE);
     }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("Não foi possível obter o tamanho do arquivo de entrada");
+        exit(EXIT_FAILURE);
+    }
+    size_t file_size = (size_t)st.st_size;
+    const char *data = NULL;
+    if (file_size > 0) {
+        data = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            perror("Falha ao mapear o arquivo de entrada em memória");
+            exit(EXIT_FAILURE);
+        }
+        madvise((void *)data, file_size, MADV_SEQUENTIAL);
+    }
 
-    // Abre o arquivo de saída
-    FILE *output_fp = fopen(output_filename, "wb");
-    if (!output_fp) {
+    // Abre o arquivo de saída dos acessos
+    FILE *access_fp = fopen(access_filename, "wb");
+    FILE *sessions_fp = fopen(sessions_filename, "wb");
+    if (!access_fp || !sessions_fp) {
         perror("Não foi possível abrir o arquivo de saída");
         exit(EXIT_FAILURE);
     }
 
-    size_t access_capacity = CHUNK_SIZE;  // Máximo de registros por chunk
-    AccessRecord *access_records = malloc(access_capacity * sizeof(AccessRecord));
-    if (!access_records) {
-        perror("Falha ao alocar memória para access_records");
+    // O cabeçalho é reservado agora e reescrito com o dicionário completo no final
+    EventTypeDictionary *event_types = calloc(1, sizeof(EventTypeDictionary));
+    if (!event_types) {
+        perror("Falha ao alocar memória para o dicionário de tipos de evento");
+        exit(EXIT_FAILURE);
+    }
+    write_access_header(access_fp, event_types);
+    StringDictionary strings;
+    string_dictionary_init(&strings);
+
+    // Um bloco de CSV rende cerca de 4x o seu tamanho em registros: 1/16 do orçamento
+    // vai para os dois blocos em uso (~1/4 em registros) e metade para a formação de runs
+    size_t block_size = memory_budget / 32;
+    if (block_size > READ_BLOCK_SIZE) block_size = READ_BLOCK_SIZE;
+    if (block_size < MIN_READ_BLOCK_SIZE) block_size = MIN_READ_BLOCK_SIZE;
+
+    // Dois blocos se alternam: enquanto um é tokenizado, o outro é consumido pela
+    // thread que grava os acessos e forma os runs
+    IngestPipeline pipeline;
+    memset(&pipeline, 0, sizeof(IngestPipeline));
+    pthread_mutex_init(&pipeline.mutex, NULL);
+    pthread_cond_init(&pipeline.cond, NULL);
+    pipeline.access_fp = access_fp;
+    pipeline.sessions_fp = sessions_fp;
+    run_builder_init(&pipeline.builder, memory_budget / 2);
+    pthread_t consumer;
+    if (pthread_create(&consumer, NULL, consume_parsed_blocks, &pipeline) != 0) {
+        perror("Falha ao criar a thread de formação de runs");
         exit(EXIT_FAILURE);
     }
 
-    char line[1024];
     long long seq_counter = 1;  // Contador de chave sequencial
+    const char *p = data;
+    const char *end = data ? data + file_size : data;
 
     // Pula a linha de cabeçalho, se presente
-    if (fgets(line, sizeof(line), fp)) {
-        if (strstr(line, "event_time") == NULL) {
-            // A primeira linha não é um cabeçalho
-            fseek(fp, 0, SEEK_SET);
+    if (p < end) {
+        const char *nl = find_newline(p, end);
+        char first_line[1024];
+        size_t len = nl - p;
+        if (len >= sizeof(first_line)) {
+            len = sizeof(first_line) - 1;
+        }
+        memcpy(first_line, p, len);
+        first_line[len] = '\0';
+        if (strstr(first_line, "event_time") != NULL) {
+            p = nl < end ? nl + 1 : end;
         }
     }
 
-    while (1) {
-        size_t access_count = 0;  // Número de registros lidos no chunk atual
-
-        // Lê um chunk de dados
-        while (access_count < access_capacity && fgets(line, sizeof(line), fp)) {
-            char *p = line;
-            int field = 0;
-            char *token;
-
-            char event_time[MAX_EVENT_TIME_LEN];
-            char event_type[MAX_EVENT_TYPE_LEN];
-            long long product_id = 0;  // Inicializa com valores padrão
-            long long user_id = 0;
-            char user_session[MAX_USER_SESSION_LEN];
-
-            // Inicializa strings
-            memset(event_time, 0, sizeof(event_time));
-            memset(event_type, 0, sizeof(event_type));
-            memset(user_session, 0, sizeof(user_session));
-
-            while (field <= 8) {
-                token = p;
-                // Encontra a próxima vírgula ou fim de linha
-                while (*p && *p != ',') p++;
-                if (*p == ',') {
-                    *p = '\0';  // Termina o campo atual
-                    p++;        // Move para o próximo caractere
-                } else if (*p == '\n' || *p == '\0') {
-                    *p = '\0';  // Termina no fim da linha
-                    p = NULL;   // Não há mais dados
-                }
+    int current = 0;
+    while (p < end) {
+        // O bloco termina logo após a primeira quebra de linha depois de block_size bytes
+        const char *block_end = end;
+        if ((size_t)(end - p) > block_size) {
+            const char *nl = find_newline(p + block_size, end);
+            block_end = nl < end ? nl + 1 : end;
+        }
 
-                // Agora token aponta para o campo atual
-                switch (field) {
-                    case 0:
-                        strncpy(event_time, token, MAX_EVENT_TIME_LEN - 1);
-                        pad_string(event_time, MAX_EVENT_TIME_LEN - 1);
-                        break;
-                    case 1:
-                        strncpy(event_type, token, MAX_EVENT_TYPE_LEN - 1);
-                        pad_string(event_type, MAX_EVENT_TYPE_LEN - 1);
-                        break;
-                    case 2:
-                        if (*token != '\0') {
-                            product_id = atoll(token);
-                        }
-                        break;
-                    case 7:
-                        if (*token != '\0') {
-                            user_id = atoll(token);
-                        }
-                        break;
-                    case 8:
-                        strncpy(user_session, token, MAX_USER_SESSION_LEN - 1);
-                        user_session[strcspn(user_session, "\n")] = '\0';
-                        pad_string(user_session, MAX_USER_SESSION_LEN - 1);
-                        break;
-                    default:
-                        break;
-                }
-                if (p == NULL) {
-                    break;  // Fim da linha alcançado
-                }
-                field++;
+        // Espera a thread consumidora liberar o bloco
+        pthread_mutex_lock(&pipeline.mutex);
+        while (pipeline.ready[current]) {
+            pthread_cond_wait(&pipeline.cond, &pipeline.mutex);
+        }
+        pthread_mutex_unlock(&pipeline.mutex);
+
+        parse_block(p, block_end, num_threads, seq_counter, event_types, &strings, &pipeline.blocks[current]);
+        seq_counter += pipeline.blocks[current].count;
+        p = block_end;
+
+        pthread_mutex_lock(&pipeline.mutex);
+        pipeline.ready[current] = 1;
+        pthread_cond_broadcast(&pipeline.cond);
+        pthread_mutex_unlock(&pipeline.mutex);
+        current ^= 1;
+    }
+
+    pthread_mutex_lock(&pipeline.mutex);
+    pipeline.done = 1;
+    pthread_cond_broadcast(&pipeline.cond);
+    pthread_mutex_unlock(&pipeline.mutex);
+    pthread_join(consumer, NULL);
+
+    run_builder_finish(&pipeline.builder);
+
+    if (data) {
+        munmap((void *)data, file_size);
+    }
+    close(fd);
+    for (int i = 0; i < 2; i++) {
+        free(pipeline.blocks[i].access_records);
+        free(pipeline.blocks[i].product_records);
+    }
+    pthread_mutex_destroy(&pipeline.mutex);
+    pthread_cond_destroy(&pipeline.cond);
+    write_access_header(access_fp, event_types);
+    fclose(access_fp);
+    fclose(sessions_fp);
+    free(event_types);
+
+    // Mescla os runs, eliminando IDs de produtos duplicados
+    char **temp_files = pipeline.builder.temp_files;
+    int temp_file_count = pipeline.builder.temp_file_count;
+    merge_product_runs(products_filename, &temp_files, &temp_file_count, memory_budget, num_threads, &strings);
+    write_product_columns(products_filename, columns_filename);
+
+    free(temp_files);
+    string_dictionary_free(&strings);
+}
+
+/**
+ * Grava products.col lendo products.bin em sequência, em blocos de
+ * COLUMN_CHUNK_RECORDS registros. As colunas reservam 25% a mais que o número
+ * de registros para que inserções não exijam reescrever o arquivo.
+ */
+void write_product_columns(const char *products_filename, const char *columns_filename) {
+    FILE *products_fp = fopen(products_filename, "rb");
+    if (!products_fp) {
+        perror("Não foi possível abrir o arquivo de produtos");
+        exit(EXIT_FAILURE);
+    }
+    Header header;
+    struct stat st;
+    if (fread(&header, sizeof(Header), 1, products_fp) != 1 || fstat(fileno(products_fp), &st) != 0 ||
+        fseeko(products_fp, header.data_offset, SEEK_SET) != 0) {
+        perror("Falha ao ler o cabeçalho do arquivo de produtos");
+        exit(EXIT_FAILURE);
+    }
+
+    ColumnHeader columns;
+    memset(&columns, 0, sizeof(ColumnHeader));
+    memcpy(columns.magic, COLUMN_FILE_MAGIC, sizeof(columns.magic));
+    columns.version = COLUMN_FILE_VERSION;
+    columns.count = (st.st_size - header.data_offset) / (long long)sizeof(ProductRecord);
+    columns.capacity = (columns.count + columns.count / 4 + 64 + 63) / 64 * 64;
+    off_t ids_offset = COLUMN_HEADER_SIZE;
+    off_t categories_offset = ids_offset + columns.capacity * (off_t)sizeof(long long);
+    off_t prices_offset = categories_offset + columns.capacity * (off_t)sizeof(long long);
+    off_t active_offset = prices_offset + columns.capacity * (off_t)sizeof(float);
+
+    int fd = open(columns_filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, active_offset + columns.capacity / 8) != 0) {
+        perror("Não foi possível criar o arquivo de colunas");
+        exit(EXIT_FAILURE);
+    }
+
+    ProductRecord *records = malloc(COLUMN_CHUNK_RECORDS * sizeof(ProductRecord));
+    long long *ids = malloc(COLUMN_CHUNK_RECORDS * sizeof(long long));
+    long long *categories = malloc(COLUMN_CHUNK_RECORDS * sizeof(long long));
+    float *prices = malloc(COLUMN_CHUNK_RECORDS * sizeof(float));
+    unsigned char *active = malloc(COLUMN_CHUNK_RECORDS / 8);
+    if (!records || !ids || !categories || !prices || !active) {
+        perror("Falha ao alocar memória para as colunas");
+        exit(EXIT_FAILURE);
+    }
+
+    // Blocos com múltiplo de 8 registros começam sempre em um byte do bitmap
+    long long first = 0;
+    size_t n;
+    while (first < columns.count &&
+           (n = fread(records, sizeof(ProductRecord), COLUMN_CHUNK_RECORDS, products_fp)) > 0) {
+        memset(active, 0, COLUMN_CHUNK_RECORDS / 8);
+        for (size_t i = 0; i < n; i++) {
+            ids[i] = records[i].product_id;
+            categories[i] = records[i].category_id;
+            prices[i] = records[i].price;
+            if (records[i].ativo) {
+                active[i / 8] |= (unsigned char)(1u << (i % 8));
             }
+        }
+        pwrite_all(fd, ids, n * sizeof(long long), ids_offset + first * (off_t)sizeof(long long));
+        pwrite_all(fd, categories, n * sizeof(long long), categories_offset + first * (off_t)sizeof(long long));
+        pwrite_all(fd, prices, n * sizeof(float), prices_offset + first * (off_t)sizeof(float));
+        pwrite_all(fd, active, (n + 7) / 8, active_offset + first / 8);
+        first += n;
+    }
+    fclose(products_fp);
+
+    columns.data.size = st.st_size;
+    columns.data.mtime_sec = st.st_mtim.tv_sec;
+    columns.data.mtime_nsec = st.st_mtim.tv_nsec;
+    pwrite_all(fd, &columns, sizeof(ColumnHeader), 0);
+    close(fd);
+
+    free(records);
+    free(ids);
+    free(categories);
+    free(prices);
+    free(active);
+}
 
-            // Atribui chave sequencial e adiciona aos registros de acesso
-            AccessRecord *access_rec = &access_records[access_count++];
-            strcpy(access_rec->event_time, event_time);
-            strcpy(access_rec->event_type, event_type);
-            access_rec->product_id = product_id;
-            access_rec->user_id = user_id;
-            strcpy(access_rec->user_session, user_session);
-            access_rec->seq_key = seq_counter++;  // Atribui chave sequencial
-            access_rec->ativo = 1;
+/**
+ * Thread consumidora da ingestão: grava os acessos de cada bloco tokenizado e
+ * alimenta a formação de runs com os seus produtos, alternando entre os dois
+ * blocos na mesma ordem em que foram produzidos.
+ */
+void *consume_parsed_blocks(void *arg) {
+    IngestPipeline *pipeline = (IngestPipeline *)arg;
+    int current = 0;
+    while (1) {
+        pthread_mutex_lock(&pipeline->mutex);
+        while (!pipeline->ready[current] && !pipeline->done) {
+            pthread_cond_wait(&pipeline->cond, &pipeline->mutex);
         }
+        int has_block = pipeline->ready[current];
+        pthread_mutex_unlock(&pipeline->mutex);
+        if (!has_block) {
+            break;  // Produtor terminou e não há mais blocos
+        }
+
+        ParsedBlock *block = &pipeline->blocks[current];
 
-        if (access_count == 0) {
-            break;  // Não há mais dados
+        // Sessões longas vão para o arquivo de sessões; o registro passa a guardar
+        // o deslocamento e o tamanho no lugar do ponteiro para o texto no CSV
+        for (size_t i = 0; i < block->count; i++) {
+            AccessRecord *record = &block->access_records[i];
+            if (record->session_kind != SESSION_OVERFLOW) {
+                continue;
+            }
+            const char *text;
+            long long len;
+            memcpy(&text, record->user_session, sizeof(text));
+            memcpy(&len, record->user_session + 8, sizeof(len));
+            if (fwrite(text, 1, len, pipeline->sessions_fp) != (size_t)len) {
+                perror("Falha ao escrever no arquivo de sessões");
+                exit(EXIT_FAILURE);
+            }
+            memcpy(record->user_session, &pipeline->sessions_size, sizeof(long long));
+            pipeline->sessions_size += len;
         }
 
-        // Escreve o chunk diretamente no arquivo de saída
-        size_t write_count = fwrite(access_records, sizeof(AccessRecord), access_count, output_fp);
-        if (write_count != access_count) {
+        // Escreve os acessos do bloco diretamente no arquivo de saída
+        size_t write_count = fwrite(block->access_records, sizeof(AccessRecord), block->count, pipeline->access_fp);
+        if (write_count != block->count) {
             perror("Falha ao escrever todos os registros de acesso no arquivo de saída");
             exit(EXIT_FAILURE);
         }
+
+        // Alimenta a formação de runs com os produtos do bloco, na ordem do arquivo
+        for (size_t i = 0; i < block->count; i++) {
+            run_builder_add(&pipeline->builder, &block->product_records[i]);
+        }
+
+        pthread_mutex_lock(&pipeline->mutex);
+        pipeline->ready[current] = 0;
+        pthread_cond_broadcast(&pipeline->cond);
+        pthread_mutex_unlock(&pipeline->mutex);
+        current ^= 1;
     }
+    return NULL;
+}
 
-    free(access_records);
-    fclose(fp);
-    fclose(output_fp);
+/**
+ * Conta as linhas de uma faixa do bloco (primeira fase do parsing paralelo).
+ * Uma última linha sem quebra de linha também é contada.
+ */
+void *count_range_lines(void *arg) {
+    ParseRange *range = (ParseRange *)arg;
+    size_t lines = count_newlines(range->begin, range->end);
+    if (range->end > range->begin && range->end[-1] != '\n') {
+        lines++;
+    }
+    range->line_count = lines;
+    return NULL;
 }
 
 /**
- * Lê o arquivo de entrada, extrai registros de produtos, assegura que não haja IDs de produtos duplicados,
- * ordena cada chunk usando Quick Sort e mescla os chunks ordenados.
+ * Tokeniza as linhas de uma faixa do bloco, gravando os registros a partir da
+ * posição first_record calculada pela soma de prefixos das contagens (segunda
+ * fase do parsing paralelo).
  */
-void external_sort_products(const char *input_filename, const char *output_filename) {
-    FILE *fp = fopen(input_filename, "r");
-    if (!fp) {
-        perror("Não foi possível abrir o arquivo de entrada");
-        exit(EXIT_FAILURE);
+void *parse_range_lines(void *arg) {
+    ParseRange *range = (ParseRange *)arg;
+    AccessRecord *access_rec = range->block->access_records + range->first_record;
+    ProductRecord *product_rec = range->block->product_records + range->first_record;
+    long long seq_key = range->first_seq_key;
+    const char *p = range->begin;
+    while (p < range->end) {
+        p = parse_line(p, range->end, range->event_types, range->strings, access_rec, product_rec);
+        access_rec->seq_key = seq_key++;  // Atribui chave sequencial na ordem do arquivo
+        access_rec++;
+        product_rec++;
     }
+    return NULL;
+}
 
-    char **temp_files = NULL;          // Array para armazenar nomes de arquivos temporários
-    int temp_file_count = 0;           // Número de arquivos temporários criados
-    size_t product_capacity = CHUNK_SIZE;
-    ProductRecord *product_records = malloc(product_capacity * sizeof(ProductRecord));
-    if (!product_records) {
-        perror("Falha ao alocar memória para product_records");
+/**
+ * Divide o intervalo [begin, end) em até num_threads faixas alinhadas em quebras
+ * de linha e tokeniza todas elas em paralelo. As chaves sequenciais começam em
+ * first_seq_key e seguem a ordem original do arquivo.
+ * Cada faixa codifica os tipos de evento em um dicionário próprio; no final eles
+ * são traduzidos para o dicionário global event_types, faixa a faixa, de modo
+ * que os códigos seguem a ordem da primeira ocorrência no arquivo qualquer que
+ * seja o número de threads. O mesmo vale para as marcas e códigos de categoria,
+ * traduzidos para o dicionário global strings.
+ */
+void parse_block(const char *begin, const char *end, int num_threads, long long first_seq_key, EventTypeDictionary *event_types, StringDictionary *strings, ParsedBlock *block) {
+    ParseRange ranges[MAX_PARSE_THREADS];
+    pthread_t threads[MAX_PARSE_THREADS];
+    size_t length = end - begin;
+
+    if (num_threads < 1) num_threads = 1;
+    if (num_threads > MAX_PARSE_THREADS) num_threads = MAX_PARSE_THREADS;
+
+    EventTypeDictionary *local_types = calloc(num_threads, sizeof(EventTypeDictionary));
+    StringDictionary *local_strings = malloc(num_threads * sizeof(StringDictionary));
+    if (!local_types || !local_strings) {
+        perror("Falha ao alocar memória para os dicionários do bloco");
         exit(EXIT_FAILURE);
     }
+    for (int t = 0; t < num_threads; t++) {
+        string_dictionary_init(&local_strings[t]);
+    }
 
-    char line[1024];
+    const char *range_begin = begin;
+    for (int t = 0; t < num_threads; t++) {
+        const char *range_end = (t == num_threads - 1) ? end : begin + length / num_threads * (t + 1);
+        if (range_end < range_begin) {
+            range_end = range_begin;
+        } else if (range_end < end) {
+            // Avança até depois da próxima quebra de linha
+            const char *nl = find_newline(range_end, end);
+            range_end = nl < end ? nl + 1 : end;
+        }
+        ranges[t].begin = range_begin;
+        ranges[t].end = range_end;
+        ranges[t].block = block;
+        ranges[t].event_types = &local_types[t];
+        ranges[t].strings = &local_strings[t];
+        range_begin = range_end;
+    }
 
-    // Pula a linha de cabeçalho, se presente
-    if (fgets(line, sizeof(line), fp)) {
-        if (strstr(line, "event_time") == NULL) {
-            // A primeira linha não é um cabeçalho
-            fseek(fp, 0, SEEK_SET);
+    // Primeira fase: contagem de linhas por faixa
+    for (int t = 0; t < num_threads; t++) {
+        if (pthread_create(&threads[t], NULL, count_range_lines, &ranges[t]) != 0) {
+            perror("Falha ao criar thread de parsing");
+            exit(EXIT_FAILURE);
         }
     }
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
 
+    // Soma de prefixos: posição e chave sequencial da primeira linha de cada faixa
+    size_t total = 0;
+    for (int t = 0; t < num_threads; t++) {
+        ranges[t].first_record = total;
+        ranges[t].first_seq_key = first_seq_key + (long long)total;
+        total += ranges[t].line_count;
+    }
 
-    while (1) {
-        size_t product_count = 0;  // Número de registros lidos no chunk atual
-
-        // Lê um chunk de dados
-        while (product_count < product_capacity && fgets(line, sizeof(line), fp)) {
-            char *p = line;
-            // Tokeniza a linha
-            char *token;
-            int field = 0;
-
-            // Inicializa variáveis
-            long long product_id = 0;
-            long long category_id = 0;
-            char category_code[MAX_CATEGORY_CODE_LEN];
-            char brand[MAX_BRAND_LEN];
-            float price = 0.0;
-
-            // Inicializa strings
-            memset(category_code, 0, sizeof(category_code));
-            memset(brand, 0, sizeof(brand));
-
-            while (field <= 6) {
-                token = p;
-                // Encontra a próxima vírgula ou fim de linha
-                while (*p && *p != ',') p++;
-                if (*p == ',') {
-                    *p = '\0';  // Termina o campo atual
-                    p++;        // Move para o próximo caractere
-                } else if (*p == '\n' || *p == '\0') {
-                    *p = '\0';  // Termina no fim da linha
-                    p = NULL;   // Não há mais dados
-                }
+    if (total > block->capacity) {
+        AccessRecord *new_access = realloc(block->access_records, total * sizeof(AccessRecord));
+        ProductRecord *new_products = realloc(block->product_records, total * sizeof(ProductRecord));
+        if (!new_access || !new_products) {
+            perror("Falha ao alocar memória para os registros do bloco");
+            exit(EXIT_FAILURE);
+        }
+        // Zera a área nova para que os bytes de alinhamento das structs sejam determinísticos
+        memset(new_access + block->capacity, 0, (total - block->capacity) * sizeof(AccessRecord));
+        memset(new_products + block->capacity, 0, (total - block->capacity) * sizeof(ProductRecord));
+        block->access_records = new_access;
+        block->product_records = new_products;
+        block->capacity = total;
+    }
+    block->count = total;
 
-                switch (field) {
-                    case 2:
-                        if (*token != '\0') {
-                            product_id = atoll(token);
-                        }
-                        break;
-                    case 3:
-                        if (*token != '\0') {
-                            category_id = atoll(token);
-                        }
-                        break;
-                    case 4:
-                        strncpy(category_code, token, MAX_CATEGORY_CODE_LEN - 1);
-                        pad_string(category_code, MAX_CATEGORY_CODE_LEN - 1);
-                        break;
-                    case 5:
-                        strncpy(brand, token, MAX_BRAND_LEN - 1);
-                        pad_string(brand, MAX_BRAND_LEN - 1);
-                        break;
-                    case 6:
-                        if (*token != '\0') {
-                            price = atof(token);
-                        }
-                        break;
-                    default:
-                        break;
-                }
-                field++;
-                if (p == NULL) {
-                    break;  // Fim da linha alcançado
-                }
+    // Segunda fase: tokenização de cada faixa em sua posição final
+    for (int t = 0; t < num_threads; t++) {
+        if (pthread_create(&threads[t], NULL, parse_range_lines, &ranges[t]) != 0) {
+            perror("Falha ao criar thread de parsing");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    // Traduz os códigos locais de cada faixa para o dicionário global
+    for (int t = 0; t < num_threads; t++) {
+        const EventTypeDictionary *local = &local_types[t];
+        unsigned char map[MAX_EVENT_TYPES];
+        int identity = 1;
+        for (unsigned int c = 0; c < local->count; c++) {
+            map[c] = event_type_code(event_types, local->names[c], strlen(local->names[c]));
+            identity &= map[c] == c;
+        }
+        if (!identity) {
+            AccessRecord *access_rec = block->access_records + ranges[t].first_record;
+            for (size_t i = 0; i < ranges[t].line_count; i++) {
+                access_rec[i].event_type = map[access_rec[i].event_type];
+            }
+        }
+
+        const StringDictionary *local_dictionary = &local_strings[t];
+        unsigned int *string_map = malloc((local_dictionary->count > 0 ? local_dictionary->count : 1) * sizeof(unsigned int));
+        if (!string_map) {
+            perror("Falha ao alocar memória para os dicionários do bloco");
+            exit(EXIT_FAILURE);
+        }
+        identity = 1;
+        for (unsigned int c = 0; c < local_dictionary->count; c++) {
+            string_map[c] = string_dictionary_code(strings, local_dictionary->entries[c], strlen(local_dictionary->entries[c]));
+            identity &= string_map[c] == c;
+        }
+        if (!identity) {
+            ProductRecord *product_rec = block->product_records + ranges[t].first_record;
+            for (size_t i = 0; i < ranges[t].line_count; i++) {
+                product_rec[i].category_code = string_map[product_rec[i].category_code];
+                product_rec[i].brand = string_map[product_rec[i].brand];
             }
+        }
+        free(string_map);
+        string_dictionary_free(&local_strings[t]);
+    }
+    free(local_types);
+    free(local_strings);
+}
 
-            // Adiciona aos registros de produtos
-            ProductRecord *product_rec = &product_records[product_count++];
-            product_rec->product_id = product_id;
-            product_rec->category_id = category_id;
-            strcpy(product_rec->category_code, category_code);
-            strcpy(product_rec->brand, brand);
-            product_rec->price = price;
-            product_rec->seq_key = 0; 
-            product_rec->ativo = 1;
-            product_rec->elo = 0;
+/**
+ * Tokeniza a linha que começa em p e grava cada campo diretamente no registro
+ * de acesso e no registro de produto correspondentes, sem cópias intermediárias.
+ * Campos ausentes recebem valores padrão. Retorna o início da próxima linha.
+ * A chave sequencial do acesso é atribuída por quem chama.
+ */
+const char *parse_line(const char *p, const char *end, EventTypeDictionary *event_types, StringDictionary *strings, AccessRecord *access_rec, ProductRecord *product_rec) {
+    int field = 0;
+    int line_done = 0;
+
+    while (!line_done) {
+        const char *token = p;
+        // Campos após o último usado são ignorados até o fim da linha
+        const char *delim = field <= 8 ? find_delimiter(p, end) : find_newline(p, end);
+        size_t len = delim - token;
+        if (delim == end || *delim == '\n') {
+            line_done = 1;
         }
+        p = delim < end ? delim + 1 : end;
+
+        switch (field) {
+            case 0:
+                access_rec->event_time = parse_event_time(token, delim);
+                break;
+            case 1:
+                access_rec->event_type = event_type_code(event_types, token, len);
+                break;
+            case 2:
+                access_rec->product_id = parse_int64(token, delim);
+                product_rec->product_id = access_rec->product_id;
+                break;
+            case 3:
+                product_rec->category_id = parse_int64(token, delim);
+                break;
+            case 4:
+                product_rec->category_code = string_dictionary_code(strings, token, len < MAX_CATEGORY_CODE_LEN - 1 ? len : MAX_CATEGORY_CODE_LEN - 1);
+                break;
+            case 5:
+                product_rec->brand = string_dictionary_code(strings, token, len < MAX_BRAND_LEN - 1 ? len : MAX_BRAND_LEN - 1);
+                break;
+            case 6:
+                product_rec->price = parse_price(token, delim);
+                break;
+            case 7:
+                access_rec->user_id = parse_int64(token, delim);
+                break;
+            case 8:
+                encode_session(access_rec, token, len);
+                break;
+            default:
+                break;
+        }
+        field++;
+    }
 
-        if (product_count == 0) {
-            break;  // Não há mais dados
+    // Linha curta: completa os campos que faltaram com valores padrão
+    for (; field <= 8; field++) {
+        switch (field) {
+            case 0: access_rec->event_time = EVENT_TIME_UNKNOWN; break;
+            case 1: access_rec->event_type = event_type_code(event_types, "", 0); break;
+            case 2: access_rec->product_id = product_rec->product_id = 0; break;
+            case 3: product_rec->category_id = 0; break;
+            case 4: product_rec->category_code = string_dictionary_code(strings, "", 0); break;
+            case 5: product_rec->brand = string_dictionary_code(strings, "", 0); break;
+            case 6: product_rec->price = 0.0f; break;
+            case 7: access_rec->user_id = 0; break;
+            case 8: encode_session(access_rec, "", 0); break;
         }
+    }
 
-        // Ordena o chunk usando Quick Sort
-        quicksort(product_records, 0, product_count - 1, sizeof(ProductRecord), compare_product_records);
+    access_rec->ativo = 1;
+    product_rec->seq_key = 0;
+    product_rec->ativo = 1;
+    product_rec->elo = 0;
+    return p;
+}
 
-        // Escreve o chunk ordenado em um arquivo temporário
-        char temp_filename[30];
-        sprintf(temp_filename, "product_temp_%d.bin", temp_file_count++);
-        FILE *temp_fp = fopen(temp_filename, "wb");
-        if (!temp_fp) {
-            perror("Não foi possível abrir o arquivo temporário");
-            exit(EXIT_FAILURE);
+/**
+ * Retorna a posição da próxima vírgula ou quebra de linha em [p, end), ou end.
+ * Compara 32 (AVX2) ou 16 (SSE2) bytes por vez quando disponível.
+ */
+const char *find_delimiter(const char *p, const char *end) {
+#if defined(__AVX2__)
+    const __m256i comma = _mm256_set1_epi8(',');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    while (end - p >= 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)p);
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, comma), _mm256_cmpeq_epi8(chunk, newline)));
+        if (mask) {
+            return p + __builtin_ctz(mask);
         }
+        p += 32;
+    }
+#elif defined(__SSE2__)
+    const __m128i comma = _mm_set1_epi8(',');
+    const __m128i newline = _mm_set1_epi8('\n');
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        unsigned mask = (unsigned)_mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, comma), _mm_cmpeq_epi8(chunk, newline)));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    while (p < end && *p != ',' && *p != '\n') p++;
+    return p;
+}
 
-        // Escreve cada registro no arquivo temporário
-        size_t write_count = fwrite(product_records, sizeof(ProductRecord), product_count, temp_fp);
-        if (write_count != product_count) {
-            perror("Falha ao escrever todos os registros de produtos no arquivo temporário");
-            exit(EXIT_FAILURE);
+/**
+ * Retorna a posição da próxima quebra de linha em [p, end), ou end.
+ */
+const char *find_newline(const char *p, const char *end) {
+#if defined(__AVX2__)
+    const __m256i newline = _mm256_set1_epi8('\n');
+    while (end - p >= 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)p);
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+#elif defined(__SSE2__)
+    const __m128i newline = _mm_set1_epi8('\n');
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+        if (mask) {
+            return p + __builtin_ctz(mask);
         }
+        p += 16;
+    }
+#endif
+    while (p < end && *p != '\n') p++;
+    return p;
+}
 
-        fclose(temp_fp);
+/**
+ * Conta as quebras de linha em [p, end).
+ */
+size_t count_newlines(const char *p, const char *end) {
+    size_t count = 0;
+#if defined(__AVX2__)
+    const __m256i newline = _mm256_set1_epi8('\n');
+    while (end - p >= 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)p);
+        count += __builtin_popcount((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline)));
+        p += 32;
+    }
+#elif defined(__SSE2__)
+    const __m128i newline = _mm_set1_epi8('\n');
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        count += __builtin_popcount((unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline)));
+        p += 16;
+    }
+#endif
+    while (p < end) {
+        count += (*p++ == '\n');
+    }
+    return count;
+}
 
-        // Mantém o controle dos arquivos temporários
-        char *temp_filename_dup = strdup(temp_filename);
-        if (!temp_filename_dup) {
-            perror("Falha ao duplicar o nome do arquivo temporário");
+/**
+ * Inicializa um dicionário de strings vazio.
+ */
+void string_dictionary_init(StringDictionary *dictionary) {
+    dictionary->count = 0;
+    dictionary->capacity = 64;
+    dictionary->slot_mask = 127;
+    dictionary->entries = malloc(dictionary->capacity * DICTIONARY_ENTRY_LEN);
+    dictionary->slots = calloc(dictionary->slot_mask + 1, sizeof(unsigned int));
+    if (!dictionary->entries || !dictionary->slots) {
+        perror("Falha ao alocar memória para o dicionário de strings");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Retorna o código de [text, text + len) no dicionário, acrescentando a string
+ * se for nova. A tabela hash dobra de tamanho quando passa da metade ocupada.
+ */
+unsigned int string_dictionary_code(StringDictionary *dictionary, const char *text, size_t len) {
+    unsigned int hash = 2166136261u;  // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+    }
+    unsigned int slot = hash & dictionary->slot_mask;
+    while (dictionary->slots[slot] != 0) {
+        const char *entry = dictionary->entries[dictionary->slots[slot] - 1];
+        if (memcmp(entry, text, len) == 0 && entry[len] == '\0') {
+            return dictionary->slots[slot] - 1;
+        }
+        slot = (slot + 1) & dictionary->slot_mask;
+    }
+
+    unsigned int code = dictionary->count++;
+    if (code == dictionary->capacity) {
+        dictionary->capacity *= 2;
+        dictionary->entries = realloc(dictionary->entries, (size_t)dictionary->capacity * DICTIONARY_ENTRY_LEN);
+        if (!dictionary->entries) {
+            perror("Falha ao alocar memória para o dicionário de strings");
             exit(EXIT_FAILURE);
         }
-        char **new_temp_files = realloc(temp_files, temp_file_count * sizeof(char *));
-        if (!new_temp_files) {
-            perror("Falha ao realocar memória para temp_files");
+    }
+    // Bytes após o terminador zerados: as entradas são gravadas como estão no arquivo
+    memset(dictionary->entries[code], 0, DICTIONARY_ENTRY_LEN);
+    memcpy(dictionary->entries[code], text, len);
+    dictionary->slots[slot] = code + 1;
+
+    if (dictionary->count * 2 > dictionary->slot_mask) {
+        unsigned int new_mask = dictionary->slot_mask * 2 + 1;
+        unsigned int *new_slots = calloc((size_t)new_mask + 1, sizeof(unsigned int));
+        if (!new_slots) {
+            perror("Falha ao alocar memória para o dicionário de strings");
             exit(EXIT_FAILURE);
         }
-        temp_files = new_temp_files;
-        temp_files[temp_file_count - 1] = temp_filename_dup;
+        for (unsigned int c = 0; c < dictionary->count; c++) {
+            unsigned int h = 2166136261u;
+            for (const char *q = dictionary->entries[c]; *q; q++) {
+                h = (h ^ (unsigned char)*q) * 16777619u;
+            }
+            unsigned int s = h & new_mask;
+            while (new_slots[s] != 0) {
+                s = (s + 1) & new_mask;
+            }
+            new_slots[s] = c + 1;
+        }
+        free(dictionary->slots);
+        dictionary->slots = new_slots;
+        dictionary->slot_mask = new_mask;
     }
+    return code;
+}
 
-    free(product_records);
-    fclose(fp);
+void string_dictionary_free(StringDictionary *dictionary) {
+    free(dictionary->entries);
+    free(dictionary->slots);
+}
 
-    // Mescla os arquivos temporários, eliminando IDs de produtos duplicados
-    merge_files(output_filename, temp_files, temp_file_count, sizeof(ProductRecord), compare_product_records, 1);
+/**
+ * Monta o início de products.bin: cabeçalho (com head_index = 0) e dicionário,
+ * com pelo menos DICTIONARY_MIN_CAPACITY entradas e o dobro das usadas, para que
+ * novas marcas e categorias possam ser inseridas sem mover os registros.
+ */
+char *build_product_file_prefix(const StringDictionary *strings, size_t *prefix_size) {
+    long long capacity = (long long)strings->count * 2;
+    if (capacity < DICTIONARY_MIN_CAPACITY) capacity = DICTIONARY_MIN_CAPACITY;
 
-    // Limpa os arquivos temporários
-    for (int i = 0; i < temp_file_count; i++) {
-        remove(temp_files[i]);
-        free(temp_files[i]);
+    Header header;
+    memset(&header, 0, sizeof(Header));
+    header.head_index = 0;
+    header.free_head = -1;
+    memcpy(header.magic, PRODUCT_FILE_MAGIC, sizeof(header.magic));
+    header.version = PRODUCT_FILE_VERSION;
+    header.record_size = sizeof(ProductRecord);
+    header.dict_count = strings->count;
+    header.dict_offset = sizeof(Header);
+    header.dict_capacity = capacity;
+    header.data_offset = header.dict_offset + capacity * DICTIONARY_ENTRY_LEN;
+
+    *prefix_size = (size_t)header.data_offset;
+    char *prefix = calloc(1, *prefix_size);
+    if (!prefix) {
+        perror("Falha ao alocar memória para o cabeçalho de produtos");
+        exit(EXIT_FAILURE);
     }
-    free(temp_files);
+    memcpy(prefix, &header, sizeof(Header));
+    memcpy(prefix + header.dict_offset, strings->entries, (size_t)strings->count * DICTIONARY_ENTRY_LEN);
+    return prefix;
 }
 
 /**
- * Mescla arquivos temporários ordenados no arquivo de saída final.
- * Se eliminate_duplicates estiver definido, registros duplicados (baseados na chave) serão ignorados.
+ * Retorna o código do tipo de evento no dicionário, acrescentando-o se for novo.
+ * Nomes mais longos que MAX_EVENT_TYPE_LEN - 1 são truncados, como no formato
+ * anterior.
  */
-void merge_files(const char *output_filename, char **temp_files, int num_temp_files, size_t record_size, int (*compare)(const void *, const void *), int eliminate_duplicates) {
-    FILE **fps = malloc(num_temp_files * sizeof(FILE *));
-    if (!fps) {
-        perror("Falha ao alocar memória para ponteiros de arquivos");
+unsigned char event_type_code(EventTypeDictionary *dictionary, const char *name, size_t len) {
+    if (len > MAX_EVENT_TYPE_LEN - 1) {
+        len = MAX_EVENT_TYPE_LEN - 1;
+    }
+    for (unsigned int c = 0; c < dictionary->count; c++) {
+        if (strncmp(dictionary->names[c], name, len) == 0 && dictionary->names[c][len] == '\0') {
+            return (unsigned char)c;
+        }
+    }
+    if (dictionary->count == MAX_EVENT_TYPES) {
+        fprintf(stderr, "Mais de %d tipos de evento distintos no arquivo de entrada\n", MAX_EVENT_TYPES);
         exit(EXIT_FAILURE);
     }
-    for (int i = 0; i < num_temp_files; i++) {
-        fps[i] = fopen(temp_files[i], "rb");
-        if (!fps[i]) {
-            perror("Não foi possível abrir o arquivo temporário para mesclagem");
-            exit(EXIT_FAILURE);
+    memcpy(dictionary->names[dictionary->count], name, len);
+    dictionary->names[dictionary->count][len] = '\0';
+    return (unsigned char)dictionary->count++;
+}
+
+/**
+ * Converte "AAAA-MM-DD HH:MM:SS" (o sufixo, como " UTC", é ignorado) em segundos
+ * desde 1970-01-01 UTC. Retorna EVENT_TIME_UNKNOWN se o campo não estiver nesse
+ * formato.
+ */
+long long parse_event_time(const char *p, const char *end) {
+    static const char pattern[] = "dddd-dd-dd dd:dd:dd";
+    if (end - p < (long)(sizeof(pattern) - 1)) {
+        return EVENT_TIME_UNKNOWN;
+    }
+    for (size_t i = 0; i < sizeof(pattern) - 1; i++) {
+        if (pattern[i] == 'd' ? (unsigned)(p[i] - '0') > 9 : p[i] != pattern[i]) {
+            return EVENT_TIME_UNKNOWN;
+        }
+    }
+    long long year = two_digits(p) * 100 + two_digits(p + 2);
+    unsigned month = two_digits(p + 5);
+    unsigned day = two_digits(p + 8);
+    int hour = two_digits(p + 11);
+    int minute = two_digits(p + 14);
+    int second = two_digits(p + 17);
+    if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 60) {
+        return EVENT_TIME_UNKNOWN;
+    }
+    return days_from_civil(year, month, day) * 86400LL + hour * 3600 + minute * 60 + second;
+}
+
+int two_digits(const char *p) {
+    return (p[0] - '0') * 10 + (p[1] - '0');
+}
+
+/**
+ * Número de dias desde 1970-01-01 no calendário gregoriano proléptico.
+ */
+long long days_from_civil(long long year, unsigned month, unsigned day) {
+    year -= month <= 2;
+    long long era = (year >= 0 ? year : year - 399) / 400;
+    unsigned year_of_era = (unsigned)(year - era * 400);
+    unsigned day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    unsigned day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return era * 146097 + (long long)day_of_era - 719468;
+}
+
+/**
+ * Codifica a sessão do usuário no registro: UUIDs em minúsculas viram 16 bytes
+ * binários, textos de até 16 bytes são guardados como estão e os demais
+ * (truncados em MAX_USER_SESSION_LEN - 1 bytes) vão para o arquivo de sessões.
+ * Nesse último caso o registro guarda, até ser gravado, o ponteiro para o texto
+ * no CSV e o seu tamanho.
+ */
+void encode_session(AccessRecord *record, const char *p, size_t len) {
+    if (len == 36 && parse_uuid(p, record->user_session)) {
+        record->session_kind = SESSION_UUID;
+    } else if (len <= SESSION_BYTES) {
+        record->session_kind = SESSION_TEXT;
+        memcpy(record->user_session, p, len);
+        memset(record->user_session + len, 0, SESSION_BYTES - len);
+    } else {
+        long long stored_len = len > MAX_USER_SESSION_LEN - 1 ? MAX_USER_SESSION_LEN - 1 : (long long)len;
+        record->session_kind = SESSION_OVERFLOW;
+        memset(record->user_session, 0, SESSION_BYTES);
+        memcpy(record->user_session, &p, sizeof(p));
+        memcpy(record->user_session + 8, &stored_len, sizeof(stored_len));
+    }
+}
+
+/**
+ * Converte um UUID no formato 8-4-4-4-12 com dígitos hexadecimais minúsculos em
+ * 16 bytes. Retorna 0 se o texto não estiver nesse formato.
+ */
+int parse_uuid(const char *p, unsigned char *out) {
+    unsigned char bytes[SESSION_BYTES];
+    int n = 0;
+    for (int i = 0; i < 36; i++) {
+        if (i == 8 || i == 13 || i == 18 || i == 23) {
+            if (p[i] != '-') return 0;
+            continue;
         }
+        int value;
+        if ((unsigned)(p[i] - '0') <= 9) value = p[i] - '0';
+        else if (p[i] >= 'a' && p[i] <= 'f') value = p[i] - 'a' + 10;
+        else return 0;
+        if (n % 2 == 0) bytes[n / 2] = (unsigned char)(value << 4);
+        else bytes[n / 2] |= (unsigned char)value;
+        n++;
     }
+    memcpy(out, bytes, SESSION_BYTES);
+    return 1;
+}
 
-    ProductRecord *record = malloc(sizeof(ProductRecord));  // Aloca um ProductRecord para trabalhar diretamente
-    if (!record) {
-        perror("Falha ao alocar memória para ProductRecord");
+/**
+ * Grava o cabeçalho de access.bin no início do arquivo com o dicionário atual de
+ * tipos de evento e volta a posição para o fim do arquivo.
+ */
+void write_access_header(FILE *fp, const EventTypeDictionary *event_types) {
+    AccessFileHeader header;
+    memset(&header, 0, sizeof(AccessFileHeader));
+    memcpy(header.magic, ACCESS_FILE_MAGIC, sizeof(header.magic));
+    header.version = ACCESS_FILE_VERSION;
+    header.event_type_count = event_types->count;
+    header.record_size = sizeof(AccessRecord);
+    memcpy(header.event_types, event_types->names, sizeof(header.event_types));
+    if (fseek(fp, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(AccessFileHeader), 1, fp) != 1 || fseek(fp, 0, SEEK_END) != 0) {
+        perror("Falha ao escrever o cabeçalho do arquivo de acessos");
         exit(EXIT_FAILURE);
     }
+}
+
+/**
+ * Converte o campo [p, end) em inteiro com a mesma semântica de atoll: ignora
+ * espaços iniciais, aceita sinal, para no primeiro caractere não numérico e
+ * satura em LLONG_MAX/LLONG_MIN se o valor não couber.
+ */
+long long parse_int64(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    int negative = 0;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+    unsigned long long limit = negative ? (unsigned long long)LLONG_MAX + 1 : (unsigned long long)LLONG_MAX;
+    unsigned long long value = 0;
+    while (p < end && (unsigned)(*p - '0') <= 9) {
+        unsigned digit = (unsigned)(*p - '0');
+        value = value > (limit - digit) / 10 ? limit : value * 10 + digit;
+        p++;
+    }
+    if (negative) {
+        return value == limit ? LLONG_MIN : -(long long)value;
+    }
+    return (long long)value;
+}
 
-    void **buffers = malloc(num_temp_files * sizeof(void *));
-    if (!buffers) {
-        perror("Falha ao alocar memória para buffers");
+/**
+ * Converte um preço do campo [p, end). O caso comum (dígitos com ponto decimal
+ * opcional, até 15 dígitos significativos) é montado como inteiro e dividido por
+ * uma potência de 10 exata, o que dá o mesmo resultado arredondado de atof;
+ * qualquer outro formato recorre a atof.
+ */
+float parse_price(const char *p, const char *end) {
+    static const double powers_of_ten[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15
+    };
+    if (p == end) {
+        return 0.0f;
+    }
+
+    const char *s = p;
+    int negative = 0;
+    if (*s == '-' || *s == '+') {
+        negative = *s == '-';
+        s++;
+    }
+    unsigned long long mantissa = 0;
+    int digits = 0;
+    int decimals = 0;
+    while (s < end && (unsigned)(*s - '0') <= 9 && digits < 15) {
+        mantissa = mantissa * 10 + (unsigned)(*s - '0');
+        s++;
+        digits++;
+    }
+    if (s < end && *s == '.') {
+        s++;
+        while (s < end && (unsigned)(*s - '0') <= 9 && digits < 15) {
+            mantissa = mantissa * 10 + (unsigned)(*s - '0');
+            s++;
+            digits++;
+            decimals++;
+        }
+    }
+    if (s == end && digits > 0) {
+        double value = (double)mantissa / powers_of_ten[decimals];
+        return (float)(negative ? -value : value);
+    }
+
+    // Formato incomum (expoente, espaços, muitos dígitos): usa atof
+    char buffer[64];
+    size_t len = end - p;
+    if (len >= sizeof(buffer)) {
+        len = sizeof(buffer) - 1;
+    }
+    memcpy(buffer, p, len);
+    buffer[len] = '\0';
+    return (float)atof(buffer);
+}
+
+/**
+ * Inicializa um conjunto de product_ids com espaço para max_keys chaves,
+ * mantendo a ocupação abaixo de 50%.
+ */
+void product_id_set_init(ProductIdSet *set, size_t max_keys) {
+    set->bits = 1;
+    while (((size_t)1 << set->bits) < 2 * max_keys) {
+        set->bits++;
+    }
+    size_t size = (size_t)1 << set->bits;
+    set->keys = malloc(size * sizeof(long long));
+    set->stamps = calloc(size, sizeof(unsigned int));
+    if (!set->keys || !set->stamps) {
+        perror("Falha ao alocar memória para o conjunto de product_ids");
         exit(EXIT_FAILURE);
     }
-    int *active = malloc(num_temp_files * sizeof(int));
-    if (!active) {
-        perror("Falha ao alocar memória para o array active");
+    set->stamp = 1;
+}
+
+/**
+ * Insere key no conjunto. Retorna 1 se a chave é nova e 0 se já estava presente.
+ */
+int product_id_set_insert(ProductIdSet *set, long long key) {
+    size_t mask = ((size_t)1 << set->bits) - 1;
+    size_t i = (size_t)(((unsigned long long)key * 0x9E3779B97F4A7C15ULL) >> (64 - set->bits));
+    while (set->stamps[i] == set->stamp) {
+        if (set->keys[i] == key) {
+            return 0;
+        }
+        i = (i + 1) & mask;
+    }
+    set->stamps[i] = set->stamp;
+    set->keys[i] = key;
+    return 1;
+}
+
+/**
+ * Remove key do conjunto, se presente, deslocando para trás as entradas
+ * seguintes da mesma sequência de sondagem.
+ */
+void product_id_set_remove(ProductIdSet *set, long long key) {
+    size_t mask = ((size_t)1 << set->bits) - 1;
+    size_t i = (size_t)(((unsigned long long)key * 0x9E3779B97F4A7C15ULL) >> (64 - set->bits));
+    while (set->stamps[i] == set->stamp && set->keys[i] != key) {
+        i = (i + 1) & mask;
+    }
+    if (set->stamps[i] != set->stamp) {
+        return;
+    }
+    size_t j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (set->stamps[j] != set->stamp) {
+            break;
+        }
+        size_t home = (size_t)(((unsigned long long)set->keys[j] * 0x9E3779B97F4A7C15ULL) >> (64 - set->bits));
+        // A entrada j pode ocupar a lacuna i se sua posição de origem não está em (i, j]
+        int in_between = (i <= j) ? (home > i && home <= j) : (home > i || home <= j);
+        if (!in_between) {
+            set->keys[i] = set->keys[j];
+            i = j;
+        }
+    }
+    set->stamps[i] = 0;
+}
+
+/**
+ * Esvazia o conjunto em O(1), trocando a geração das entradas.
+ */
+void product_id_set_clear(ProductIdSet *set) {
+    set->stamp++;
+    if (set->stamp == 0) {
+        memset(set->stamps, 0, ((size_t)1 << set->bits) * sizeof(unsigned int));
+        set->stamp = 1;
+    }
+}
+
+void product_id_set_free(ProductIdSet *set) {
+    free(set->keys);
+    free(set->stamps);
+}
+
+/**
+ * Prepara a formação de runs por seleção com substituição dentro de
+ * memory_budget bytes. Cada registro em memória custa o próprio ProductRecord,
+ * a entrada do heap, a posição livre e as entradas nos conjuntos de chaves.
+ */
+void run_builder_init(RunBuilder *builder, size_t memory_budget) {
+    size_t per_record = sizeof(ProductRecord) + sizeof(HeapEntry) + sizeof(unsigned int)
+                      + 2 * 2 * (sizeof(long long) + sizeof(unsigned int));
+    size_t capacity = memory_budget / per_record;
+    if (capacity < 1024) capacity = 1024;
+    if (capacity > 0xFFFFFFFFu) capacity = 0xFFFFFFFFu;
+
+    memset(builder, 0, sizeof(RunBuilder));
+    builder->capacity = capacity;
+    builder->slots = malloc(capacity * sizeof(ProductRecord));
+    builder->free_slots = malloc(capacity * sizeof(unsigned int));
+    builder->heap = malloc(capacity * sizeof(HeapEntry));
+    builder->write_buffer = malloc(RUN_WRITE_BUFFER * sizeof(ProductRecord));
+    if (!builder->slots || !builder->free_slots || !builder->heap || !builder->write_buffer) {
+        perror("Falha ao alocar memória para a formação de runs");
         exit(EXIT_FAILURE);
     }
-    for (int i = 0; i < num_temp_files; i++) {
-        buffers[i] = malloc(record_size);
-        if (!buffers[i]) {
-            perror("Falha ao alocar memória para o buffer");
+    for (size_t i = 0; i < capacity; i++) {
+        builder->free_slots[i] = (unsigned int)(capacity - 1 - i);
+    }
+    builder->free_count = capacity;
+    product_id_set_init(&builder->run_ids[0], capacity);
+    product_id_set_init(&builder->run_ids[1], capacity);
+    builder->run_fd = -1;
+}
+
+/**
+ * Adiciona um registro lido do CSV. Com o heap cheio, o menor registro do run
+ * atual é gravado antes, liberando espaço. O novo registro entra no run atual se
+ * sua chave não é menor que a última gravada; caso contrário fica para o próximo
+ * run. Como um registro nunca entra em um run anterior ao de uma cópia lida
+ * antes, descartar cópias de chaves já presentes no mesmo run mantém o primeiro
+ * registro de cada product_id, como a mesclagem.
+ */
+void run_builder_add(RunBuilder *builder, const ProductRecord *record) {
+    if (builder->heap_size == builder->capacity) {
+        run_builder_emit_min(builder);
+    }
+
+    unsigned int run = builder->current_run;
+    if (builder->has_output && record->product_id <= builder->last_output) {
+        if (record->product_id == builder->last_output) {
+            return;  // Duplicado de um registro já gravado neste run
+        }
+        run++;
+    }
+    if (!product_id_set_insert(&builder->run_ids[run & 1], record->product_id)) {
+        return;  // Já existe um registro com esta chave no heap para o mesmo run
+    }
+
+    unsigned int slot = builder->free_slots[--builder->free_count];
+    builder->slots[slot] = *record;
+
+    // Sobe a nova entrada até a posição correta do heap
+    HeapEntry entry = { record->product_id, builder->order++, run, slot };
+    size_t i = builder->heap_size++;
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!heap_entry_less(&entry, &builder->heap[parent])) {
+            break;
+        }
+        builder->heap[i] = builder->heap[parent];
+        i = parent;
+    }
+    builder->heap[i] = entry;
+}
+
+/**
+ * Grava os registros restantes no heap e fecha o último run.
+ */
+void run_builder_finish(RunBuilder *builder) {
+    while (builder->heap_size > 0) {
+        run_builder_emit_min(builder);
+    }
+    run_builder_close_run(builder);
+
+    free(builder->slots);
+    free(builder->free_slots);
+    free(builder->heap);
+    free(builder->write_buffer);
+    product_id_set_free(&builder->run_ids[0]);
+    product_id_set_free(&builder->run_ids[1]);
+}
+
+/**
+ * Retira o menor registro do heap e o grava no run a que pertence, abrindo um
+ * novo arquivo temporário quando o run muda.
+ */
+void run_builder_emit_min(RunBuilder *builder) {
+    HeapEntry top = builder->heap[0];
+
+    // Desce a última entrada a partir da raiz
+    HeapEntry last = builder->heap[--builder->heap_size];
+    size_t i = 0;
+    while (1) {
+        size_t child = 2 * i + 1;
+        if (child >= builder->heap_size) {
+            break;
+        }
+        if (child + 1 < builder->heap_size && heap_entry_less(&builder->heap[child + 1], &builder->heap[child])) {
+            child++;
+        }
+        if (!heap_entry_less(&builder->heap[child], &last)) {
+            break;
+        }
+        builder->heap[i] = builder->heap[child];
+        i = child;
+    }
+    if (builder->heap_size > 0) {
+        builder->heap[i] = last;
+    }
+
+    if (top.run != builder->current_run || builder->run_fd < 0) {
+        run_builder_close_run(builder);
+        builder->current_run = top.run;
+        builder->has_output = 0;
+        builder->run_fd = open(new_temp_filename(&builder->temp_files, &builder->temp_file_count),
+                               O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (builder->run_fd < 0) {
+            perror("Não foi possível abrir o arquivo temporário");
             exit(EXIT_FAILURE);
         }
-        if (fread(buffers[i], record_size, 1, fps[i]) == 1) {
-            active[i] = 1;
-        } else {
-            active[i] = 0;
+    }
+
+    product_id_set_remove(&builder->run_ids[top.run & 1], top.product_id);
+    if (builder->buffered == RUN_WRITE_BUFFER) {
+        write_all(builder->run_fd, builder->write_buffer, builder->buffered * sizeof(ProductRecord));
+        builder->buffered = 0;
+    }
+    builder->write_buffer[builder->buffered++] = builder->slots[top.slot];
+    builder->free_slots[builder->free_count++] = top.slot;
+    builder->last_output = top.product_id;
+    builder->has_output = 1;
+}
+
+/**
+ * Descarrega o buffer de escrita e fecha o arquivo do run atual, se aberto.
+ */
+void run_builder_close_run(RunBuilder *builder) {
+    if (builder->run_fd < 0) {
+        return;
+    }
+    write_all(builder->run_fd, builder->write_buffer, builder->buffered * sizeof(ProductRecord));
+    builder->buffered = 0;
+    close(builder->run_fd);
+    builder->run_fd = -1;
+}
+
+/**
+ * Ordem do heap: run, depois product_id, depois ordem de leitura.
+ */
+int heap_entry_less(const HeapEntry *a, const HeapEntry *b) {
+    if (a->run != b->run) return a->run < b->run;
+    if (a->product_id != b->product_id) return a->product_id < b->product_id;
+    return a->order < b->order;
+}
+
+/**
+ * Gera o nome do próximo arquivo temporário e o registra na lista de temporários.
+ */
+char *new_temp_filename(char ***temp_files, int *temp_file_count) {
+    char temp_filename[30];
+    sprintf(temp_filename, "product_temp_%d.bin", *temp_file_count);
+
+    // Mantém o controle dos arquivos temporários
+    char *temp_filename_dup = strdup(temp_filename);
+    if (!temp_filename_dup) {
+        perror("Falha ao duplicar o nome do arquivo temporário");
+        exit(EXIT_FAILURE);
+    }
+    char **new_temp_files = realloc(*temp_files, (*temp_file_count + 1) * sizeof(char *));
+    if (!new_temp_files) {
+        perror("Falha ao realocar memória para temp_files");
+        exit(EXIT_FAILURE);
+    }
+    *temp_files = new_temp_files;
+    (*temp_files)[(*temp_file_count)++] = temp_filename_dup;
+    return temp_filename_dup;
+}
+
+/**
+ * Mescla os runs no arquivo final. Se há mais runs do que o orçamento de memória
+ * ou o limite de descritores de arquivo permitem abrir de uma vez, grupos de
+ * runs consecutivos são mesclados em passadas intermediárias; como os grupos
+ * seguem a ordem dos runs, a eliminação de duplicatas continua mantendo o
+ * primeiro registro. A passada final é dividida em num_threads partições por
+ * faixa de chaves. Os arquivos temporários são removidos ao longo do caminho.
+ */
+void merge_product_runs(const char *output_filename, char ***temp_files, int *temp_file_count, size_t memory_budget, int num_threads, const StringDictionary *strings) {
+    // Na passada final cada partição abre todos os runs, então memória e
+    // descritores são divididos entre elas; sem descritores para ao menos dois
+    // runs e a saída por partição, usa menos partições
+    size_t descriptors = merge_descriptor_budget();
+    int partitions = num_threads > 1 ? num_threads : 1;
+    if ((size_t)partitions > descriptors / 3) {
+        partitions = descriptors / 3 > 1 ? (int)(descriptors / 3) : 1;
+    }
+    int fan_in = compute_merge_fan_in(memory_budget, descriptors, partitions);
+    char **pending = malloc((*temp_file_count > 0 ? *temp_file_count : 1) * sizeof(char *));
+    if (!pending) {
+        perror("Falha ao alocar memória para a lista de runs");
+        exit(EXIT_FAILURE);
+    }
+    int pending_count = *temp_file_count;
+    memcpy(pending, *temp_files, pending_count * sizeof(char *));
+
+    while (pending_count > fan_in) {
+        int next_count = 0;
+        for (int first = 0; first < pending_count; first += fan_in) {
+            int group = pending_count - first < fan_in ? pending_count - first : fan_in;
+            if (group == 1) {
+                pending[next_count++] = pending[first];
+                continue;
+            }
+            char *merged = new_temp_filename(temp_files, temp_file_count);
+            merge_files(merged, pending + first, group, sizeof(ProductRecord), compare_product_records, 1, NULL, 0);
+            for (int i = first; i < first + group; i++) {
+                remove(pending[i]);
+            }
+            pending[next_count++] = merged;
         }
+        pending_count = next_count;
+    }
+
+    size_t prefix_size;
+    char *prefix = build_product_file_prefix(strings, &prefix_size);
+    if (partitions > 1 && pending_count > 0) {
+        parallel_merge_files(output_filename, pending, pending_count, partitions, memory_budget, prefix, prefix_size);
+    } else {
+        merge_files(output_filename, pending, pending_count, sizeof(ProductRecord), compare_product_records, 1, prefix, prefix_size);
+    }
+    free(prefix);
+    for (int i = 0; i < pending_count; i++) {
+        remove(pending[i]);
+    }
+    free(pending);
+
+    for (int i = 0; i < *temp_file_count; i++) {
+        free((*temp_files)[i]);
+    }
+}
+
+/**
+ * Descritores que a mesclagem pode abrir: RLIMIT_NOFILE menos
+ * MERGE_RESERVED_FDS.
+ */
+size_t merge_descriptor_budget(void) {
+    size_t descriptors = 1024;
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+        descriptors = (size_t)limit.rlim_cur;
     }
+    return descriptors > MERGE_RESERVED_FDS ? descriptors - MERGE_RESERVED_FDS : 0;
+}
+
+/**
+ * Número máximo de runs mesclados por passada quando partitions mesclagens
+ * rodam ao mesmo tempo: cada uma tem um bloco de MERGE_BLOCK_SIZE por run mais
+ * o de saída dentro da sua parte do orçamento, e abre os seus runs mais um
+ * arquivo de saída dentro da sua parte de descriptors. Um limite baixo só
+ * aumenta o número de passadas.
+ */
+int compute_merge_fan_in(size_t memory_budget, size_t descriptors, int partitions) {
+    size_t by_memory = memory_budget / (size_t)partitions / MERGE_BLOCK_SIZE;
+    by_memory = by_memory > 1 ? by_memory - 1 : 1;
+
+    size_t by_files = descriptors / (size_t)partitions;
+    by_files = by_files > 1 ? by_files - 1 : 1;
 
-    FILE *output_fp = fopen(output_filename, "wb+");
-    if (!output_fp) {
+    size_t fan_in = by_memory < by_files ? by_memory : by_files;
+    if (fan_in < 2) fan_in = 2;
+    if (fan_in > 1000000) fan_in = 1000000;
+    return (int)fan_in;
+}
+
+/**
+ * Mescla arquivos temporários ordenados inteiros em output_filename, em blocos
+ * de MERGE_BLOCK_SIZE bytes.
+ * Se eliminate_duplicates estiver definido, registros duplicados (baseados na chave) serão ignorados.
+ * Se prefix não for NULL, a saída é o arquivo final: os prefix_size bytes de
+ * prefix (cabeçalho e dicionário) seguidos dos registros com chaves sequenciais
+ * e elos; caso contrário é um run intermediário.
+ */
+void merge_files(const char *output_filename, char **temp_files, int num_temp_files, size_t record_size, int (*compare)(const void *, const void *), int eliminate_duplicates, const char *prefix, size_t prefix_size) {
+    size_t block_bytes = MERGE_BLOCK_SIZE / record_size * record_size;
+    RunReader *runs = calloc(num_temp_files > 0 ? num_temp_files : 1, sizeof(RunReader));
+    if (!runs) {
+        perror("Falha ao alocar memória para a mesclagem");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < num_temp_files; i++) {
+        open_run_reader(&runs[i], temp_files[i], 0, -1, block_bytes);
+    }
+
+    int output_fd = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output_fd < 0) {
         perror("Não foi possível abrir o arquivo de saída para mesclagem");
         exit(EXIT_FAILURE);
     }
+    if (prefix != NULL) {
+        pwrite_all(output_fd, prefix, prefix_size, 0);
+        long long count = merge_runs(runs, num_temp_files, record_size, compare, output_fd, (off_t)prefix_size, block_bytes, eliminate_duplicates, 1, 1);
+        // Sem registros a lista fica vazia; todos os registros gravados formam a região ordenada
+        if (count == 0) {
+            long long head_index = -1;
+            pwrite_all(output_fd, &head_index, sizeof(head_index), offsetof(Header, head_index));
+        }
+        pwrite_all(output_fd, &count, sizeof(count), offsetof(Header, base_count));
+    } else {
+        merge_runs(runs, num_temp_files, record_size, compare, output_fd, 0, block_bytes, eliminate_duplicates, 0, 0);
+    }
+    close(output_fd);
 
-    void *last_written_record = malloc(record_size);
-    if (!last_written_record) {
-        perror("Falha ao alocar memória para last_written_record");
+    for (int i = 0; i < num_temp_files; i++) {
+        close_run_reader(&runs[i]);
+    }
+    free(runs);
+}
+
+/**
+ * Mescla as faixas de runs já abertas, gravando a saída em output_fd a partir de
+ * output_offset, usando uma árvore de perdedores (torneio): cada registro de
+ * saída custa O(log k) comparações para k runs. A saída é gravada em blocos de
+ * block_bytes bytes; com output_fd < 0 os registros só são contados. Em caso de
+ * empate, vence o run de menor índice, preservando a ordem de leitura.
+ * Se first_seq_key > 0, os registros (ProductRecord) recebem seq_key e elo
+ * sequenciais a partir dele e, se last estiver definido, o último recebe
+ * elo = -1. Retorna o número de registros gravados.
+ */
+long long merge_runs(RunReader *runs, int num_runs, size_t record_size, int (*compare)(const void *, const void *), int output_fd, off_t output_offset, size_t block_bytes, int eliminate_duplicates, long long first_seq_key, int last) {
+    size_t records_per_block = block_bytes / record_size;
+
+    MergeState merge;
+    merge.runs = runs;
+    merge.num_runs = num_runs;
+    merge.record_size = record_size;
+    merge.compare = compare;
+    merge.losers = malloc((num_runs > 0 ? num_runs : 1) * sizeof(int));
+    char *output_buffer;
+    if (!merge.losers || posix_memalign((void **)&output_buffer, BLOCK_ALIGNMENT, records_per_block * record_size) != 0) {
+        perror("Falha ao alocar memória para a mesclagem");
         exit(EXIT_FAILURE);
     }
 
-    Header header;
-    header.head_index = 0;
-    fwrite(&header, sizeof(Header), 1, output_fp); 
-    int first_record = 1;
-    long long seq_counter = 1;
-    long last_written_pos = -1;
+    size_t buffered = 0;          // Registros no buffer de saída
+    long long written = 0;
+    ProductRecord *last_written = NULL;
 
-    while (1) {
-        int min_index = -1;
-        for (int i = 0; i < num_temp_files; i++) {
-            if (active[i]) {
-                if (min_index == -1) {
-                    min_index = i;
-                } else {
-                    if (compare(buffers[i], buffers[min_index]) < 0) {
-                        min_index = i;
-                    }
+    int winner = num_runs > 0 ? build_loser_tree(&merge, 1) : -1;
+    while (winner >= 0 && runs[winner].active) {
+        RunReader *run = &runs[winner];
+        const char *current = run->buffer + run->pos * record_size;
+
+        // Elimina duplicatas se necessário
+        if (!eliminate_duplicates || last_written == NULL || compare(current, last_written) != 0) {
+            // O buffer só é descarregado quando um novo registro precisa de espaço, de modo
+            // que o último registro gravado continua nele para receber elo = -1 no final
+            if (buffered == records_per_block) {
+                if (output_fd >= 0) {
+                    pwrite_all(output_fd, output_buffer, buffered * record_size, output_offset);
+                    output_offset += buffered * record_size;
                 }
+                buffered = 0;
             }
+            ProductRecord *record = (ProductRecord *)(output_buffer + buffered * record_size);
+            memcpy(record, current, record_size);
+            if (first_seq_key > 0) {
+                record->elo = first_seq_key + written;
+                record->seq_key = first_seq_key + written;
+            }
+            written++;
+            buffered++;
+            last_written = record;
         }
 
-        if (min_index == -1) {
-            break;
+        // Avança o run vencedor e refaz as partidas até a raiz
+        run->pos++;
+        if (run->pos == run->count) {
+            refill_run(run, record_size);
         }
+        winner = replay_loser_tree(&merge, winner);
+    }
 
-        // Copia os dados do buffer para o ProductRecord diretamente
-        memcpy(record, buffers[min_index], sizeof(ProductRecord));
+    // Marca o último registro gravado como fim da lista
+    if (first_seq_key > 0 && last && last_written != NULL) {
+        last_written->elo = -1;
+    }
+    if (output_fd >= 0) {
+        pwrite_all(output_fd, output_buffer, buffered * record_size, output_offset);
+    }
 
-        // Elimina duplicatas se necessário
-        if (eliminate_duplicates) {
-            if (first_record || compare(buffers[min_index], last_written_record) != 0) {
-                record->elo = seq_counter;
-                record->seq_key = seq_counter;
-
-                // Escreve o ProductRecord diretamente no arquivo
-                last_written_pos = ftell(output_fp);
-                fwrite(record, sizeof(ProductRecord), 1, output_fp);
-                memcpy(last_written_record, record, sizeof(ProductRecord));
-                first_record = 0;
-                seq_counter++;
-            }
-        } else {
-            // Atualiza os contadores de sequência sem eliminar duplicatas
-            record->elo = seq_counter;
-            record->seq_key = seq_counter;
+    free(output_buffer);
+    free(merge.losers);
+    return written;
+}
 
-            last_written_pos = ftell(output_fp);
-            fwrite(record, sizeof(ProductRecord), 1, output_fp);
-            seq_counter++;
+/**
+ * Abre a faixa [begin, end) de um run para leitura em blocos de block_bytes
+ * bytes e carrega o primeiro bloco. end = -1 indica o fim do arquivo.
+ */
+void open_run_reader(RunReader *run, const char *filename, off_t begin, off_t end, size_t block_bytes) {
+    run->fd = open(filename, O_RDONLY);
+    if (run->fd < 0) {
+        perror("Não foi possível abrir o arquivo temporário para mesclagem");
+        exit(EXIT_FAILURE);
+    }
+    if (end < 0) {
+        struct stat st;
+        if (fstat(run->fd, &st) != 0) {
+            perror("Não foi possível obter o tamanho do arquivo temporário");
+            exit(EXIT_FAILURE);
         }
+        end = st.st_size;
+    }
+    if (posix_memalign((void **)&run->buffer, BLOCK_ALIGNMENT, block_bytes) != 0) {
+        perror("Falha ao alocar memória para o buffer");
+        exit(EXIT_FAILURE);
+    }
+    run->offset = begin;
+    run->end = end;
+    run->capacity = block_bytes;
+    refill_run(run, sizeof(ProductRecord));
+}
 
-        // Lê o próximo registro do arquivo temporário
-        if (fread(buffers[min_index], record_size, 1, fps[min_index]) == 1) {
-            active[min_index] = 1;
-        } else {
-            active[min_index] = 0;
+void close_run_reader(RunReader *run) {
+    close(run->fd);
+    free(run->buffer);
+}
+
+/**
+ * Mescla a passada final em num_partitions partições por faixa de chaves, uma
+ * por thread. Os separadores saem de uma amostra das chaves dos runs, e cada
+ * run é dividido por busca binária no arquivo; todas as cópias de uma chave
+ * caem na mesma partição, então a eliminação de duplicatas continua local. Uma
+ * primeira passada só conta os registros de cada partição; depois da soma de
+ * prefixos das contagens, cada partição é mesclada de novo direto na sua região
+ * do arquivo final, com os mesmos seq_key e elo de uma mesclagem serial. Os
+ * runs são lidos duas vezes, mas os produtos são gravados uma só vez.
+ */
+void parallel_merge_files(const char *output_filename, char **temp_files, int num_temp_files, int num_partitions, size_t memory_budget, char *prefix, size_t prefix_size) {
+    const size_t record_size = sizeof(ProductRecord);
+    long long *run_records = malloc(num_temp_files * sizeof(long long));
+    int *run_fds = malloc(num_temp_files * sizeof(int));
+    if (!run_records || !run_fds) {
+        perror("Falha ao alocar memória para a mesclagem paralela");
+        exit(EXIT_FAILURE);
+    }
+    long long total = 0;
+    for (int i = 0; i < num_temp_files; i++) {
+        run_fds[i] = open(temp_files[i], O_RDONLY);
+        struct stat st;
+        if (run_fds[i] < 0 || fstat(run_fds[i], &st) != 0) {
+            perror("Não foi possível abrir o arquivo temporário para mesclagem");
+            exit(EXIT_FAILURE);
         }
+        run_records[i] = st.st_size / record_size;
+        total += run_records[i];
     }
 
-    // Atualiza o último registro gravado, se necessário
-    if (last_written_pos != -1) {
-        fseek(output_fp, last_written_pos, SEEK_SET);
-        fread(last_written_record, record_size, 1, output_fp);
-        ProductRecord *last_record = (ProductRecord *)last_written_record;
-        last_record->elo = -1;  // Marca como o último registro
-        fseek(output_fp, last_written_pos, SEEK_SET);
-        fwrite(last_record, sizeof(ProductRecord), 1, output_fp);
+    // Amostra cerca de MERGE_SAMPLES_PER_PARTITION chaves por partição, proporcionalmente ao tamanho dos runs
+    long long wanted = (long long)MERGE_SAMPLES_PER_PARTITION * num_partitions;
+    long long *samples = malloc((wanted + num_temp_files) * sizeof(long long));
+    if (!samples) {
+        perror("Falha ao alocar memória para a amostra de chaves");
+        exit(EXIT_FAILURE);
+    }
+    long long sample_count = 0;
+    for (int i = 0; i < num_temp_files && total > 0; i++) {
+        long long n = run_records[i] * wanted / total;
+        if (n < 1) n = 1;
+        if (n > run_records[i]) n = run_records[i];
+        for (long long j = 0; j < n; j++) {
+            long long position = (2 * j + 1) * run_records[i] / (2 * n);
+            long long key;
+            if (pread(run_fds[i], &key, sizeof(key), position * record_size) != (ssize_t)sizeof(key)) {
+                perror("Falha ao ler a amostra de chaves");
+                exit(EXIT_FAILURE);
+            }
+            samples[sample_count++] = key;
+        }
+    }
+    qsort(samples, sample_count, sizeof(long long), compare_long_long);
+
+    // Separadores estritamente crescentes; chaves repetidas reduzem o número de partições
+    long long *splitters = malloc(num_partitions * sizeof(long long));
+    int num_splitters = 0;
+    for (int p = 1; p < num_partitions && sample_count > 0; p++) {
+        long long key = samples[sample_count * p / num_partitions];
+        if (num_splitters == 0 || key > splitters[num_splitters - 1]) {
+            splitters[num_splitters++] = key;
+        }
     }
+    int partitions = num_splitters + 1;
 
-    // Limpeza
-    fclose(output_fp);
-    free(last_written_record);
-    free(record);
+    // Faixa de cada run em cada partição: [lower_bound(separador anterior), lower_bound(separador))
+    MergePartition *parts = calloc(partitions, sizeof(MergePartition));
+    off_t *bounds = malloc((size_t)(partitions + 1) * num_temp_files * sizeof(off_t));
+    if (!parts || !bounds) {
+        perror("Falha ao alocar memória para as partições");
+        exit(EXIT_FAILURE);
+    }
     for (int i = 0; i < num_temp_files; i++) {
-        fclose(fps[i]);
-        free(buffers[i]);
+        bounds[i] = 0;
+        for (int s = 0; s < num_splitters; s++) {
+            bounds[(size_t)(s + 1) * num_temp_files + i] = lower_bound_in_run(run_fds[i], run_records[i], splitters[s]);
+        }
+        bounds[(size_t)partitions * num_temp_files + i] = (off_t)(run_records[i] * record_size);
+        close(run_fds[i]);
+    }
+
+    int output_fd = open(output_filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (output_fd < 0) {
+        perror("Não foi possível abrir o arquivo de saída para mesclagem");
+        exit(EXIT_FAILURE);
+    }
+
+    // Cada partição abre todos os runs: divide o orçamento entre os blocos
+    size_t block_bytes = memory_budget / ((size_t)partitions * (num_temp_files + 1));
+    if (block_bytes > MERGE_BLOCK_SIZE) block_bytes = MERGE_BLOCK_SIZE;
+    if (block_bytes < 64 * 1024) block_bytes = 64 * 1024;
+    block_bytes = block_bytes / record_size * record_size;
+
+    pthread_t *threads = malloc(partitions * sizeof(pthread_t));
+    if (!threads) {
+        perror("Falha ao alocar memória para as threads de mesclagem");
+        exit(EXIT_FAILURE);
+    }
+    for (int p = 0; p < partitions; p++) {
+        parts[p].temp_files = temp_files;
+        parts[p].num_runs = num_temp_files;
+        parts[p].begin = bounds + (size_t)p * num_temp_files;
+        parts[p].end = bounds + (size_t)(p + 1) * num_temp_files;
+        parts[p].block_bytes = block_bytes;
+        parts[p].output_fd = output_fd;
+        parts[p].data_offset = (off_t)prefix_size;
+        parts[p].counting = 1;
+        if (pthread_create(&threads[p], NULL, merge_partition, &parts[p]) != 0) {
+            perror("Falha ao criar thread de mesclagem");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int p = 0; p < partitions; p++) {
+        pthread_join(threads[p], NULL);
+    }
+
+    // Soma de prefixos: posição de cada partição no arquivo final
+    long long written = 0;
+    int last_partition = -1;
+    for (int p = 0; p < partitions; p++) {
+        parts[p].base = written;
+        written += parts[p].count;
+        if (parts[p].count > 0) {
+            last_partition = p;
+        }
+    }
+    if (last_partition >= 0) {
+        parts[last_partition].last = 1;
     }
-    free(fps);
-    free(buffers);
-    free(active);
-}
 
+    ((Header *)prefix)->head_index = written > 0 ? 0 : -1;
+    ((Header *)prefix)->base_count = written;
+    pwrite_all(output_fd, prefix, prefix_size, 0);
+    for (int p = 0; p < partitions; p++) {
+        parts[p].counting = 0;
+        if (pthread_create(&threads[p], NULL, merge_partition, &parts[p]) != 0) {
+            perror("Falha ao criar thread de mesclagem");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int p = 0; p < partitions; p++) {
+        pthread_join(threads[p], NULL);
+    }
+    close(output_fd);
+
+    free(threads);
+    free(parts);
+    free(bounds);
+    free(splitters);
+    free(samples);
+    free(run_records);
+    free(run_fds);
+}
 
+/**
+ * Retorna o deslocamento em bytes do primeiro registro do run com
+ * product_id >= key, por busca binária com leituras pontuais.
+ */
+off_t lower_bound_in_run(int fd, long long num_records, long long key) {
+    long long left = 0;
+    long long right = num_records;
+    while (left < right) {
+        long long mid = left + (right - left) / 2;
+        long long mid_key;
+        if (pread(fd, &mid_key, sizeof(mid_key), (off_t)(mid * sizeof(ProductRecord))) != (ssize_t)sizeof(mid_key)) {
+            perror("Falha ao ler o arquivo temporário");
+            exit(EXIT_FAILURE);
+        }
+        if (mid_key < key) {
+            left = mid + 1;
+        } else {
+            right = mid;
+        }
+    }
+    return (off_t)(left * sizeof(ProductRecord));
+}
 
 /**
- * Compara duas estruturas ProductRecord com base em product_id.
+ * Thread de mesclagem de uma partição. Na passada de contagem só conta os
+ * registros sem duplicatas; na seguinte grava-os direto na região da partição
+ * no arquivo final, com seq_key e elo a partir da posição global base.
  */
-int compare_product_records(const void *a, const void *b) {
-    const ProductRecord *recA = (const ProductRecord *)a;
-    const ProductRecord *recB = (const ProductRecord *)b;
+void *merge_partition(void *arg) {
+    MergePartition *part = (MergePartition *)arg;
+    RunReader *runs = calloc(part->num_runs, sizeof(RunReader));
+    if (!runs) {
+        perror("Falha ao alocar memória para a mesclagem");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < part->num_runs; i++) {
+        open_run_reader(&runs[i], part->temp_files[i], part->begin[i], part->end[i], part->block_bytes);
+    }
+    if (part->counting) {
+        part->count = merge_runs(runs, part->num_runs, sizeof(ProductRecord), compare_product_records, -1, 0, part->block_bytes, 1, 0, 0);
+    } else {
+        off_t offset = part->data_offset + (off_t)part->base * sizeof(ProductRecord);
+        merge_runs(runs, part->num_runs, sizeof(ProductRecord), compare_product_records, part->output_fd, offset, part->block_bytes, 1, part->base + 1, part->last);
+    }
+    for (int i = 0; i < part->num_runs; i++) {
+        close_run_reader(&runs[i]);
+    }
+    free(runs);
+    return NULL;
+}
 
-    if (recA->product_id < recB->product_id)
-        return -1;
-    else if (recA->product_id > recB->product_id)
-        return 1;
-    else
-        return 0;
+int compare_long_long(const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Lê o próximo bloco da faixa de um run. Marca o run como inativo quando não há
+ * mais registros.
+ */
+void refill_run(RunReader *run, size_t record_size) {
+    size_t wanted = run->capacity;
+    if ((off_t)wanted > run->end - run->offset) {
+        wanted = (size_t)(run->end - run->offset);
+    }
+    size_t filled = 0;
+    while (filled < wanted) {
+        ssize_t n = pread(run->fd, run->buffer + filled, wanted - filled, run->offset + filled);
+        if (n < 0) {
+            perror("Falha ao ler o arquivo temporário");
+            exit(EXIT_FAILURE);
+        }
+        if (n == 0) {
+            break;
+        }
+        filled += n;
+    }
+    run->offset += filled;
+    run->count = filled / record_size;
+    run->pos = 0;
+    run->active = run->count > 0;
 }
 
 /**
- * Preenche uma string com espaços para garantir que tenha tamanho fixo.
+ * Retorna diferente de zero se o registro atual do arquivo a deve sair antes do
+ * registro atual do arquivo b. Arquivos esgotados perdem sempre; empates são
+ * decididos pelo menor índice.
  */
-void pad_string(char *str, int size) {
-    int len = strlen(str);
-    for (int i = len; i < size; i++) {
-        str[i] = ' ';
+int run_precedes(const MergeState *merge, int a, int b) {
+    const RunReader *run_a = &merge->runs[a];
+    const RunReader *run_b = &merge->runs[b];
+    if (!run_a->active || !run_b->active) {
+        return run_a->active || (!run_b->active && a < b);
     }
-    str[size] = '\0';
+    int cmp = merge->compare(run_a->buffer + run_a->pos * merge->record_size,
+                             run_b->buffer + run_b->pos * merge->record_size);
+    return cmp < 0 || (cmp == 0 && a < b);
 }
 
 /**
- * Implementação do Quick Sort para ordenar um array.
- * Esta função ordena o array do índice 'left' ao 'right'.
+ * Monta recursivamente a árvore de perdedores a partir do nó node. Os nós
+ * internos são 1..k-1 e a folha do arquivo i é o nó k + i. Cada nó interno
+ * guarda o perdedor da sua partida; retorna o vencedor da subárvore.
  */
-void quicksort(void *arr, int left, int right, size_t size, int (*compare)(const void *, const void *)) {
-    if (left < right) {
-        // Particiona o array e obtém o índice do pivô
-        int pivot_index = partition(arr, left, right, size, compare);
+int build_loser_tree(MergeState *merge, int node) {
+    if (node >= merge->num_runs) {
+        return node - merge->num_runs;
+    }
+    int left = build_loser_tree(merge, 2 * node);
+    int right = build_loser_tree(merge, 2 * node + 1);
+    if (run_precedes(merge, left, right)) {
+        merge->losers[node] = right;
+        return left;
+    }
+    merge->losers[node] = left;
+    return right;
+}
 
-        // Ordena recursivamente os elementos antes e depois da partição
-        quicksort(arr, left, pivot_index - 1, size, compare);
-        quicksort(arr, pivot_index + 1, right, size, compare);
+/**
+ * Refaz as partidas do caminho entre a folha do arquivo winner e a raiz depois
+ * que o arquivo avançou para o próximo registro. Retorna o novo vencedor.
+ */
+int replay_loser_tree(MergeState *merge, int winner) {
+    for (int node = (merge->num_runs + winner) / 2; node >= 1; node /= 2) {
+        if (run_precedes(merge, merge->losers[node], winner)) {
+            int loser = winner;
+            winner = merge->losers[node];
+            merge->losers[node] = loser;
+        }
     }
+    return winner;
 }
 
 /**
- * Particiona o array e retorna o índice do pivô.
+ * Grava len bytes em fd, repetindo write até concluir.
  */
-int partition(void *arr, int left, int right, size_t size, int (*compare)(const void *, const void *)) {
-    char *array = (char *)arr;
-    void *pivot = array + right * size;  // Escolhe o último elemento como pivô
-    int i = left - 1;
+void write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            perror("Falha ao escrever no arquivo de saída");
+            exit(EXIT_FAILURE);
+        }
+        p += n;
+        len -= n;
+    }
+}
 
-    for (int j = left; j < right; j++) {
-        if (compare(array + j * size, pivot) <= 0) {
-            i++;
-            swap_records(array + i * size, array + j * size, size);
+void pwrite_all(int fd, const void *data, size_t len, off_t offset) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0) {
+            perror("Falha ao escrever no arquivo de saída");
+            exit(EXIT_FAILURE);
         }
+        p += n;
+        offset += n;
+        len -= n;
     }
-    swap_records(array + (i + 1) * size, array + right * size, size);
-    return i + 1;
 }
 
 /**
- * Troca dois registros de tamanho 'size'.
+ * Compara duas estruturas ProductRecord com base em product_id.
  */
-void swap_records(void *a, void *b, size_t size) {
-    // Usa um buffer estático para evitar malloc/free frequentes
-    char temp[sizeof(ProductRecord) > sizeof(AccessRecord) ? sizeof(ProductRecord) : sizeof(AccessRecord)];
+int compare_product_records(const void *a, const void *b) {
+    const ProductRecord *recA = (const ProductRecord *)a;
+    const ProductRecord *recB = (const ProductRecord *)b;
 
-    memcpy(temp, a, size);
-    memcpy(a, b, size);
-    memcpy(b, temp, size);
-}
\ No newline at end of file
+    if (recA->product_id < recB->product_id)
+        return -1;
+    else if (recA->product_id > recB->product_id)
+        return 1;
+    else
+        return 0;
+}
@@ -1,6 +1,20 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <float.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 #define MAX_CATEGORY_CODE_LEN 64
 #define MAX_BRAND_LEN 32
@@ -11,478 +25,4892 @@
 
 #define INDEX_FILE_NAME "products.idx"
 #define RECORDS_PER_INDEX 100000  
+#define INDEX_MAGIC "PIDX"
+#define INDEX_MIN_SPAN (RECORDS_PER_INDEX / 2)
+#define INDEX_CHECK_INTERVAL_NS 10000000LL
+#define INDEX_MAX_SPAN (RECORDS_PER_INDEX * 2)
+
+#define PRODUCT_FILE_MAGIC "PRDS"
+#define PRODUCT_FILE_VERSION 5
+#define DICTIONARY_ENTRY_LEN MAX_CATEGORY_CODE_LEN
+#define DICTIONARY_MIN_CAPACITY 1024
+#define FREE_SLOT_SCAN 32
+#define COMPACT_FREE_PERCENT 10     // O exemplo so compacta com ao menos 10% de posicoes livres
+#define BASE_INTERPOLATION_MIN 64
+#define DELTA_MERGE_MIN 4096        // Posicoes fora da regiao base antes de pensar em compactar
+#define DELTA_MERGE_FRACTION 8      // ... e a fracao de base_count que elas podem ocupar
+
+#define BPT_FILE_NAME "products.bpt"
+#define BPT_MAGIC "BPT1"
+#define BPT_PAGE_SIZE POOL_PAGE_SIZE
+#define BPT_MAX_KEYS 254
+#define BPT_MAX_DEPTH 16
+#define TREE_MAX_KEY_SIZE 32        // Maior key_size de um TreeLayout
+
+#define CATEGORY_INDEX_FILE_NAME "products_category.sidx"
+#define BRAND_INDEX_FILE_NAME "products_brand.sidx"
+#define SIDX_MAGIC "SDX1"
+#define SIDX_MAX_KEYS 126
+#define SIDX_POOL_FRAMES 128
+
+#define COLUMN_FILE_NAME "products.col"
+#define COLUMN_FILE_MAGIC "PCOL"
+#define COLUMN_FILE_VERSION 1
+#define COLUMN_HEADER_SIZE 64
+#define COLUMN_BLOCK 8192
+#define COLUMN_POOL_FRAMES 64
+
+#define BLOOM_FILE_NAME "products.bloom"
+#define BLOOM_MAGIC "PBLM"
+#define BLOOM_HEADER_SIZE 64
+#define BLOOM_BLOCK_WORDS 8
+#define BLOOM_KEYS_PER_BLOCK 16
+#define BLOOM_POOL_FRAMES 64
+
+#define POOL_PAGE_SIZE 4096
+#define POOL_MAPPED 1
+#define POOL_DEFERRED 2
+#define POOL_MAP_EXTENT (1 << 20)
+#define DATA_POOL_FRAMES 256
+#define TREE_POOL_FRAMES 256
+#define INDEX_POOL_FRAMES 16
+
+#define WAL_FILE_NAME "products.wal"
+#define LOCK_FILE_NAME "products.lock"
+#define WAL_START 1
+#define WAL_WRITE 2
+#define WAL_COMMIT 3
+#define WAL_GROUP_COMMITS 64
+#define WAL_GROUP_BYTES (1 << 20)
+#define WAL_CHECKPOINT_PAGES 2048
+#define PUBLISH_DELAY_NS 50000000LL  // Atraso maximo entre um commit e a sua publicacao
+#define WAL_CHECKSUM_SEED 14695981039346656037ull
+
+#define STORAGE_BUFFERED 0
+#define STORAGE_MAPPED 1
+#ifndef STORAGE_MODE
+#define STORAGE_MODE STORAGE_BUFFERED
+
+#define DEMO_READER_PAGES 2         // Paginas lidas por cada leitor do exemplo
+#define DEMO_READER_LOOKUPS 3       // Produtos de cada pagina conferidos com find_product
+#endif
 
 typedef struct {
     long long head_index;
+    char magic[4];
+    unsigned int version;
+    unsigned int record_size;
+    unsigned int dict_count;
+    long long dict_offset;
+    long long dict_capacity;
+    long long data_offset;
+    long long free_head;
+    long long base_count;       // Posicoes [0, base_count) em ordem crescente de product_id
+    long long base_free;        // Posicoes inativas em [0, base_count), fora da lista livre
 } Header;
 
 typedef struct {
     long long product_id;
     long long category_id;
-    char category_code[MAX_CATEGORY_CODE_LEN];
-    char brand[MAX_BRAND_LEN];
     float price;
+    unsigned int category_code;
+    unsigned int brand;
     int ativo;
     long long seq_key;
     long long elo;
 } ProductRecord;
 
+/*
+ * Tamanho e data de modificacao de products.bin, guardados pelos arquivos
+ * derivados para detectar alteracoes feitas por fora.
+ */
+typedef struct {
+    long long size;
+    long long mtime_sec;
+    long long mtime_nsec;
+} DataStamp;
+
+typedef struct {
+    char magic[4];
+    int reserved;
+    long long root;
+    long long page_count;
+    DataStamp data;
+} BPTreeMeta;
+
+/*
+ * Inicio de todo no de arvore B+ em disco. Depois dele vem max_keys chaves e
+ * max_keys + 1 values, no formato do TreeLayout da arvore.
+ */
+typedef struct {
+    int is_leaf;
+    int count;
+    long long next;
+    long long prev;
+} TreeNodeHeader;
+
+/*
+ * Formato dos nos de uma arvore para as rotinas tree_*: chaves de key_size
+ * bytes, ate max_keys por no, ordenadas por compare.
+ */
+typedef struct {
+    size_t key_size;
+    int max_keys;
+    int (*compare)(const void *a, const void *b);
+} TreeLayout;
+
+typedef union {
+    TreeNodeHeader header;
+    long long words[BPT_PAGE_SIZE / sizeof(long long)];
+} TreePage;
+
+/*
+ * No da arvore B+ (uma pagina). Nas folhas, values guarda o indice do registro
+ * de cada chave e next/prev ligam as folhas vizinhas; nos nos internos, values
+ * guarda as count + 1 paginas filhas.
+ */
+typedef struct {
+    int is_leaf;
+    int count;
+    long long next;
+    long long prev;
+    long long keys[BPT_MAX_KEYS];
+    long long values[BPT_MAX_KEYS + 1];
+} BPTreeNode;
+
+/*
+ * Registro do log de escrita antecipada (products.wal). WAL_WRITE e seguido
+ * dos length bytes gravados em offset de products.bin; WAL_COMMIT fecha a
+ * transacao com a soma de verificacao dos seus registros WAL_WRITE; WAL_START
+ * abre o log depois de cada publicacao (ver storage_publish).
+ */
+typedef struct {
+    unsigned int type;
+    unsigned int length;
+    long long offset;           // WAL_START e WAL_COMMIT: tamanho de products.bin
+    unsigned long long checksum;
+} WalRecord;
+
+typedef struct {
+    int fd;
+    char *buffer;               // Registros ainda nao gravados no log
+    size_t used;
+    size_t capacity;
+    int in_transaction;
+    unsigned long long checksum; // Da transacao aberta
+    int unsynced_commits;       // Transacoes confirmadas desde o ultimo fsync
+} WriteAheadLog;
+
+/*
+ * Estado compartilhado entre os processos (products.lock, mapeado). version
+ * fica impar enquanto um escritor publica as suas paginas; leitores comparam
+ * a versao do inicio e do fim de cada leitura.
+ */
+typedef struct {
+    unsigned long long version;
+    int writers_waiting;
+} SharedState;
+
+typedef struct {
+    SharedState *shared;
+    unsigned long long version; // Versao publicada que o handle enxerga
+    int valid;                  // O estado dessa versao foi carregado
+} Snapshot;
+
+typedef struct {
+    long long page;             // Pagina carregada no quadro (-1 se livre)
+    int dirty;
+    int referenced;
+    int next;                   // Proximo quadro na mesma lista da tabela hash
+    char *data;
+} Frame;
+
+typedef struct {
+    int fd;
+    Frame *frames;
+    char *memory;
+    int frame_count;
+    int clock_hand;
+    int *buckets;
+    int bucket_mask;
+    long long file_size;        // Tamanho logico, incluindo paginas ainda nao gravadas
+    int mapped;                 // Modo mmap: o arquivo inteiro mapeado, sem quadros
+    char *map;
+    long long map_capacity;
+    int advice;
+    int deferred;               // Escritas ficam em paginas pendentes ate pool_checkpoint
+    long long stable_size;      // Bytes do arquivo validos para este pool (ver pool_truncate)
+    WriteAheadLog *wal;         // Se houver, as escritas adiadas tambem vao para o log
+    const Snapshot *snapshot;   // Num leitor, leituras falham se a versao mudar
+    long long *pending_pages;   // Tabela hash com enderecamento aberto (-1 se livre)
+    char **pending_data;
+    int pending_mask;
+    int pending_count;
+} BufferPool;
+
+typedef struct {
+    BufferPool *pool;
+    BPTreeMeta meta;
+    const TreeLayout *layout;
+} BPTree;
+
+/*
+ * Chave dos indices secundarios: (group, price, slot), comparada nessa ordem.
+ * group e o category_id ou o codigo da marca; price guarda os bits do preco
+ * convertidos para que a ordem dos inteiros siga a dos floats. payload nao
+ * entra na comparacao: no indice por categoria guarda o codigo da marca, para
+ * filtrar por marca sem ler o registro.
+ */
+typedef struct {
+    long long group;
+    unsigned int price;
+    unsigned int payload;
+    long long slot;
+} SecondaryKey;
+
+/*
+ * No de um indice secundario (uma pagina), com a mesma organizacao de
+ * BPTreeNode. As folhas nao usam values: o slot ja esta na chave.
+ */
+typedef struct {
+    int is_leaf;
+    int count;
+    long long next;
+    long long prev;
+    SecondaryKey keys[SIDX_MAX_KEYS];
+    long long values[SIDX_MAX_KEYS + 1];
+} SecondaryNode;
+
+typedef struct {
+    BPTree btree;
+    int by_brand;               // 0: agrupado por category_id; 1: pela marca
+} SecondaryTree;
+
+
+typedef struct {
+    long long product_id;
+    long long category_id;
+    char category_code[MAX_CATEGORY_CODE_LEN];
+    char brand[MAX_BRAND_LEN];
+    float price;
+    int ativo;
+} ProductEntry;
+
 typedef struct {
     long long product_id;
     long long record_index;
+    long long count;            // Produtos ativos de record_index ate a proxima entrada
 } IndexRecord;
 
+/*
+ * Cabecalho de products.idx, seguido de entry_count entradas IndexRecord.
+ */
+typedef struct {
+    char magic[4];
+    int records_per_index;
+    long long entry_count;
+    DataStamp data;
+} IndexHeader;
 
-void initialize_file() {
-    FILE *fp = fopen(ORIGINAL_FILE_NAME, "rb");
-    if (fp == NULL) {
-        fp = fopen(ORIGINAL_FILE_NAME, "wb");
-        Header header;
-        header.head_index = -1;
-        fwrite(&header, sizeof(Header), 1, fp);
-        fclose(fp);
+/*
+ * Cabecalho de products.col, a copia em colunas de products.bin gerada por
+ * gerar_arquivos: um elemento por posicao de registro. A partir de
+ * COLUMN_HEADER_SIZE vem as colunas product_id, category_id e price, cada uma
+ * com capacity elementos, e o bitmap de registros ativos.
+ */
+typedef struct {
+    char magic[4];
+    unsigned int version;
+    long long count;
+    long long capacity;         // Multiplo de 64
+    DataStamp data;
+} ColumnHeader;
+
+/*
+ * Cabecalho de products.bloom, seguido de block_count blocos de
+ * BLOOM_BLOCK_WORDS palavras de 32 bits a partir de BLOOM_HEADER_SIZE.
+ */
+typedef struct {
+    char magic[4];
+    int reserved;
+    long long block_count;
+    long long key_count;        // Chaves acrescentadas desde a ultima reconstrucao
+    long long removed;          // Remocoes desde a ultima reconstrucao
+    DataStamp data;
+} BloomHeader;
+
+#define COLUMN_PRODUCT_ID 0
+#define COLUMN_CATEGORY_ID 1
+#define COLUMN_PRICE 2
+#define COLUMN_ACTIVE 3
+
+/*
+ * Copia do indice parcial em memoria. As chaves ficam em um vetor proprio na
+ * ordem de Eytzinger (em largura: os filhos de k estao em 2k e 2k + 1), para
+ * que a busca desca tocando poucas linhas de cache; os demais campos ficam em
+ * entries, na ordem do arquivo. rank_tree e uma arvore de Fenwick sobre os
+ * contadores das entradas, usada para achar a entrada que contem o n-esimo
+ * produto ativo.
+ */
+typedef struct {
+    long long *keys;            // Posicoes 1..count
+    long long *ranks;           // Posicao em entries de cada chave de keys
+    IndexRecord *entries;
+    long long *rank_tree;       // Posicoes 1..count
+    long long count;
+    long long checked_at;       // Ultima verificacao do arquivo (CLOCK_MONOTONIC, ns)
+    DataStamp file;             // Estado de products.idx quando foi carregado
+    int valid;
+} IndexCache;
+
+/*
+ * Posicao de continuacao da listagem pelos elos: o proximo registro a exibir.
+ * record_index == -1 indica que nao ha mais paginas.
+ */
+typedef struct {
+    long long product_id;
+    long long record_index;
+} PageCursor;
+
+/*
+ * Produtos ativos das posicoes a partir de base_count (inseridos depois da
+ * geracao ou da ultima compactacao), em ordem de product_id.
+ */
+typedef struct {
+    long long product_id;
+    long long slot;
+} DeltaEntry;
+
+typedef struct {
+    DeltaEntry *entries;
+    long long count;
+    long long capacity;
+} DeltaIndex;
+
+/*
+ * Posicao de sorted_next: a proxima posicao da regiao base e a proxima
+ * entrada do delta.
+ */
+typedef struct {
+    long long base;
+    long long delta;
+} SortedCursor;
+
+/*
+ * Handle de longa duracao para products.bin e seus arquivos derivados: o
+ * cabecalho fica em memoria e cada arquivo tem o seu pool de buffers.
+ */
+typedef struct {
+    BufferPool data;
+    WriteAheadLog wal;
+    int pool_flags;
+    int lock_fd;
+    SharedState *shared;
+    pthread_mutex_t writer;     // Serializa escritas, leituras e publicacoes do handle
+    int lease;                  // Este processo tem o lock de escrita de products.lock
+    int reader;                 // Handle so de leitura (ver storage_open_reader)
+    pthread_t publisher;        // Ver storage_publisher
+    pthread_cond_t publish_wake;
+    long long publish_due;      // Prazo da proxima publicacao (CLOCK_MONOTONIC, ns; 0 se nenhum)
+    int publisher_running;
+    int closing;                // storage_close pediu o fim da thread publicadora
+    Snapshot snapshot;
+    Header header;
+    DeltaIndex delta;
+    BufferPool tree_pages;
+    BPTree tree;
+    BufferPool index;
+    IndexHeader index_header;
+    IndexCache index_cache;
+    BufferPool category_pages;
+    SecondaryTree category_tree;
+    BufferPool brand_pages;
+    SecondaryTree brand_tree;
+    BufferPool columns;
+    ColumnHeader column_header;
+    BufferPool bloom;
+    BloomHeader bloom_header;
+} Storage;
+
+/*
+ * Filtro de query_products: category_id (-1 para qualquer categoria), marca
+ * (NULL para qualquer uma) e faixa de preco inclusiva. Pelo menos um dos dois
+ * primeiros deve ser informado.
+ */
+typedef struct {
+    long long category_id;
+    const char *brand;
+    float min_price;
+    float max_price;
+} ProductFilter;
+
+/*
+ * Continuacao de query_products: a proxima chave a examinar. Deve ser zerado
+ * antes da primeira pagina.
+ */
+typedef struct {
+    SecondaryKey next;
+    int started;
+    int done;
+} QueryCursor;
+
+
+unsigned long long wal_checksum(unsigned long long hash, const void *data, size_t length) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+/*
+ * Grava no log os registros acumulados no buffer, sem fsync.
+ */
+int wal_write_out(WriteAheadLog *wal) {
+    size_t done = 0;
+    while (done < wal->used) {
+        ssize_t n = write(wal->fd, wal->buffer + done, wal->used - done);
+        if (n <= 0) {
+            perror("Erro ao gravar o log de escrita antecipada");
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    wal->used = 0;
+    return 0;
+}
+
+int wal_put(WriteAheadLog *wal, const void *data, size_t length) {
+    // Uma transacao grande vai para o arquivo aos poucos; sem o WAL_COMMIT ela
+    // e ignorada na recuperacao
+    if (wal->used + length > wal->capacity && wal->used >= WAL_GROUP_BYTES && wal_write_out(wal) != 0) {
+        return -1;
+    }
+    if (wal->used + length > wal->capacity) {
+        size_t capacity = wal->capacity > 0 ? wal->capacity : 4096;
+        while (capacity < wal->used + length) {
+            capacity *= 2;
+        }
+        char *buffer = realloc(wal->buffer, capacity);
+        if (buffer == NULL) {
+            perror("Erro ao alocar o buffer do log");
+            exit(EXIT_FAILURE);
+        }
+        wal->buffer = buffer;
+        wal->capacity = capacity;
+    }
+    memcpy(wal->buffer + wal->used, data, length);
+    wal->used += length;
+    return 0;
+}
+
+/*
+ * Acrescenta a escrita de length bytes em offset a transacao aberta, abrindo
+ * uma se necessario.
+ */
+int wal_append(WriteAheadLog *wal, long long offset, const void *data, size_t length) {
+    WalRecord record = {WAL_WRITE, (unsigned int)length, offset, 0};
+    if (!wal->in_transaction) {
+        wal->in_transaction = 1;
+        wal->checksum = WAL_CHECKSUM_SEED;
+    }
+    wal->checksum = wal_checksum(wal->checksum, &record, sizeof(WalRecord));
+    wal->checksum = wal_checksum(wal->checksum, data, length);
+    if (wal_put(wal, &record, sizeof(WalRecord)) != 0) {
+        return -1;
+    }
+    return wal_put(wal, data, length);
+}
+
+/*
+ * Fecha a transacao aberta. O WAL_COMMIT fica no buffer ate o proximo
+ * wal_sync: as transacoes sao confirmadas no disco em grupo.
+ */
+int wal_end_transaction(WriteAheadLog *wal, long long file_size) {
+    if (!wal->in_transaction) {
+        return 0;
+    }
+    WalRecord record = {WAL_COMMIT, 0, file_size, wal->checksum};
+    wal->in_transaction = 0;
+    wal->unsynced_commits++;
+    return wal_put(wal, &record, sizeof(WalRecord));
+}
+
+/*
+ * Grava o buffer e faz um unico fsync para todas as transacoes confirmadas
+ * desde o anterior.
+ */
+int wal_sync(WriteAheadLog *wal) {
+    if (wal->used > 0 && wal_write_out(wal) != 0) {
+        return -1;
+    }
+    if (wal->unsynced_commits > 0) {
+        if (fdatasync(wal->fd) != 0) {
+            perror("Erro ao sincronizar o log de escrita antecipada");
+            return -1;
+        }
+        wal->unsynced_commits = 0;
+    }
+    return 0;
+}
+
+/*
+ * Reinicia o log depois de uma publicacao, deixando so o WAL_START com o
+ * tamanho atual de products.bin. O registro antigo e sobrescrito antes do
+ * corte: uma queda no meio so faz reaplicar transacoes ja gravadas.
+ */
+int wal_restart(WriteAheadLog *wal, long long file_size) {
+    WalRecord record = {WAL_START, 0, file_size, 0};
+    if (pwrite(wal->fd, &record, sizeof(WalRecord), 0) != (ssize_t)sizeof(WalRecord) ||
+        ftruncate(wal->fd, sizeof(WalRecord)) != 0 ||
+        lseek(wal->fd, sizeof(WalRecord), SEEK_SET) < 0 ||
+        fdatasync(wal->fd) != 0) {
+        perror("Erro ao reiniciar o log de escrita antecipada");
+        return -1;
+    }
+    wal->used = 0;
+    return 0;
+}
+
+/*
+ * Pool de buffers de um arquivo: quadros de POOL_PAGE_SIZE bytes com
+ * substituicao CLOCK e escrita adiada das paginas alteradas, que so vao para o
+ * arquivo quando o quadro e substituido ou em pool_flush. Todas as leituras e
+ * escritas de registros passam por aqui. Com POOL_MAPPED, o arquivo e
+ * mapeado com mmap e os quadros nao sao usados; com POOL_DEFERRED, as
+ * escritas ficam em paginas pendentes e o arquivo so muda em pool_checkpoint.
+ */
+int pool_open(BufferPool *pool, const char *filename, int frame_count, int flags) {
+    int mapped = (flags & POOL_MAPPED) != 0;
+    pool->fd = open(filename, O_RDWR | O_CREAT, 0644);
+    if (pool->fd < 0) {
+        perror("Erro ao abrir o arquivo do pool de buffers");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(pool->fd, &st) != 0) {
+        perror("Erro ao obter o tamanho do arquivo");
+        close(pool->fd);
+        return -1;
+    }
+    pool->file_size = st.st_size;
+    pool->mapped = mapped;
+    pool->map = NULL;
+    pool->map_capacity = 0;
+    pool->advice = MADV_RANDOM;
+    pool->deferred = (flags & POOL_DEFERRED) != 0;
+    pool->stable_size = pool->file_size;
+    pool->wal = NULL;
+    pool->snapshot = NULL;
+    pool->pending_pages = NULL;
+    pool->pending_data = NULL;
+    pool->pending_mask = -1;
+    pool->pending_count = 0;
+    if (mapped) {
+        pool->frame_count = 0;
+        pool->frames = NULL;
+        pool->memory = NULL;
+        pool->buckets = NULL;
+        pool->bucket_mask = -1;
+        if (pool->file_size > 0) {
+            pool->map = mmap(NULL, pool->file_size, PROT_READ | PROT_WRITE, MAP_SHARED, pool->fd, 0);
+            if (pool->map == MAP_FAILED) {
+                perror("Erro ao mapear o arquivo");
+                close(pool->fd);
+                return -1;
+            }
+            pool->map_capacity = pool->file_size;
+            madvise(pool->map, pool->map_capacity, pool->advice);
+        }
+        return 0;
+    }
+    pool->frame_count = frame_count > 0 ? frame_count : 1;
+    pool->clock_hand = 0;
+    pool->bucket_mask = 1;
+    while (pool->bucket_mask < 2 * pool->frame_count) {
+        pool->bucket_mask *= 2;
+    }
+    pool->buckets = malloc(pool->bucket_mask * sizeof(int));
+    pool->bucket_mask--;
+    pool->frames = calloc(pool->frame_count, sizeof(Frame));
+    pool->memory = malloc((size_t)pool->frame_count * POOL_PAGE_SIZE);
+    if (pool->buckets == NULL || pool->frames == NULL || pool->memory == NULL) {
+        perror("Erro ao alocar o pool de buffers");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i <= pool->bucket_mask; i++) {
+        pool->buckets[i] = -1;
+    }
+    for (int i = 0; i < pool->frame_count; i++) {
+        pool->frames[i].page = -1;
+        pool->frames[i].next = -1;
+        pool->frames[i].data = pool->memory + (size_t)i * POOL_PAGE_SIZE;
+    }
+    return 0;
+}
+
+int pool_bucket(const BufferPool *pool, long long page) {
+    return (int)(((unsigned long long)page * 11400714819323198485ull) >> 40) & pool->bucket_mask;
+}
+
+/*
+ * Grava a pagina do quadro no arquivo, sem passar do tamanho logico.
+ */
+int pool_write_back(BufferPool *pool, Frame *frame) {
+    long long offset = frame->page * POOL_PAGE_SIZE;
+    long long length = pool->file_size - offset;
+    if (length > POOL_PAGE_SIZE) length = POOL_PAGE_SIZE;
+    if (length > 0 && pwrite(pool->fd, frame->data, (size_t)length, offset) != (ssize_t)length) {
+        perror("Erro ao gravar pagina do pool de buffers");
+        return -1;
+    }
+    frame->dirty = 0;
+    return 0;
+}
+
+/*
+ * Retorna o quadro com a pagina, lendo-a do arquivo se necessario. A vitima e
+ * escolhida pelo algoritmo CLOCK: quadros com o bit de referencia ligado ganham
+ * uma segunda chance.
+ */
+Frame *pool_fetch(BufferPool *pool, long long page) {
+    int bucket = pool_bucket(pool, page);
+    for (int i = pool->buckets[bucket]; i != -1; i = pool->frames[i].next) {
+        if (pool->frames[i].page == page) {
+            pool->frames[i].referenced = 1;
+            return &pool->frames[i];
+        }
+    }
+
+    int victim;
+    while (1) {
+        victim = pool->clock_hand;
+        pool->clock_hand = (pool->clock_hand + 1) % pool->frame_count;
+        Frame *candidate = &pool->frames[victim];
+        if (candidate->page == -1 || !candidate->referenced) {
+            break;
+        }
+        candidate->referenced = 0;
+    }
+
+    Frame *frame = &pool->frames[victim];
+    if (frame->page != -1) {
+        if (frame->dirty) {
+            pool_write_back(pool, frame);
+        }
+        int *link = &pool->buckets[pool_bucket(pool, frame->page)];
+        while (*link != victim) {
+            link = &pool->frames[*link].next;
+        }
+        *link = frame->next;
+    }
+
+    ssize_t n = pread(pool->fd, frame->data, POOL_PAGE_SIZE, page * POOL_PAGE_SIZE);
+    if (n < 0) {
+        n = 0;
+    }
+    memset(frame->data + n, 0, POOL_PAGE_SIZE - n);
+    frame->page = page;
+    frame->dirty = 0;
+    frame->referenced = 1;
+    frame->next = pool->buckets[bucket];
+    pool->buckets[bucket] = victim;
+    return frame;
+}
+
+/*
+ * Retorna a copia pendente da pagina (alterada desde o ultimo checkpoint), ou
+ * NULL. Com create, a copia e criada com o conteudo atual do arquivo.
+ */
+char *pool_pending(BufferPool *pool, long long page, int create) {
+    int slot = -1;
+    if (pool->pending_mask >= 0) {
+        slot = (int)(((unsigned long long)page * 11400714819323198485ull) >> 40) & pool->pending_mask;
+        while (pool->pending_pages[slot] != -1) {
+            if (pool->pending_pages[slot] == page) {
+                return pool->pending_data[slot];
+            }
+            slot = (slot + 1) & pool->pending_mask;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    if (2 * (pool->pending_count + 1) > pool->pending_mask + 1) {
+        // Dobra a tabela e reinsere as paginas
+        int old_mask = pool->pending_mask;
+        long long *old_pages = pool->pending_pages;
+        char **old_data = pool->pending_data;
+        pool->pending_mask = old_mask < 0 ? 63 : 2 * old_mask + 1;
+        pool->pending_pages = malloc((size_t)(pool->pending_mask + 1) * sizeof(long long));
+        pool->pending_data = malloc((size_t)(pool->pending_mask + 1) * sizeof(char *));
+        if (pool->pending_pages == NULL || pool->pending_data == NULL) {
+            perror("Erro ao alocar as paginas pendentes");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i <= pool->pending_mask; i++) {
+            pool->pending_pages[i] = -1;
+        }
+        for (int i = 0; i <= old_mask; i++) {
+            if (old_pages[i] == -1) {
+                continue;
+            }
+            int j = (int)(((unsigned long long)old_pages[i] * 11400714819323198485ull) >> 40) & pool->pending_mask;
+            while (pool->pending_pages[j] != -1) {
+                j = (j + 1) & pool->pending_mask;
+            }
+            pool->pending_pages[j] = old_pages[i];
+            pool->pending_data[j] = old_data[i];
+        }
+        free(old_pages);
+        free(old_data);
+        slot = (int)(((unsigned long long)page * 11400714819323198485ull) >> 40) & pool->pending_mask;
+        while (pool->pending_pages[slot] != -1) {
+            slot = (slot + 1) & pool->pending_mask;
+        }
+    }
+
+    // Paginas de quadros e do mapeamento de um pool adiado nunca ficam a frente
+    // do arquivo
+    char *data = malloc(POOL_PAGE_SIZE);
+    if (data == NULL) {
+        perror("Erro ao alocar as paginas pendentes");
+        exit(EXIT_FAILURE);
+    }
+    long long stable = pool->stable_size - page * POOL_PAGE_SIZE;
+    ssize_t n = stable <= 0 ? 0 : pread(pool->fd, data, stable < POOL_PAGE_SIZE ? (size_t)stable : POOL_PAGE_SIZE, page * POOL_PAGE_SIZE);
+    if (n < 0) {
+        n = 0;
+    }
+    memset(data + n, 0, POOL_PAGE_SIZE - n);
+    pool->pending_pages[slot] = page;
+    pool->pending_data[slot] = data;
+    pool->pending_count++;
+    return data;
+}
+
+/*
+ * Garante que o mapeamento cubra size bytes. O arquivo cresce em extensoes de
+ * pelo menos POOL_MAP_EXTENT (ou o dobro do tamanho atual), para que
+ * acrescentar registros nao remapeie a cada escrita; o excesso e cortado em
+ * pool_close. Ponteiros obtidos com pool_pointer deixam de valer.
+ */
+int pool_reserve(BufferPool *pool, long long size) {
+    if (size <= pool->map_capacity) {
+        return 0;
+    }
+    long long capacity = pool->map_capacity * 2;
+    if (capacity < POOL_MAP_EXTENT) capacity = POOL_MAP_EXTENT;
+    if (capacity < size) capacity = size;
+    capacity = (capacity + POOL_PAGE_SIZE - 1) / POOL_PAGE_SIZE * POOL_PAGE_SIZE;
+    if (ftruncate(pool->fd, capacity) != 0) {
+        perror("Erro ao aumentar o arquivo mapeado");
+        return -1;
+    }
+    char *map;
+    if (pool->map == NULL) {
+        map = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, pool->fd, 0);
     } else {
-        fclose(fp);
+        map = mremap(pool->map, pool->map_capacity, capacity, MREMAP_MAYMOVE);
+    }
+    if (map == MAP_FAILED) {
+        perror("Erro ao remapear o arquivo");
+        return -1;
     }
+    pool->map = map;
+    pool->map_capacity = capacity;
+    madvise(pool->map, pool->map_capacity, pool->advice);
+    return 0;
 }
 
+/*
+ * No modo mmap, retorna um ponteiro direto para length bytes em offset (sem
+ * copia nem chamada de sistema); no modo com quadros, ou fora do arquivo,
+ * retorna NULL. Uma pagina pendente so e devolvida se contiver o trecho
+ * inteiro.
+ */
+const void *pool_pointer(BufferPool *pool, long long offset, size_t length) {
+    if (!pool->mapped || offset < 0 || offset + (long long)length > pool->file_size) {
+        return NULL;
+    }
+    if (pool->deferred && offset + (long long)length > pool->stable_size) {
+        return NULL;
+    }
+    if (pool->pending_count > 0) {
+        long long first = offset / POOL_PAGE_SIZE;
+        long long last = (offset + (long long)length - 1) / POOL_PAGE_SIZE;
+        char *page = pool_pending(pool, first, 0);
+        if (page != NULL) {
+            return first == last ? page + offset % POOL_PAGE_SIZE : NULL;
+        }
+        for (long long p = first + 1; p <= last; p++) {
+            if (pool_pending(pool, p, 0) != NULL) {
+                return NULL;
+            }
+        }
+    }
+    return pool->map + offset;
+}
 
-ProductRecord create_sample_product(long long product_id, long long category_id, const char *category_code, const char *brand, float price, int ativo) {
-    ProductRecord record;
-    record.product_id = product_id;
-    record.category_id = category_id;
-    strncpy(record.category_code, category_code, MAX_CATEGORY_CODE_LEN - 1);
-    record.category_code[MAX_CATEGORY_CODE_LEN - 1] = '\0';
-    strncpy(record.brand, brand, MAX_BRAND_LEN - 1);
-    record.brand[MAX_BRAND_LEN - 1] = '\0';
-    record.price = price;
-    record.ativo = ativo;
-    record.seq_key = 0; 
-    record.elo = -1;    
-    return record;
+/*
+ * Indica ao kernel o padrao de acesso esperado (MADV_SEQUENTIAL para
+ * varreduras, MADV_RANDOM para seguir os elos). Sem efeito no modo com quadros.
+ */
+void pool_advise(BufferPool *pool, int advice) {
+    pool->advice = advice;
+    if (pool->mapped && pool->map != NULL) {
+        madvise(pool->map, pool->map_capacity, advice);
+    }
 }
 
-long long find_immediately_lower_product_id(long long target_product_id) {
-    FILE *fp = fopen(ORIGINAL_FILE_NAME, "rb");
-    if (fp == NULL) {
+/*
+ * Num leitor, falha assim que outra versao comeca a ser publicada: quem segue
+ * ponteiros lidos do arquivo para na hora, em vez de percorrer paginas de
+ * versoes diferentes.
+ */
+int pool_read(BufferPool *pool, long long offset, void *buffer, size_t length) {
+    if (offset < 0 || offset + (long long)length > pool->file_size) {
+        return -1;
+    }
+    if (pool->snapshot != NULL &&
+        __atomic_load_n(&pool->snapshot->shared->version, __ATOMIC_ACQUIRE) != pool->snapshot->version) {
+        return -1;
+    }
+    if (pool->mapped && pool->pending_count == 0 && offset + (long long)length <= pool->stable_size) {
+        memcpy(buffer, pool->map + offset, length);
+        return 0;
+    }
+    char *out = (char *)buffer;
+    while (length > 0) {
+        long long page = offset / POOL_PAGE_SIZE;
+        size_t in_page = offset % POOL_PAGE_SIZE;
+        size_t chunk = POOL_PAGE_SIZE - in_page < length ? POOL_PAGE_SIZE - in_page : length;
+        const char *source = pool_pending(pool, page, 0);
+        if (source == NULL && pool->deferred && page * POOL_PAGE_SIZE >= pool->stable_size) {
+            // Trecho cortado por pool_truncate e ainda nao regravado
+            memset(out, 0, chunk);
+        } else {
+            if (source == NULL) {
+                source = pool->mapped ? pool->map + page * POOL_PAGE_SIZE : pool_fetch(pool, page)->data;
+            }
+            memcpy(out, source + in_page, chunk);
+        }
+        out += chunk;
+        offset += chunk;
+        length -= chunk;
+    }
+    return 0;
+}
+
+/*
+ * Num pool adiado, a escrita vai so para as paginas pendentes (e, com log,
+ * para a transacao aberta): o arquivo nunca recebe parte de uma transacao.
+ */
+int pool_write(BufferPool *pool, long long offset, const void *buffer, size_t length) {
+    if (pool->deferred) {
+        if (pool->wal != NULL && wal_append(pool->wal, offset, buffer, length) != 0) {
+            return -1;
+        }
+        const char *in = (const char *)buffer;
+        while (length > 0) {
+            char *page = pool_pending(pool, offset / POOL_PAGE_SIZE, 1);
+            size_t in_page = offset % POOL_PAGE_SIZE;
+            size_t chunk = POOL_PAGE_SIZE - in_page < length ? POOL_PAGE_SIZE - in_page : length;
+            memcpy(page + in_page, in, chunk);
+            in += chunk;
+            offset += chunk;
+            length -= chunk;
+            if (offset > pool->file_size) {
+                pool->file_size = offset;
+            }
+        }
+        return 0;
+    }
+    if (pool->mapped) {
+        if (pool_reserve(pool, offset + (long long)length) != 0) {
+            return -1;
+        }
+        memcpy(pool->map + offset, buffer, length);
+        if (offset + (long long)length > pool->file_size) {
+            pool->file_size = offset + (long long)length;
+        }
+        return 0;
+    }
+    const char *in = (const char *)buffer;
+    while (length > 0) {
+        Frame *frame = pool_fetch(pool, offset / POOL_PAGE_SIZE);
+        size_t in_page = offset % POOL_PAGE_SIZE;
+        size_t chunk = POOL_PAGE_SIZE - in_page < length ? POOL_PAGE_SIZE - in_page : length;
+        memcpy(frame->data + in_page, in, chunk);
+        frame->dirty = 1;
+        in += chunk;
+        offset += chunk;
+        length -= chunk;
+        if (offset > pool->file_size) {
+            pool->file_size = offset;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Refaz o mapeamento para cobrir exatamente as paginas de file_size.
+ */
+int pool_remap(BufferPool *pool) {
+    long long capacity = (pool->file_size + POOL_PAGE_SIZE - 1) / POOL_PAGE_SIZE * POOL_PAGE_SIZE;
+    if (capacity == pool->map_capacity) {
+        return 0;
+    }
+    if (pool->map != NULL) {
+        munmap(pool->map, pool->map_capacity);
+    }
+    pool->map = NULL;
+    pool->map_capacity = 0;
+    if (capacity > 0) {
+        char *map = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, pool->fd, 0);
+        if (map == MAP_FAILED) {
+            perror("Erro ao remapear o arquivo");
+            return -1;
+        }
+        pool->map = map;
+        pool->map_capacity = capacity;
+        madvise(pool->map, pool->map_capacity, pool->advice);
+    }
+    return 0;
+}
+
+/*
+ * Grava as paginas pendentes de um pool adiado e deixa o arquivo com o tamanho
+ * logico; o que foi cortado por pool_truncate e nao regravado volta zerado.
+ * Nao faz fsync nem toca no log: a ordem fica com storage_publish.
+ */
+int pool_checkpoint(BufferPool *pool) {
+    if (!pool->deferred || (pool->pending_count == 0 && pool->stable_size == pool->file_size)) {
+        return 0;
+    }
+    struct stat st;
+    if (fstat(pool->fd, &st) != 0 || (st.st_size > pool->stable_size && ftruncate(pool->fd, pool->stable_size) != 0)) {
+        perror("Erro ao ajustar o tamanho do arquivo");
+        return -1;
+    }
+    for (int i = 0; i <= pool->pending_mask; i++) {
+        long long page = pool->pending_pages[i];
+        if (page == -1) {
+            continue;
+        }
+        long long offset = page * POOL_PAGE_SIZE;
+        long long length = pool->file_size - offset;
+        if (length > POOL_PAGE_SIZE) length = POOL_PAGE_SIZE;
+        if (length <= 0) {
+            continue;
+        }
+        if (pwrite(pool->fd, pool->pending_data[i], (size_t)length, offset) != (ssize_t)length) {
+            perror("Erro ao gravar pagina do pool de buffers");
+            return -1;
+        }
+        for (int f = pool->mapped ? -1 : pool->buckets[pool_bucket(pool, page)]; f != -1; f = pool->frames[f].next) {
+            if (pool->frames[f].page == page) {
+                memcpy(pool->frames[f].data, pool->pending_data[i], POOL_PAGE_SIZE);
+                break;
+            }
+        }
+    }
+    if (ftruncate(pool->fd, pool->file_size) != 0 || (pool->mapped && pool_remap(pool) != 0)) {
+        perror("Erro ao ajustar o tamanho do arquivo");
         return -1;
     }
-    long long previous_index = -1;
-    Header header;
-    fread(&header, sizeof(Header), 1, fp);
-    if (header.head_index != -1) {
-        long long current_index = header.head_index;
-        ProductRecord current_record;
-        while (current_index != -1) {
-            fseek(fp, sizeof(Header) + current_index * sizeof(ProductRecord), SEEK_SET);
-            fread(&current_record, sizeof(ProductRecord), 1, fp);
-            if (current_record.product_id < target_product_id && current_record.ativo) {
-                previous_index = current_index;
+    for (int i = 0; i <= pool->pending_mask; i++) {
+        if (pool->pending_pages[i] != -1) {
+            free(pool->pending_data[i]);
+            pool->pending_pages[i] = -1;
+        }
+    }
+    pool->pending_count = 0;
+    pool->stable_size = pool->file_size;
+    return 0;
+}
+
+/*
+ * Grava os quadros alterados. As paginas de um pool adiado so vao para o
+ * arquivo em pool_checkpoint.
+ */
+int pool_flush(BufferPool *pool) {
+    if (pool->deferred) {
+        return 0;
+    }
+    int result = 0;
+    for (int i = 0; i < pool->frame_count; i++) {
+        if (pool->frames[i].page != -1 && pool->frames[i].dirty && pool_write_back(pool, &pool->frames[i]) != 0) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+void pool_drop_frames(BufferPool *pool) {
+    for (int i = 0; i < pool->frame_count; i++) {
+        pool->frames[i].page = -1;
+        pool->frames[i].dirty = 0;
+        pool->frames[i].referenced = 0;
+        pool->frames[i].next = -1;
+    }
+    for (int i = 0; i <= pool->bucket_mask; i++) {
+        pool->buckets[i] = -1;
+    }
+}
+
+/*
+ * Esvazia o arquivo, descartando todas as paginas em memoria. Num pool adiado
+ * o corte so chega ao arquivo em pool_checkpoint.
+ */
+int pool_truncate(BufferPool *pool) {
+    if (pool->deferred) {
+        for (int i = 0; i <= pool->pending_mask; i++) {
+            if (pool->pending_pages[i] != -1) {
+                free(pool->pending_data[i]);
+                pool->pending_pages[i] = -1;
+            }
+        }
+        pool->pending_count = 0;
+        pool_drop_frames(pool);
+        pool->file_size = 0;
+        pool->stable_size = 0;
+        return 0;
+    }
+    if (pool->mapped && pool->map != NULL) {
+        munmap(pool->map, pool->map_capacity);
+        pool->map = NULL;
+        pool->map_capacity = 0;
+    }
+    pool_drop_frames(pool);
+    pool->file_size = 0;
+    return ftruncate(pool->fd, 0);
+}
+
+/*
+ * Grava as paginas alteradas, descarta as demais e rele o tamanho do arquivo,
+ * para enxergar alteracoes feitas por outro processo. No modo mmap o
+ * conteudo ja e compartilhado e so um novo tamanho exige refazer o mapeamento.
+ */
+int pool_refresh(BufferPool *pool) {
+    struct stat st;
+    if (pool->deferred && (pool->pending_count > 0 || pool->stable_size != pool->file_size)) {
+        // Alteracoes ainda nao publicadas: ninguem mais pode ter escrito
+        return 0;
+    }
+    pool_flush(pool);
+    pool_drop_frames(pool);
+    if (fstat(pool->fd, &st) != 0) {
+        return -1;
+    }
+    if (pool->mapped && st.st_size != pool->map_capacity) {
+        // O arquivo foi redimensionado por fora: refaz o mapeamento
+        if (pool->map != NULL) {
+            munmap(pool->map, pool->map_capacity);
+        }
+        pool->map = NULL;
+        pool->map_capacity = 0;
+        if (st.st_size > 0) {
+            pool->map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, pool->fd, 0);
+            if (pool->map == MAP_FAILED) {
+                pool->map = NULL;
+                pool->file_size = 0;
+                return -1;
+            }
+            pool->map_capacity = st.st_size;
+            madvise(pool->map, pool->map_capacity, pool->advice);
+        }
+        pool->file_size = st.st_size;
+    } else {
+        // O mapeamento (arredondado por pool_remap) ja cobre o novo tamanho
+        pool->file_size = st.st_size;
+    }
+    pool->stable_size = pool->file_size;
+    return 0;
+}
+
+void pool_close(BufferPool *pool) {
+    pool_flush(pool);
+    if (pool->mapped) {
+        if (pool->map != NULL) {
+            munmap(pool->map, pool->map_capacity);
+        }
+        // Um pool adiado ja deixou o arquivo no tamanho certo, e o arquivo
+        // pode estar crescendo em outro processo
+        if (!pool->deferred && pool->map_capacity != pool->file_size && ftruncate(pool->fd, pool->file_size) != 0) {
+            perror("Erro ao ajustar o tamanho do arquivo mapeado");
+        }
+    }
+    close(pool->fd);
+    free(pool->frames);
+    free(pool->memory);
+    free(pool->buckets);
+    for (int i = 0; i <= pool->pending_mask; i++) {
+        if (pool->pending_pages[i] != -1) {
+            free(pool->pending_data[i]);
+        }
+    }
+    free(pool->pending_pages);
+    free(pool->pending_data);
+}
+
+int read_product(Storage *store, long long index, ProductRecord *record) {
+    return pool_read(&store->data, store->header.data_offset + index * (long long)sizeof(ProductRecord), record, sizeof(ProductRecord));
+}
+
+int write_product(Storage *store, long long index, const ProductRecord *record) {
+    return pool_write(&store->data, store->header.data_offset + index * (long long)sizeof(ProductRecord), record, sizeof(ProductRecord));
+}
+
+/*
+ * Retorna o registro index sem copia no modo mmap; no modo com quadros, le o
+ * registro para copy. Retorna NULL se index estiver fora do arquivo. O ponteiro
+ * so vale ate a proxima escrita em products.bin.
+ */
+const ProductRecord *product_at(Storage *store, long long index, ProductRecord *copy) {
+    const ProductRecord *record = pool_pointer(&store->data, store->header.data_offset + index * (long long)sizeof(ProductRecord), sizeof(ProductRecord));
+    if (record != NULL) {
+        return record;
+    }
+    return read_product(store, index, copy) == 0 ? copy : NULL;
+}
+
+int write_header(Storage *store) {
+    return pool_write(&store->data, 0, &store->header, sizeof(Header));
+}
+
+long long product_count(const Storage *store) {
+    return (store->data.file_size - store->header.data_offset) / (long long)sizeof(ProductRecord);
+}
+
+/*
+ * Delimitam uma leitura num handle de escritor, que segura o mutex do handle
+ * para nao cruzar uma publicacao da thread publicadora (ver
+ * storage_publisher). O mutex e recursivo, entao as leituras tambem servem
+ * dentro de uma escrita. Num leitor, nao fazem nada.
+ */
+void storage_begin_read(Storage *store) {
+    if (!store->reader) {
+        pthread_mutex_lock(&store->writer);
+    }
+}
+
+void storage_end_read(Storage *store) {
+    if (!store->reader) {
+        pthread_mutex_unlock(&store->writer);
+    }
+}
+
+int read_header(FILE *fp, Header *header) {
+    fseek(fp, 0, SEEK_SET);
+    if (fread(header, sizeof(Header), 1, fp) != 1 ||
+        memcmp(header->magic, PRODUCT_FILE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != PRODUCT_FILE_VERSION ||
+        header->record_size != sizeof(ProductRecord)) {
+        return -1;
+    }
+    return 0;
+}
+
+void initialize_file() {
+    FILE *fp = fopen(ORIGINAL_FILE_NAME, "rb");
+    if (fp == NULL) {
+        fp = fopen(ORIGINAL_FILE_NAME, "wb");
+        Header header;
+        memset(&header, 0, sizeof(Header));
+        header.head_index = -1;
+        header.free_head = -1;
+        memcpy(header.magic, PRODUCT_FILE_MAGIC, sizeof(header.magic));
+        header.version = PRODUCT_FILE_VERSION;
+        header.record_size = sizeof(ProductRecord);
+        header.dict_offset = sizeof(Header);
+        header.dict_capacity = DICTIONARY_MIN_CAPACITY;
+        header.data_offset = header.dict_offset + header.dict_capacity * DICTIONARY_ENTRY_LEN;
+        fwrite(&header, sizeof(Header), 1, fp);
+        // Reserva o dicionario vazio antes dos registros
+        char empty_entry[DICTIONARY_ENTRY_LEN] = {0};
+        for (long long i = 0; i < header.dict_capacity; i++) {
+            fwrite(empty_entry, DICTIONARY_ENTRY_LEN, 1, fp);
+        }
+        fclose(fp);
+    } else {
+        Header header;
+        if (read_header(fp, &header) != 0) {
+            printf("O arquivo %s nao esta no formato v5; gere-o novamente com gerar_arquivos.\n", ORIGINAL_FILE_NAME);
+            exit(EXIT_FAILURE);
+        }
+        fclose(fp);
+    }
+}
+
+/*
+ * Le a string de codigo code do dicionario para buffer (decodificacao feita so
+ * na exibicao).
+ */
+const char *dictionary_string(Storage *store, unsigned int code, char *buffer) {
+    buffer[0] = '\0';
+    if (code < store->header.dict_count) {
+        if (pool_read(&store->data, store->header.dict_offset + (long long)code * DICTIONARY_ENTRY_LEN, buffer, DICTIONARY_ENTRY_LEN) != 0) {
+            buffer[0] = '\0';
+        }
+        buffer[DICTIONARY_ENTRY_LEN - 1] = '\0';
+    }
+    return buffer;
+}
+
+/*
+ * Retorna o codigo de text no dicionario, -1 se ele nao estiver la ou -2 em
+ * caso de erro de leitura.
+ */
+long long dictionary_find(Storage *store, const char *text) {
+    Header *header = &store->header;
+    char *entries = malloc((size_t)header->dict_count * DICTIONARY_ENTRY_LEN + 1);
+    if (entries == NULL) {
+        return -2;
+    }
+    if (header->dict_count > 0 &&
+        pool_read(&store->data, header->dict_offset, entries, (size_t)header->dict_count * DICTIONARY_ENTRY_LEN) != 0) {
+        free(entries);
+        return -2;
+    }
+    for (unsigned int code = 0; code < header->dict_count; code++) {
+        if (strncmp(entries + (size_t)code * DICTIONARY_ENTRY_LEN, text, DICTIONARY_ENTRY_LEN) == 0) {
+            free(entries);
+            return code;
+        }
+    }
+    free(entries);
+    return -1;
+}
+
+/*
+ * Retorna o codigo de text no dicionario, acrescentando a string no espaco
+ * reservado se ela for nova, ou -1 se o dicionario estiver cheio.
+ */
+long long dictionary_code(Storage *store, const char *text) {
+    Header *header = &store->header;
+    long long found = dictionary_find(store, text);
+    if (found != -1) {
+        return found < 0 ? -1 : found;
+    }
+
+    if (header->dict_count >= header->dict_capacity) {
+        printf("Dicionario de strings cheio.\n");
+        return -1;
+    }
+    char entry[DICTIONARY_ENTRY_LEN] = {0};
+    strncpy(entry, text, DICTIONARY_ENTRY_LEN - 1);
+    long long code = header->dict_count;
+    pool_write(&store->data, header->dict_offset + code * DICTIONARY_ENTRY_LEN, entry, DICTIONARY_ENTRY_LEN);
+    header->dict_count++;
+    write_header(store);
+    return code;
+}
+
+
+/*
+ * product_id da posicao slot (LLONG_MAX se a leitura falhar).
+ */
+long long base_key(Storage *store, long long slot) {
+    ProductRecord copy;
+    const ProductRecord *record = product_at(store, slot, &copy);
+    return record != NULL ? record->product_id : LLONG_MAX;
+}
+
+/*
+ * Primeira posicao da regiao base com product_id maior ou igual ao alvo
+ * (base_count se nao houver). Os passos alternam interpolacao, que chega ao
+ * alvo em poucas leituras quando os product_ids sao bem distribuidos, e
+ * bissecao, que garante O(log n) leituras no pior caso.
+ */
+long long base_lower_bound(Storage *store, long long product_id) {
+    long long count = store->header.base_count;
+    if (count == 0 || base_key(store, 0) >= product_id) {
+        return 0;
+    }
+    if (base_key(store, count - 1) < product_id) {
+        return count;
+    }
+    // A resposta esta em [lo, hi]; lo_key e o product_id de lo - 1 e hi_key o de hi
+    long long lo = 1;
+    long long hi = count - 1;
+    long long lo_key = base_key(store, 0);
+    long long hi_key = base_key(store, count - 1);
+    int interpolate = 1;
+    while (lo < hi) {
+        long long mid = lo + (hi - lo) / 2;
+        if (interpolate && hi - lo > BASE_INTERPOLATION_MIN) {
+            double fraction = ((double)product_id - (double)lo_key) / ((double)hi_key - (double)lo_key);
+            mid = lo - 1 + (long long)(fraction * (double)(hi - lo + 1));
+            if (mid < lo) mid = lo;
+            if (mid > hi - 1) mid = hi - 1;
+        }
+        interpolate = !interpolate;
+        long long key = base_key(store, mid);
+        if (key < product_id) {
+            lo = mid + 1;
+            lo_key = key;
+        } else {
+            hi = mid;
+            hi_key = key;
+        }
+    }
+    return lo;
+}
+
+long long delta_lower_bound(const DeltaIndex *delta, long long product_id) {
+    long long lo = 0;
+    long long hi = delta->count;
+    while (lo < hi) {
+        long long mid = lo + (hi - lo) / 2;
+        if (delta->entries[mid].product_id < product_id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+void delta_reserve(DeltaIndex *delta, long long count) {
+    if (count <= delta->capacity) {
+        return;
+    }
+    long long capacity = delta->capacity > 0 ? delta->capacity : 64;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    DeltaEntry *entries = realloc(delta->entries, capacity * sizeof(DeltaEntry));
+    if (entries == NULL) {
+        perror("Erro ao alocar o delta");
+        exit(EXIT_FAILURE);
+    }
+    delta->entries = entries;
+    delta->capacity = capacity;
+}
+
+void delta_add(DeltaIndex *delta, long long product_id, long long slot) {
+    delta_reserve(delta, delta->count + 1);
+    long long position = delta_lower_bound(delta, product_id);
+    memmove(delta->entries + position + 1, delta->entries + position, (delta->count - position) * sizeof(DeltaEntry));
+    delta->entries[position].product_id = product_id;
+    delta->entries[position].slot = slot;
+    delta->count++;
+}
+
+void delta_remove(DeltaIndex *delta, long long product_id) {
+    long long position = delta_lower_bound(delta, product_id);
+    if (position < delta->count && delta->entries[position].product_id == product_id) {
+        memmove(delta->entries + position, delta->entries + position + 1, (delta->count - position - 1) * sizeof(DeltaEntry));
+        delta->count--;
+    }
+}
+
+void delta_free(DeltaIndex *delta) {
+    free(delta->entries);
+    memset(delta, 0, sizeof(DeltaIndex));
+}
+
+int compare_delta_entries(const void *a, const void *b) {
+    long long x = ((const DeltaEntry *)a)->product_id;
+    long long y = ((const DeltaEntry *)b)->product_id;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Monta o delta com os produtos ativos das posicoes a partir de base_count.
+ */
+int delta_load(Storage *store) {
+    DeltaIndex *delta = &store->delta;
+    long long slot_count = product_count(store);
+    delta->count = 0;
+    ProductRecord copy;
+    const ProductRecord *record;
+    pool_advise(&store->data, MADV_SEQUENTIAL);
+    for (long long slot = store->header.base_count; slot < slot_count; slot++) {
+        if ((record = product_at(store, slot, &copy)) == NULL) {
+            pool_advise(&store->data, MADV_RANDOM);
+            return -1;
+        }
+        if (record->ativo) {
+            delta_reserve(delta, delta->count + 1);
+            delta->entries[delta->count].product_id = record->product_id;
+            delta->entries[delta->count].slot = slot;
+            delta->count++;
+        }
+    }
+    pool_advise(&store->data, MADV_RANDOM);
+    if (delta->count > 0) {
+        qsort(delta->entries, delta->count, sizeof(DeltaEntry), compare_delta_entries);
+    }
+    return 0;
+}
+
+/*
+ * Mantem o delta depois que record foi gravado (add) ou retirado da posicao
+ * slot. Posicoes da regiao base nao entram no delta: um produto removido dela
+ * fica como registro inativo, ainda na ordem.
+ */
+void delta_note(Storage *store, const ProductRecord *record, long long slot, int add) {
+    if (slot < store->header.base_count) {
+        return;
+    }
+    if (add && record->ativo) {
+        delta_add(&store->delta, record->product_id, slot);
+    } else if (!add) {
+        delta_remove(&store->delta, record->product_id);
+    }
+}
+
+/*
+ * Procura o produto ativo com product_id na regiao base e depois no delta,
+ * sem arvore nem elos. Retorna 1 e a posicao em slot se ele existir.
+ */
+int sorted_find(Storage *store, long long product_id, long long *slot) {
+    long long position = base_lower_bound(store, product_id);
+    ProductRecord copy;
+    const ProductRecord *record;
+    if (position < store->header.base_count && (record = product_at(store, position, &copy)) != NULL &&
+        record->product_id == product_id && record->ativo) {
+        *slot = position;
+        return 1;
+    }
+    const DeltaIndex *delta = &store->delta;
+    long long entry = delta_lower_bound(delta, product_id);
+    if (entry < delta->count && delta->entries[entry].product_id == product_id) {
+        *slot = delta->entries[entry].slot;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Posiciona cursor no menor product_id maior ou igual ao alvo.
+ */
+void sorted_seek(Storage *store, long long product_id, SortedCursor *cursor) {
+    cursor->base = base_lower_bound(store, product_id);
+    cursor->delta = delta_lower_bound(&store->delta, product_id);
+}
+
+/*
+ * Copia para record o proximo produto ativo em ordem de product_id,
+ * intercalando a regiao base e o delta, e avanca cursor. Retorna 0 no fim
+ * (ou se uma leitura falhar).
+ */
+int sorted_next(Storage *store, SortedCursor *cursor, ProductRecord *record, long long *slot) {
+    ProductRecord copy;
+    const ProductRecord *base = NULL;
+    while (cursor->base < store->header.base_count) {
+        if ((base = product_at(store, cursor->base, &copy)) == NULL) {
+            return 0;
+        }
+        if (base->ativo) {
+            break;
+        }
+        base = NULL;
+        cursor->base++;
+    }
+    const DeltaIndex *delta = &store->delta;
+    if (base != NULL && (cursor->delta == delta->count || base->product_id < delta->entries[cursor->delta].product_id)) {
+        *record = *base;
+        *slot = cursor->base++;
+        return 1;
+    }
+    if (cursor->delta == delta->count || read_product(store, delta->entries[cursor->delta].slot, record) != 0) {
+        return 0;
+    }
+    *slot = delta->entries[cursor->delta++].slot;
+    return 1;
+}
+
+ProductEntry create_sample_product(long long product_id, long long category_id, const char *category_code, const char *brand, float price, int ativo) {
+    ProductEntry record;
+    record.product_id = product_id;
+    record.category_id = category_id;
+    strncpy(record.category_code, category_code, MAX_CATEGORY_CODE_LEN - 1);
+    record.category_code[MAX_CATEGORY_CODE_LEN - 1] = '\0';
+    strncpy(record.brand, brand, MAX_BRAND_LEN - 1);
+    record.brand[MAX_BRAND_LEN - 1] = '\0';
+    record.price = price;
+    record.ativo = ativo;
+    return record;
+}
+
+void stamp_file(const char *filename, DataStamp *stamp) {
+    struct stat st;
+    stamp->size = -1;
+    stamp->mtime_sec = 0;
+    stamp->mtime_nsec = 0;
+    if (stat(filename, &st) == 0) {
+        stamp->size = st.st_size;
+        stamp->mtime_sec = st.st_mtim.tv_sec;
+        stamp->mtime_nsec = st.st_mtim.tv_nsec;
+    }
+}
+
+void stamp_data_file(DataStamp *stamp) {
+    stamp_file(ORIGINAL_FILE_NAME, stamp);
+}
+
+int same_data_stamp(const DataStamp *a, const DataStamp *b) {
+    return a->size == b->size && a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec;
+}
+
+/*
+ * Rotinas comuns as arvores B+ em disco (products.bpt e os indices
+ * secundarios), com os nos no formato de tree->layout. A pagina 0 guarda os
+ * metadados; as demais sao nos de BPT_PAGE_SIZE bytes. A arvore guarda o
+ * tamanho e a data de modificacao de products.bin da ultima vez que foi
+ * atualizada e e reconstruida se o arquivo de dados mudou por fora (por
+ * exemplo, ao ser gerado de novo).
+ */
+char *tree_key(const TreeLayout *layout, const void *node, int i) {
+    return (char *)node + sizeof(TreeNodeHeader) + (size_t)i * layout->key_size;
+}
+
+long long *tree_values(const TreeLayout *layout, const void *node) {
+    return (long long *)tree_key(layout, node, layout->max_keys);
+}
+
+size_t tree_node_size(const TreeLayout *layout) {
+    return sizeof(TreeNodeHeader) + (size_t)layout->max_keys * layout->key_size +
+           (size_t)(layout->max_keys + 1) * sizeof(long long);
+}
+
+int tree_read_node(BPTree *tree, long long page, void *node) {
+    const TreeNodeHeader *header = node;
+    if (pool_read(tree->pool, page * BPT_PAGE_SIZE, node, tree_node_size(tree->layout)) != 0 ||
+        header->count < 0 || header->count > tree->layout->max_keys) {
+        return -1;
+    }
+    return 0;
+}
+
+int tree_write_node(BPTree *tree, long long page, const void *node) {
+    return pool_write(tree->pool, page * BPT_PAGE_SIZE, node, tree_node_size(tree->layout));
+}
+
+long long tree_alloc_node(BPTree *tree) {
+    return tree->meta.page_count++;
+}
+
+int tree_write_meta(BPTree *tree) {
+    return pool_write(tree->pool, 0, &tree->meta, sizeof(BPTreeMeta));
+}
+
+/*
+ * Le os metadados da arvore e indica se eles tem magic e o estado atual de
+ * products.bin.
+ */
+int tree_meta_current(BPTree *tree, const char *magic) {
+    DataStamp current;
+    stamp_data_file(&current);
+    return pool_read(tree->pool, 0, &tree->meta, sizeof(BPTreeMeta)) == 0 &&
+           memcmp(tree->meta.magic, magic, sizeof(tree->meta.magic)) == 0 &&
+           same_data_stamp(&tree->meta.data, &current);
+}
+
+/*
+ * Registra o estado atual de products.bin nos metadados da arvore. Deve ser
+ * chamada depois que as paginas alteradas de products.bin ja foram gravadas.
+ */
+void tree_close(BPTree *tree) {
+    stamp_data_file(&tree->meta.data);
+    tree_write_meta(tree);
+    pool_flush(tree->pool);
+}
+
+/*
+ * Montagem de uma arvore a partir das chaves em ordem crescente: as folhas
+ * sao preenchidas da esquerda para a direita e cada nivel interno e montado a
+ * partir das primeiras chaves do nivel abaixo.
+ */
+typedef struct {
+    BPTree *tree;
+    TreePage leaf;
+    long long leaf_page;
+    char *level_keys;           // Primeira chave de cada no do nivel
+    long long *level_pages;
+    long long level_count;
+    long long level_capacity;
+    int failed;
+} TreeBuilder;
+
+int tree_build_begin(TreeBuilder *builder, BPTree *tree, const char *magic) {
+    memset(&tree->meta, 0, sizeof(BPTreeMeta));
+    memcpy(tree->meta.magic, magic, sizeof(tree->meta.magic));
+    tree->meta.page_count = 1;
+    tree->meta.root = -1;
+
+    memset(builder, 0, sizeof(TreeBuilder));
+    builder->tree = tree;
+    builder->leaf.header.is_leaf = 1;
+    builder->leaf.header.prev = -1;
+    builder->leaf_page = -1;
+    builder->level_capacity = 64;
+    builder->level_keys = malloc(builder->level_capacity * tree->layout->key_size);
+    builder->level_pages = malloc(builder->level_capacity * sizeof(long long));
+    if (builder->level_keys == NULL || builder->level_pages == NULL) {
+        free(builder->level_keys);
+        free(builder->level_pages);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Acrescenta key, maior que as anteriores, com value. Uma falha so e
+ * informada por tree_build_finish.
+ */
+void tree_build_add(TreeBuilder *builder, const void *key, long long value) {
+    BPTree *tree = builder->tree;
+    const TreeLayout *layout = tree->layout;
+    TreeNodeHeader *leaf = &builder->leaf.header;
+    if (builder->failed) {
+        return;
+    }
+    if (builder->leaf_page == -1 || leaf->count == layout->max_keys) {
+        long long new_page = tree_alloc_node(tree);
+        if (builder->leaf_page != -1) {
+            leaf->next = new_page;
+            tree_write_node(tree, builder->leaf_page, &builder->leaf);
+            memset(&builder->leaf, 0, sizeof(TreePage));
+            leaf->is_leaf = 1;
+            leaf->prev = builder->leaf_page;
+        }
+        builder->leaf_page = new_page;
+        if (builder->level_count == builder->level_capacity) {
+            long long capacity = builder->level_capacity * 2;
+            char *keys = realloc(builder->level_keys, capacity * layout->key_size);
+            if (keys != NULL) {
+                builder->level_keys = keys;
+            }
+            long long *pages = keys == NULL ? NULL : realloc(builder->level_pages, capacity * sizeof(long long));
+            if (pages == NULL) {
+                builder->failed = 1;
+                return;
+            }
+            builder->level_pages = pages;
+            builder->level_capacity = capacity;
+        }
+        memcpy(builder->level_keys + builder->level_count * layout->key_size, key, layout->key_size);
+        builder->level_pages[builder->level_count] = new_page;
+        builder->level_count++;
+    }
+    memcpy(tree_key(layout, &builder->leaf, leaf->count), key, layout->key_size);
+    tree_values(layout, &builder->leaf)[leaf->count] = value;
+    leaf->count++;
+}
+
+/*
+ * Grava a ultima folha, os niveis internos e os metadados, e libera o
+ * builder.
+ */
+int tree_build_finish(TreeBuilder *builder) {
+    BPTree *tree = builder->tree;
+    const TreeLayout *layout = tree->layout;
+    size_t key_size = layout->key_size;
+    long long level_count = builder->failed ? 0 : builder->level_count;
+    if (!builder->failed && builder->leaf_page != -1) {
+        builder->leaf.header.next = -1;
+        tree_write_node(tree, builder->leaf_page, &builder->leaf);
+    }
+
+    // Monta os niveis internos ate sobrar um unico no, que vira a raiz
+    while (level_count > 1) {
+        long long parent_count = 0;
+        for (long long first = 0; first < level_count; first += layout->max_keys + 1) {
+            long long children = level_count - first < layout->max_keys + 1 ? level_count - first : layout->max_keys + 1;
+            TreePage node;
+            memset(&node, 0, sizeof(TreePage));
+            node.header.next = -1;
+            node.header.prev = -1;
+            node.header.count = (int)children - 1;
+            long long *values = tree_values(layout, &node);
+            for (long long i = 0; i < children; i++) {
+                values[i] = builder->level_pages[first + i];
+                if (i > 0) {
+                    memcpy(tree_key(layout, &node, (int)i - 1), builder->level_keys + (first + i) * key_size, key_size);
+                }
+            }
+            long long page = tree_alloc_node(tree);
+            tree_write_node(tree, page, &node);
+            memmove(builder->level_keys + parent_count * key_size, builder->level_keys + first * key_size, key_size);
+            builder->level_pages[parent_count] = page;
+            parent_count++;
+        }
+        level_count = parent_count;
+    }
+    if (level_count == 1) {
+        tree->meta.root = builder->level_pages[0];
+    }
+    free(builder->level_keys);
+    free(builder->level_pages);
+    if (builder->failed) {
+        return -1;
+    }
+
+    stamp_data_file(&tree->meta.data);
+    return tree_write_meta(tree);
+}
+
+/*
+ * Desce da raiz ate a folha que deve conter key, guardando as paginas visitadas
+ * em path (se nao for NULL). Retorna a pagina da folha, ou -1 se a arvore
+ * estiver vazia.
+ */
+long long tree_find_leaf(BPTree *tree, const void *key, void *node, long long *path, int *depth) {
+    const TreeLayout *layout = tree->layout;
+    const TreeNodeHeader *header = node;
+    long long page = tree->meta.root;
+    int level = 0;
+    if (page == -1) {
+        return -1;
+    }
+    while (1) {
+        if (tree_read_node(tree, page, node) != 0) {
+            return -1;
+        }
+        if (path != NULL) {
+            path[level] = page;
+        }
+        level++;
+        if (header->is_leaf) {
+            break;
+        }
+        int child = 0;
+        while (child < header->count && layout->compare(key, tree_key(layout, node, child)) >= 0) {
+            child++;
+        }
+        page = tree_values(layout, node)[child];
+    }
+    if (depth != NULL) {
+        *depth = level;
+    }
+    return page;
+}
+
+/*
+ * Posicao da primeira chave >= key na folha.
+ */
+int tree_leaf_lower_bound(const TreeLayout *layout, const void *leaf, const void *key) {
+    const TreeNodeHeader *header = leaf;
+    int left = 0;
+    int right = header->count;
+    while (left < right) {
+        int mid = left + (right - left) / 2;
+        if (layout->compare(tree_key(layout, leaf, mid), key) < 0) {
+            left = mid + 1;
+        } else {
+            right = mid;
+        }
+    }
+    return left;
+}
+
+/*
+ * Insere key com value. Retorna -1 se key ja estiver na arvore.
+ */
+int tree_insert(BPTree *tree, const void *key, long long value) {
+    const TreeLayout *layout = tree->layout;
+    size_t key_size = layout->key_size;
+    int max_keys = layout->max_keys;
+    TreePage node;
+    long long *node_values = tree_values(layout, &node);
+    long long path[BPT_MAX_DEPTH];
+    int depth = 0;
+
+    if (tree->meta.root == -1) {
+        memset(&node, 0, sizeof(TreePage));
+        node.header.is_leaf = 1;
+        node.header.next = -1;
+        node.header.prev = -1;
+        node.header.count = 1;
+        memcpy(tree_key(layout, &node, 0), key, key_size);
+        node_values[0] = value;
+        tree->meta.root = tree_alloc_node(tree);
+        return tree_write_node(tree, tree->meta.root, &node);
+    }
+
+    long long page = tree_find_leaf(tree, key, &node, path, &depth);
+    if (page == -1) {
+        return -1;
+    }
+    int count = node.header.count;
+    int pos = tree_leaf_lower_bound(layout, &node, key);
+    if (pos < count && layout->compare(tree_key(layout, &node, pos), key) == 0) {
+        return -1;
+    }
+
+    if (count < max_keys) {
+        memmove(tree_key(layout, &node, pos + 1), tree_key(layout, &node, pos), (count - pos) * key_size);
+        memmove(&node_values[pos + 1], &node_values[pos], (count - pos) * sizeof(long long));
+        memcpy(tree_key(layout, &node, pos), key, key_size);
+        node_values[pos] = value;
+        node.header.count++;
+        return tree_write_node(tree, page, &node);
+    }
+
+    // Folha cheia: divide em duas e sobe a primeira chave da nova folha
+    long long key_words[BPT_PAGE_SIZE / sizeof(long long)];
+    long long values[BPT_PAGE_SIZE / sizeof(long long)];
+    char *keys = (char *)key_words;
+    memcpy(keys, tree_key(layout, &node, 0), pos * key_size);
+    memcpy(values, node_values, pos * sizeof(long long));
+    memcpy(keys + pos * key_size, key, key_size);
+    values[pos] = value;
+    memcpy(keys + (pos + 1) * key_size, tree_key(layout, &node, pos), (count - pos) * key_size);
+    memcpy(&values[pos + 1], &node_values[pos], (count - pos) * sizeof(long long));
+
+    int total = max_keys + 1;
+    int left_count = total / 2;
+    TreePage right;
+    memset(&right, 0, sizeof(TreePage));
+    right.header.is_leaf = 1;
+    right.header.count = total - left_count;
+    memcpy(tree_key(layout, &right, 0), keys + left_count * key_size, right.header.count * key_size);
+    memcpy(tree_values(layout, &right), &values[left_count], right.header.count * sizeof(long long));
+    long long right_page = tree_alloc_node(tree);
+    right.header.next = node.header.next;
+    right.header.prev = page;
+    if (node.header.next != -1) {
+        TreePage after;
+        tree_read_node(tree, node.header.next, &after);
+        after.header.prev = right_page;
+        tree_write_node(tree, node.header.next, &after);
+    }
+
+    node.header.count = left_count;
+    memcpy(tree_key(layout, &node, 0), keys, left_count * key_size);
+    memcpy(node_values, values, left_count * sizeof(long long));
+    node.header.next = right_page;
+    tree_write_node(tree, page, &node);
+    tree_write_node(tree, right_page, &right);
+
+    long long separator[TREE_MAX_KEY_SIZE / sizeof(long long)];
+    memcpy(separator, tree_key(layout, &right, 0), key_size);
+    long long child_page = right_page;
+
+    // Insere o separador nos nos internos do caminho, dividindo os que estiverem cheios
+    for (int level = depth - 2; level >= 0; level--) {
+        long long parent_page = path[level];
+        TreePage parent;
+        tree_read_node(tree, parent_page, &parent);
+        long long *parent_values = tree_values(layout, &parent);
+        count = parent.header.count;
+        int child = 0;
+        while (child < count && layout->compare(separator, tree_key(layout, &parent, child)) >= 0) {
+            child++;
+        }
+        if (count < max_keys) {
+            memmove(tree_key(layout, &parent, child + 1), tree_key(layout, &parent, child), (count - child) * key_size);
+            memmove(&parent_values[child + 2], &parent_values[child + 1], (count - child) * sizeof(long long));
+            memcpy(tree_key(layout, &parent, child), separator, key_size);
+            parent_values[child + 1] = child_page;
+            parent.header.count++;
+            return tree_write_node(tree, parent_page, &parent);
+        }
+
+        memcpy(keys, tree_key(layout, &parent, 0), child * key_size);
+        memcpy(keys + child * key_size, separator, key_size);
+        memcpy(keys + (child + 1) * key_size, tree_key(layout, &parent, child), (count - child) * key_size);
+        memcpy(values, parent_values, (child + 1) * sizeof(long long));
+        values[child + 1] = child_page;
+        memcpy(&values[child + 2], &parent_values[child + 1], (count - child) * sizeof(long long));
+
+        // A chave do meio sobe; as da esquerda ficam no no atual e as da direita vao para o novo
+        int middle = (max_keys + 1) / 2;
+        TreePage sibling;
+        memset(&sibling, 0, sizeof(TreePage));
+        sibling.header.next = -1;
+        sibling.header.prev = -1;
+        sibling.header.count = max_keys - middle;
+        memcpy(tree_key(layout, &sibling, 0), keys + (middle + 1) * key_size, sibling.header.count * key_size);
+        memcpy(tree_values(layout, &sibling), &values[middle + 1], (sibling.header.count + 1) * sizeof(long long));
+        parent.header.count = middle;
+        memcpy(tree_key(layout, &parent, 0), keys, middle * key_size);
+        memcpy(parent_values, values, (middle + 1) * sizeof(long long));
+
+        long long sibling_page = tree_alloc_node(tree);
+        tree_write_node(tree, parent_page, &parent);
+        tree_write_node(tree, sibling_page, &sibling);
+        memcpy(separator, keys + middle * key_size, key_size);
+        child_page = sibling_page;
+    }
+
+    // A raiz foi dividida: cria uma nova raiz com os dois nos
+    TreePage root;
+    memset(&root, 0, sizeof(TreePage));
+    root.header.next = -1;
+    root.header.prev = -1;
+    root.header.count = 1;
+    memcpy(tree_key(layout, &root, 0), separator, key_size);
+    tree_values(layout, &root)[0] = path[0];
+    tree_values(layout, &root)[1] = child_page;
+    tree->meta.root = tree_alloc_node(tree);
+    return tree_write_node(tree, tree->meta.root, &root);
+}
+
+/*
+ * Remove key da sua folha. Os nos nao sao fundidos: uma folha pode ficar com
+ * poucas chaves ou vazia, o que nao afeta as buscas, e os separadores
+ * continuam validos.
+ */
+int tree_delete(BPTree *tree, const void *key) {
+    const TreeLayout *layout = tree->layout;
+    TreePage leaf;
+    long long page = tree_find_leaf(tree, key, &leaf, NULL, NULL);
+    if (page == -1) {
+        return 0;
+    }
+    int count = leaf.header.count;
+    int pos = tree_leaf_lower_bound(layout, &leaf, key);
+    if (pos == count || layout->compare(tree_key(layout, &leaf, pos), key) != 0) {
+        return 0;
+    }
+    long long *values = tree_values(layout, &leaf);
+    memmove(tree_key(layout, &leaf, pos), tree_key(layout, &leaf, pos + 1), (count - pos - 1) * layout->key_size);
+    memmove(&values[pos], &values[pos + 1], (count - pos - 1) * sizeof(long long));
+    leaf.header.count--;
+    tree_write_node(tree, page, &leaf);
+    return 1;
+}
+
+/*
+ * Arvore B+ em disco (BPT_FILE_NAME) com chave product_id e valor igual ao
+ * indice do registro em products.bin. Contem apenas os produtos ativos.
+ * As buscas por product_id usam a base ordenada; a arvore so e consultada
+ * para achar o predecessor de um produto nos elos.
+ */
+int bpt_compare(const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+const TreeLayout BPT_LAYOUT = {sizeof(long long), BPT_MAX_KEYS, bpt_compare};
+
+int bpt_read_node(BPTree *tree, long long page, BPTreeNode *node) {
+    return tree_read_node(tree, page, node);
+}
+
+/*
+ * Reconstroi a arvore a partir da lista encadeada de products.bin, que ja esta
+ * em ordem de product_id.
+ */
+int bpt_rebuild(Storage *store) {
+    BPTree *tree = &store->tree;
+    TreeBuilder builder;
+    if (tree_build_begin(&builder, tree, BPT_MAGIC) != 0) {
+        return -1;
+    }
+
+    int has_last = 0;
+    long long last_key = 0;
+    long long current_index = store->header.head_index;
+    ProductRecord copy;
+    const ProductRecord *current_record;
+    while (current_index != -1) {
+        if ((current_record = product_at(store, current_index, &copy)) == NULL) {
+            break;
+        }
+        if (current_record->ativo && (!has_last || current_record->product_id > last_key)) {
+            tree_build_add(&builder, &current_record->product_id, current_index);
+            last_key = current_record->product_id;
+            has_last = 1;
+        }
+        current_index = current_record->elo;
+    }
+    return tree_build_finish(&builder);
+}
+
+int bpt_open(Storage *store) {
+    BPTree *tree = &store->tree;
+    tree->pool = &store->tree_pages;
+    tree->layout = &BPT_LAYOUT;
+    if (!tree_meta_current(tree, BPT_MAGIC)) {
+        if (store->reader) {
+            return -1;
+        }
+        if (bpt_rebuild(store) != 0) {
+            printf("Erro ao reconstruir a arvore B+.\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Encontra o maior product_id menor que key. As folhas podem ficar vazias
+ * depois de remocoes, por isso a busca segue para as folhas anteriores.
+ */
+int bpt_predecessor(BPTree *tree, long long key, long long *slot) {
+    BPTreeNode leaf;
+    if (tree_find_leaf(tree, &key, &leaf, NULL, NULL) == -1) {
+        return 0;
+    }
+    int pos = tree_leaf_lower_bound(tree->layout, &leaf, &key);
+    while (pos == 0) {
+        if (leaf.prev == -1 || bpt_read_node(tree, leaf.prev, &leaf) != 0) {
+            return 0;
+        }
+        pos = leaf.count;
+    }
+    *slot = leaf.values[pos - 1];
+    return 1;
+}
+
+int bpt_insert(BPTree *tree, long long key, long long slot) {
+    return tree_insert(tree, &key, slot);
+}
+
+int bpt_delete(BPTree *tree, long long key) {
+    return tree_delete(tree, &key);
+}
+
+/*
+ * Indices secundarios em disco (CATEGORY_INDEX_FILE_NAME e
+ * BRAND_INDEX_FILE_NAME): arvores B+ com chave SecondaryKey, uma entrada por
+ * produto ativo. Para um grupo, as folhas listam os slots em ordem de preco,
+ * entao uma faixa de precos e lida em sequencia. Como products.bpt, guardam o
+ * estado de products.bin e sao reconstruidos se ele mudou por fora.
+ */
+unsigned int price_order_bits(float price) {
+    unsigned int bits;
+    memcpy(&bits, &price, sizeof(bits));
+    return (bits & 0x80000000u) ? ~bits : bits | 0x80000000u;
+}
+
+int sidx_compare(const SecondaryKey *a, const SecondaryKey *b) {
+    if (a->group != b->group) {
+        return a->group < b->group ? -1 : 1;
+    }
+    if (a->price != b->price) {
+        return a->price < b->price ? -1 : 1;
+    }
+    if (a->slot != b->slot) {
+        return a->slot < b->slot ? -1 : 1;
+    }
+    return 0;
+}
+
+SecondaryKey sidx_key(const SecondaryTree *tree, const ProductRecord *record, long long slot) {
+    SecondaryKey key;
+    key.group = tree->by_brand ? (long long)record->brand : record->category_id;
+    key.price = price_order_bits(record->price);
+    key.payload = tree->by_brand ? 0 : record->brand;
+    key.slot = slot;
+    return key;
+}
+
+int sidx_compare_keys(const void *a, const void *b) {
+    return sidx_compare((const SecondaryKey *)a, (const SecondaryKey *)b);
+}
+
+const TreeLayout SIDX_LAYOUT = {sizeof(SecondaryKey), SIDX_MAX_KEYS, sidx_compare_keys};
+
+int sidx_read_node(SecondaryTree *tree, long long page, SecondaryNode *node) {
+    return tree_read_node(&tree->btree, page, node);
+}
+
+/*
+ * Reconstroi o indice lendo products.bin em ordem de posicao: as chaves dos
+ * produtos ativos sao ordenadas em memoria antes de montar a arvore.
+ */
+int sidx_rebuild(Storage *store, SecondaryTree *tree) {
+    pool_truncate(tree->btree.pool);
+
+    long long slot_count = product_count(store);
+    long long key_count = 0;
+    SecondaryKey *keys = malloc((slot_count > 0 ? slot_count : 1) * sizeof(SecondaryKey));
+    if (keys == NULL) {
+        return -1;
+    }
+
+    ProductRecord copy;
+    const ProductRecord *record;
+    pool_advise(&store->data, MADV_SEQUENTIAL);
+    for (long long slot = 0; slot < slot_count; slot++) {
+        if ((record = product_at(store, slot, &copy)) != NULL && record->ativo) {
+            keys[key_count++] = sidx_key(tree, record, slot);
+        }
+    }
+    pool_advise(&store->data, MADV_RANDOM);
+    qsort(keys, key_count, sizeof(SecondaryKey), sidx_compare_keys);
+
+    TreeBuilder builder;
+    if (tree_build_begin(&builder, &tree->btree, SIDX_MAGIC) != 0) {
+        free(keys);
+        return -1;
+    }
+    // As folhas nao usam values: o slot ja esta na chave
+    for (long long i = 0; i < key_count; i++) {
+        tree_build_add(&builder, &keys[i], 0);
+    }
+    free(keys);
+    return tree_build_finish(&builder);
+}
+
+int sidx_open(Storage *store, SecondaryTree *tree, BufferPool *pool, int by_brand) {
+    tree->btree.pool = pool;
+    tree->btree.layout = &SIDX_LAYOUT;
+    tree->by_brand = by_brand;
+    if (!tree_meta_current(&tree->btree, SIDX_MAGIC)) {
+        if (store->reader) {
+            return -1;
+        }
+        if (sidx_rebuild(store, tree) != 0) {
+            printf("Erro ao reconstruir o indice secundario.\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Acrescenta (add = 1) ou retira (add = 0) o produto record, na posicao slot,
+ * dos dois indices secundarios.
+ */
+void sidx_note(Storage *store, const ProductRecord *record, long long slot, int add) {
+    SecondaryTree *trees[2] = {&store->category_tree, &store->brand_tree};
+    for (int i = 0; i < 2; i++) {
+        SecondaryKey key = sidx_key(trees[i], record, slot);
+        if (add) {
+            tree_insert(&trees[i]->btree, &key, 0);
+        } else {
+            tree_delete(&trees[i]->btree, &key);
+        }
+    }
+}
+
+/*
+ * products.col (COLUMN_FILE_NAME) acompanha products.bin como os demais
+ * arquivos derivados: guarda o estado de products.bin, e reconstruido se ele
+ * mudou por fora e e atualizado a cada insercao e remocao. As consultas
+ * analiticas percorrem so as colunas de que precisam.
+ */
+long long column_offset(const ColumnHeader *header, int column) {
+    long long offset = COLUMN_HEADER_SIZE;
+    if (column > COLUMN_PRODUCT_ID) offset += header->capacity * (long long)sizeof(long long);
+    if (column > COLUMN_CATEGORY_ID) offset += header->capacity * (long long)sizeof(long long);
+    if (column > COLUMN_PRICE) offset += header->capacity * (long long)sizeof(float);
+    return offset;
+}
+
+int column_write_header(Storage *store) {
+    return pool_write(&store->columns, 0, &store->column_header, sizeof(ColumnHeader));
+}
+
+/*
+ * Regrava products.col a partir de products.bin com capacity elementos por
+ * coluna, em blocos de COLUMN_BLOCK registros.
+ */
+int column_rebuild(Storage *store, long long capacity) {
+    ColumnHeader *header = &store->column_header;
+    long long count = product_count(store);
+    if (capacity < count) {
+        capacity = count;
+    }
+    memset(header, 0, sizeof(ColumnHeader));
+    memcpy(header->magic, COLUMN_FILE_MAGIC, sizeof(header->magic));
+    header->version = COLUMN_FILE_VERSION;
+    header->count = count;
+    header->capacity = (capacity + 63) / 64 * 64;
+    pool_truncate(&store->columns);
+
+    long long *ids = malloc(COLUMN_BLOCK * sizeof(long long));
+    long long *categories = malloc(COLUMN_BLOCK * sizeof(long long));
+    float *prices = malloc(COLUMN_BLOCK * sizeof(float));
+    unsigned char *active = calloc(header->capacity / 8 > 0 ? header->capacity / 8 : 1, 1);
+    if (ids == NULL || categories == NULL || prices == NULL || active == NULL) {
+        free(ids);
+        free(categories);
+        free(prices);
+        free(active);
+        return -1;
+    }
+
+    ProductRecord copy;
+    const ProductRecord *record;
+    pool_advise(&store->data, MADV_SEQUENTIAL);
+    for (long long first = 0; first < count; first += COLUMN_BLOCK) {
+        long long n = count - first < COLUMN_BLOCK ? count - first : COLUMN_BLOCK;
+        for (long long i = 0; i < n; i++) {
+            if ((record = product_at(store, first + i, &copy)) == NULL) {
+                memset(&copy, 0, sizeof(ProductRecord));
+                record = &copy;
+            }
+            ids[i] = record->product_id;
+            categories[i] = record->category_id;
+            prices[i] = record->price;
+            if (record->ativo) {
+                active[(first + i) / 8] |= (unsigned char)(1u << ((first + i) % 8));
+            }
+        }
+        pool_write(&store->columns, column_offset(header, COLUMN_PRODUCT_ID) + first * (long long)sizeof(long long), ids, n * sizeof(long long));
+        pool_write(&store->columns, column_offset(header, COLUMN_CATEGORY_ID) + first * (long long)sizeof(long long), categories, n * sizeof(long long));
+        pool_write(&store->columns, column_offset(header, COLUMN_PRICE) + first * (long long)sizeof(float), prices, n * sizeof(float));
+    }
+    pool_advise(&store->data, MADV_RANDOM);
+    // O bitmap fica no fim e e gravado inteiro, o que da ao arquivo o tamanho final
+    pool_write(&store->columns, column_offset(header, COLUMN_ACTIVE), active, header->capacity / 8);
+    free(ids);
+    free(categories);
+    free(prices);
+    free(active);
+
+    stamp_data_file(&header->data);
+    return column_write_header(store);
+}
+
+int column_open(Storage *store) {
+    ColumnHeader *header = &store->column_header;
+    DataStamp current;
+    stamp_data_file(&current);
+    if (pool_read(&store->columns, 0, header, sizeof(ColumnHeader)) != 0 ||
+        memcmp(header->magic, COLUMN_FILE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != COLUMN_FILE_VERSION ||
+        header->count != product_count(store) ||
+        !same_data_stamp(&header->data, &current)) {
+        if (store->reader) {
+            return -1;
+        }
+        long long count = product_count(store);
+        if (column_rebuild(store, count + count / 4 + 64) != 0) {
+            printf("Erro ao reconstruir %s.\n", COLUMN_FILE_NAME);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void column_close(Storage *store) {
+    stamp_data_file(&store->column_header.data);
+    column_write_header(store);
+    pool_flush(&store->columns);
+}
+
+/*
+ * Atualiza as colunas da posicao slot com record, que ja foi gravado em
+ * products.bin. Se slot passar da capacidade, o arquivo e reconstruido com o
+ * dobro dela.
+ */
+void column_note(Storage *store, long long slot, const ProductRecord *record) {
+    ColumnHeader *header = &store->column_header;
+    if (slot >= header->capacity) {
+        column_rebuild(store, header->capacity * 2 > slot + 64 ? header->capacity * 2 : slot + 64);
+        return;
+    }
+    pool_write(&store->columns, column_offset(header, COLUMN_PRODUCT_ID) + slot * (long long)sizeof(long long), &record->product_id, sizeof(long long));
+    pool_write(&store->columns, column_offset(header, COLUMN_CATEGORY_ID) + slot * (long long)sizeof(long long), &record->category_id, sizeof(long long));
+    pool_write(&store->columns, column_offset(header, COLUMN_PRICE) + slot * (long long)sizeof(float), &record->price, sizeof(float));
+    unsigned char bits;
+    long long bits_offset = column_offset(header, COLUMN_ACTIVE) + slot / 8;
+    if (pool_read(&store->columns, bits_offset, &bits, 1) == 0) {
+        if (record->ativo) {
+            bits |= (unsigned char)(1u << (slot % 8));
+        } else {
+            bits &= (unsigned char)~(1u << (slot % 8));
+        }
+        pool_write(&store->columns, bits_offset, &bits, 1);
+    }
+    if (slot >= header->count) {
+        header->count = slot + 1;
+        column_write_header(store);
+    }
+}
+
+/*
+ * Conta e soma os precos dos registros ativos de um bloco com preco em
+ * [min_price, max_price] e, se category_id != -1, dessa categoria. active[0]
+ * corresponde ao primeiro registro do bloco. Com AVX2, compara 8 registros por
+ * vez e combina as mascaras com um byte do bitmap.
+ */
+void column_scan_block(const long long *categories, const float *prices, const unsigned char *active, long long n,
+                       long long category_id, float min_price, float max_price, long long *count, double *sum) {
+    long long i = 0;
+    long long found = 0;
+    double total = 0.0;
+#if defined(__AVX2__)
+    const __m256 low = _mm256_set1_ps(min_price);
+    const __m256 high = _mm256_set1_ps(max_price);
+    const __m256i category = _mm256_set1_epi64x(category_id);
+    const __m256i lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    __m256d total_low = _mm256_setzero_pd();
+    __m256d total_high = _mm256_setzero_pd();
+    for (; i + 8 <= n; i += 8) {
+        __m256 price = _mm256_loadu_ps(prices + i);
+        __m256 in_range = _mm256_and_ps(_mm256_cmp_ps(price, low, _CMP_GE_OQ), _mm256_cmp_ps(price, high, _CMP_LE_OQ));
+        int bits = _mm256_movemask_ps(in_range) & active[i / 8];
+        if (category_id != -1) {
+            __m256i first = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *)(categories + i)), category);
+            __m256i second = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *)(categories + i + 4)), category);
+            bits &= _mm256_movemask_pd(_mm256_castsi256_pd(first)) | (_mm256_movemask_pd(_mm256_castsi256_pd(second)) << 4);
+        }
+        if (bits == 0) {
+            continue;
+        }
+        found += __builtin_popcount(bits);
+        __m256i lanes = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(bits), lane_bits), lane_bits);
+        __m256 selected = _mm256_and_ps(price, _mm256_castsi256_ps(lanes));
+        total_low = _mm256_add_pd(total_low, _mm256_cvtps_pd(_mm256_castps256_ps128(selected)));
+        total_high = _mm256_add_pd(total_high, _mm256_cvtps_pd(_mm256_extractf128_ps(selected, 1)));
+    }
+    double lanes_total[4];
+    _mm256_storeu_pd(lanes_total, _mm256_add_pd(total_low, total_high));
+    total = lanes_total[0] + lanes_total[1] + lanes_total[2] + lanes_total[3];
+#endif
+    for (; i < n; i++) {
+        if ((active[i / 8] >> (i % 8)) & 1 && prices[i] >= min_price && prices[i] <= max_price &&
+            (category_id == -1 || categories[i] == category_id)) {
+            found++;
+            total += prices[i];
+        }
+    }
+    *count += found;
+    *sum += total;
+}
+
+/*
+ * Varredura de column_scan sobre o estado carregado, usando categories, prices
+ * e active para os blocos que nao estiverem mapeados. Retorna -1 se um bloco
+ * nao puder ser lido.
+ */
+int column_scan_blocks(Storage *store, long long category_id, float min_price, float max_price,
+                       long long *categories, float *prices, unsigned char *active, long long *count, double *sum) {
+    ColumnHeader *header = &store->column_header;
+    *count = 0;
+    *sum = 0.0;
+    for (long long first = 0; first < header->count; first += COLUMN_BLOCK) {
+        long long n = header->count - first < COLUMN_BLOCK ? header->count - first : COLUMN_BLOCK;
+        long long categories_offset = column_offset(header, COLUMN_CATEGORY_ID) + first * (long long)sizeof(long long);
+        long long prices_offset = column_offset(header, COLUMN_PRICE) + first * (long long)sizeof(float);
+        long long active_offset = column_offset(header, COLUMN_ACTIVE) + first / 8;
+        const long long *block_categories = pool_pointer(&store->columns, categories_offset, n * sizeof(long long));
+        const float *block_prices = pool_pointer(&store->columns, prices_offset, n * sizeof(float));
+        const unsigned char *block_active = pool_pointer(&store->columns, active_offset, (n + 7) / 8);
+        if (block_categories == NULL || block_prices == NULL || block_active == NULL) {
+            if ((category_id != -1 && pool_read(&store->columns, categories_offset, categories, n * sizeof(long long)) != 0) ||
+                pool_read(&store->columns, prices_offset, prices, n * sizeof(float)) != 0 ||
+                pool_read(&store->columns, active_offset, active, (n + 7) / 8) != 0) {
+                return -1;
+            }
+            block_categories = categories;
+            block_prices = prices;
+            block_active = active;
+        }
+        column_scan_block(block_categories, block_prices, block_active, n, category_id, min_price, max_price, count, sum);
+    }
+    return 0;
+}
+
+/*
+ * Filtro de Bloom em blocos (products.bloom) sobre os product_ids ativos, para
+ * que buscas por produtos inexistentes terminem sem ler products.bin nem a
+ * arvore. Cada chave marca um bit em cada uma das BLOOM_BLOCK_WORDS palavras
+ * de um unico bloco de 32 bytes, entao uma consulta le um so bloco. O filtro e
+ * montado por create_partial_index, recebe as insercoes e, como bits nao
+ * podem ser apagados, e reconstruido quando as remocoes passam da metade das
+ * chaves ou as insercoes passam do dobro do dimensionado.
+ */
+static const unsigned int BLOOM_SALTS[BLOOM_BLOCK_WORDS] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+unsigned long long bloom_hash(long long key) {
+    unsigned long long hash = (unsigned long long)key + 0x9e3779b97f4a7c15ULL;
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+    return hash ^ (hash >> 31);
+}
+
+long long bloom_block_offset(const BloomHeader *header, unsigned long long hash) {
+    long long block = (long long)(((hash >> 32) * (unsigned long long)header->block_count) >> 32);
+    return BLOOM_HEADER_SIZE + block * BLOOM_BLOCK_WORDS * (long long)sizeof(unsigned int);
+}
+
+int bloom_write_header(Storage *store) {
+    return pool_write(&store->bloom, 0, &store->bloom_header, sizeof(BloomHeader));
+}
+
+/*
+ * Esvazia o filtro e o dimensiona para expected_keys chaves.
+ */
+void bloom_reset(Storage *store, long long expected_keys) {
+    BloomHeader *header = &store->bloom_header;
+    memset(header, 0, sizeof(BloomHeader));
+    memcpy(header->magic, BLOOM_MAGIC, sizeof(header->magic));
+    header->block_count = (expected_keys + BLOOM_KEYS_PER_BLOCK - 1) / BLOOM_KEYS_PER_BLOCK;
+    if (header->block_count < 1) {
+        header->block_count = 1;
+    }
+    pool_truncate(&store->bloom);
+
+    char zeros[POOL_PAGE_SIZE] = {0};
+    long long size = header->block_count * BLOOM_BLOCK_WORDS * (long long)sizeof(unsigned int);
+    for (long long offset = 0; offset < size; offset += POOL_PAGE_SIZE) {
+        size_t chunk = size - offset < POOL_PAGE_SIZE ? (size_t)(size - offset) : POOL_PAGE_SIZE;
+        pool_write(&store->bloom, BLOOM_HEADER_SIZE + offset, zeros, chunk);
+    }
+    bloom_write_header(store);
+}
+
+/*
+ * Marca product_id no filtro sem atualizar o cabecalho (usada nas montagens).
+ */
+void bloom_set(Storage *store, long long product_id) {
+    unsigned long long hash = bloom_hash(product_id);
+    long long offset = bloom_block_offset(&store->bloom_header, hash);
+    unsigned int words[BLOOM_BLOCK_WORDS];
+    if (pool_read(&store->bloom, offset, words, sizeof(words)) != 0) {
+        return;
+    }
+    for (int i = 0; i < BLOOM_BLOCK_WORDS; i++) {
+        words[i] |= 1u << (((unsigned int)hash * BLOOM_SALTS[i]) >> 27);
+    }
+    pool_write(&store->bloom, offset, words, sizeof(words));
+    store->bloom_header.key_count++;
+}
+
+/*
+ * Retorna 0 se product_id certamente nao esta entre os produtos ativos, ou 1
+ * se ele pode estar.
+ */
+int bloom_may_contain(Storage *store, long long product_id) {
+    unsigned long long hash = bloom_hash(product_id);
+    long long offset = bloom_block_offset(&store->bloom_header, hash);
+    unsigned int copy[BLOOM_BLOCK_WORDS];
+    const unsigned int *words = pool_pointer(&store->bloom, offset, sizeof(copy));
+    if (words == NULL) {
+        if (pool_read(&store->bloom, offset, copy, sizeof(copy)) != 0) {
+            return 1;
+        }
+        words = copy;
+    }
+    for (int i = 0; i < BLOOM_BLOCK_WORDS; i++) {
+        if (!(words[i] & (1u << (((unsigned int)hash * BLOOM_SALTS[i]) >> 27)))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void bloom_finish(Storage *store) {
+    stamp_data_file(&store->bloom_header.data);
+    bloom_write_header(store);
+}
+
+/*
+ * Remonta o filtro lendo products.bin em ordem de posicao.
+ */
+void bloom_rebuild(Storage *store) {
+    long long slot_count = product_count(store);
+    bloom_reset(store, slot_count + slot_count / 4 + 64);
+    ProductRecord copy;
+    const ProductRecord *record;
+    pool_advise(&store->data, MADV_SEQUENTIAL);
+    for (long long slot = 0; slot < slot_count; slot++) {
+        if ((record = product_at(store, slot, &copy)) != NULL && record->ativo) {
+            bloom_set(store, record->product_id);
+        }
+    }
+    pool_advise(&store->data, MADV_RANDOM);
+    bloom_finish(store);
+}
+
+void bloom_note_insert(Storage *store, long long product_id) {
+    bloom_set(store, product_id);
+    if (store->bloom_header.key_count > 2 * store->bloom_header.block_count * BLOOM_KEYS_PER_BLOCK) {
+        bloom_rebuild(store);
+    } else {
+        bloom_write_header(store);
+    }
+}
+
+void bloom_note_remove(Storage *store) {
+    store->bloom_header.removed++;
+    if (2 * store->bloom_header.removed > store->bloom_header.key_count) {
+        bloom_rebuild(store);
+    } else {
+        bloom_write_header(store);
+    }
+}
+
+/*
+ * Carrega o cabecalho do filtro, remontando-o se ele nao existir ou for de
+ * uma versao anterior de products.bin.
+ */
+int bloom_open(Storage *store) {
+    BloomHeader *header = &store->bloom_header;
+    DataStamp current;
+    stamp_data_file(&current);
+    if (pool_read(&store->bloom, 0, header, sizeof(BloomHeader)) != 0 ||
+        memcmp(header->magic, BLOOM_MAGIC, sizeof(header->magic)) != 0 ||
+        header->block_count < 1 ||
+        !same_data_stamp(&header->data, &current)) {
+        if (store->reader) {
+            return -1;
+        }
+        bloom_rebuild(store);
+    }
+    return 0;
+}
+
+void bloom_close(Storage *store) {
+    bloom_finish(store);
+    pool_flush(&store->bloom);
+}
+
+int read_index_entry(Storage *store, long long position, IndexRecord *entry) {
+    return pool_read(&store->index, (long long)sizeof(IndexHeader) + position * (long long)sizeof(IndexRecord), entry, sizeof(IndexRecord));
+}
+
+int write_index_entry(Storage *store, long long position, const IndexRecord *entry) {
+    // So o contador mudou: a copia em memoria e atualizada no lugar
+    IndexCache *cache = &store->index_cache;
+    if (cache->valid && position < cache->count && cache->entries[position].product_id == entry->product_id) {
+        long long delta = entry->count - cache->entries[position].count;
+        for (long long i = position + 1; i <= cache->count; i += i & -i) {
+            cache->rank_tree[i] += delta;
+        }
+        cache->entries[position] = *entry;
+    } else {
+        cache->valid = 0;
+    }
+    return pool_write(&store->index, (long long)sizeof(IndexHeader) + position * (long long)sizeof(IndexRecord), entry, sizeof(IndexRecord));
+}
+
+int write_index_header(Storage *store) {
+    if (store->index_header.entry_count != store->index_cache.count) {
+        store->index_cache.valid = 0;
+    }
+    return pool_write(&store->index, 0, &store->index_header, sizeof(IndexHeader));
+}
+
+/*
+ * Cria o indice parcial: uma entrada a cada records_per_index produtos ativos,
+ * na ordem dos elos, com o numero de produtos ativos que ela cobre. O filtro
+ * de Bloom e remontado na mesma passada.
+ */
+int create_partial_index(Storage *store, int records_per_index) {
+    store->index_cache.valid = 0;
+    if (pool_truncate(&store->index) != 0) {
+        perror("Erro ao criar o arquivo de indice");
+        return -1;
+    }
+    long long slot_count = product_count(store);
+    bloom_reset(store, slot_count + slot_count / 4 + 64);
+
+    long long current_index = store->header.head_index;
+    ProductRecord copy;
+    const ProductRecord *current_record;
+    long long count = 0;
+    long long index_count = 0;
+    IndexRecord idx_record;
+
+    // O arquivo gerado ja esta em ordem de product_id, entao seguir os elos
+    // percorre os registros quase sempre em ordem de posicao
+    pool_advise(&store->data, MADV_SEQUENTIAL);
+    while (current_index != -1) {
+        if ((current_record = product_at(store, current_index, &copy)) == NULL) {
+            break;
+        }
+
+        if (current_record->ativo) {
+            if (count % records_per_index == 0) {
+                if (count > 0) {
+                    write_index_entry(store, index_count++, &idx_record);
+                }
+                idx_record.product_id = current_record->product_id;
+                idx_record.record_index = current_index;
+                idx_record.count = 0;
+            }
+            idx_record.count++;
+            count++;
+            bloom_set(store, current_record->product_id);
+        }
+
+        current_index = current_record->elo;
+    }
+    if (count > 0) {
+        write_index_entry(store, index_count++, &idx_record);
+    }
+    pool_advise(&store->data, MADV_RANDOM);
+
+    IndexHeader *header = &store->index_header;
+    memset(header, 0, sizeof(IndexHeader));
+    memcpy(header->magic, INDEX_MAGIC, sizeof(header->magic));
+    header->records_per_index = records_per_index;
+    header->entry_count = index_count;
+    stamp_data_file(&header->data);
+    write_index_header(store);
+    pool_flush(&store->index);
+    bloom_finish(store);
+
+    printf("Indice parcial criado com sucesso.\n");
+    return 0;
+}
+
+
+long long index_cache_fill(IndexCache *cache, long long next, long long k) {
+    if (k <= cache->count) {
+        next = index_cache_fill(cache, next, 2 * k);
+        cache->keys[k] = cache->entries[next].product_id;
+        cache->ranks[k] = next;
+        next = index_cache_fill(cache, next + 1, 2 * k + 1);
+    }
+    return next;
+}
+
+/*
+ * Carrega o indice em memoria se ele foi alterado por este processo ou se
+ * products.idx mudou no disco (por exemplo, atualizado por outro processo). O
+ * disco e consultado no maximo a cada INDEX_CHECK_INTERVAL_NS.
+ */
+int index_cache_load(Storage *store) {
+    IndexCache *cache = &store->index_cache;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long now_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+    if (cache->valid && now_ns - cache->checked_at < INDEX_CHECK_INTERVAL_NS) {
+        return 0;
+    }
+    cache->checked_at = now_ns;
+
+    DataStamp current;
+    stamp_file(INDEX_FILE_NAME, &current);
+    if (!same_data_stamp(&cache->file, &current)) {
+        pool_refresh(&store->index);
+        if (pool_read(&store->index, 0, &store->index_header, sizeof(IndexHeader)) != 0) {
+            store->index_header.entry_count = 0;
+        }
+        stamp_file(INDEX_FILE_NAME, &current);
+        cache->valid = 0;
+    }
+    if (cache->valid) {
+        return 0;
+    }
+
+    long long count = store->index_header.entry_count;
+    free(cache->keys);
+    free(cache->ranks);
+    free(cache->entries);
+    free(cache->rank_tree);
+    cache->keys = NULL;
+    cache->valid = 0;
+    cache->count = 0;
+    cache->ranks = malloc((count + 1) * sizeof(long long));
+    cache->entries = malloc((count + 1) * sizeof(IndexRecord));
+    cache->rank_tree = malloc((count + 1) * sizeof(long long));
+    if (posix_memalign((void **)&cache->keys, 64, (count + 1) * sizeof(long long)) != 0 ||
+        cache->ranks == NULL || cache->entries == NULL || cache->rank_tree == NULL ||
+        (count > 0 && pool_read(&store->index, sizeof(IndexHeader), cache->entries, count * sizeof(IndexRecord)) != 0)) {
+        return -1;
+    }
+    cache->count = count;
+    index_cache_fill(cache, 0, 1);
+    for (long long i = 1; i <= count; i++) {
+        cache->rank_tree[i] = cache->entries[i - 1].count;
+    }
+    for (long long i = 1; i <= count; i++) {
+        long long parent = i + (i & -i);
+        if (parent <= count) {
+            cache->rank_tree[parent] += cache->rank_tree[i];
+        }
+    }
+    cache->file = current;
+    cache->valid = 1;
+    return 0;
+}
+
+void index_cache_free(IndexCache *cache) {
+    free(cache->keys);
+    free(cache->ranks);
+    free(cache->entries);
+    free(cache->rank_tree);
+    memset(cache, 0, sizeof(IndexCache));
+}
+
+/*
+ * Encontra a entrada com a maior chave menor ou igual ao alvo (ou a primeira,
+ * se o alvo for menor que todas). Retorna a posicao da entrada, ou -1 se o
+ * indice estiver vazio.
+ */
+int binary_search_index(Storage *store, long long target_product_id, IndexRecord *result) {
+    IndexCache *cache = &store->index_cache;
+    if (index_cache_load(store) != 0 || cache->count == 0) {
+        return -1;
+    }
+
+    // Desce sem desvios ate abaixo das folhas; os bits de k guardam o caminho,
+    // e descartar os ultimos passos a direita leva a primeira chave maior que o alvo
+    long long k = 1;
+    while (k <= cache->count) {
+        __builtin_prefetch(cache->keys + 8 * k);
+        k = 2 * k + (cache->keys[k] <= target_product_id);
+    }
+    k >>= __builtin_ffsll(~k);
+    long long position = (k == 0 ? cache->count : cache->ranks[k]) - 1;
+    if (position < 0) {
+        position = 0;
+    }
+    *result = cache->entries[position];
+    return (int)position;
+}
+
+/*
+ * Encontra a entrada que contem o produto ativo de posicao rank (a partir de 0)
+ * na ordem dos elos e guarda em before quantos produtos vem antes da sua
+ * ancora. Retorna a posicao da entrada, ou -1 se houver rank produtos ou menos.
+ */
+long long index_seek_rank(Storage *store, long long rank, IndexRecord *result, long long *before) {
+    IndexCache *cache = &store->index_cache;
+    if (index_cache_load(store) != 0 || cache->count == 0 || rank < 0) {
+        return -1;
+    }
+
+    long long position = 0;
+    long long remaining = rank;
+    long long step = 1;
+    while (step * 2 <= cache->count) {
+        step *= 2;
+    }
+    for (; step > 0; step >>= 1) {
+        if (position + step <= cache->count && cache->rank_tree[position + step] <= remaining) {
+            position += step;
+            remaining -= cache->rank_tree[position];
+        }
+    }
+    if (position == cache->count) {
+        return -1;
+    }
+    *result = cache->entries[position];
+    *before = rank - remaining;
+    return position;
+}
+
+/*
+ * Atualiza o indice depois da insercao de um produto ativo: so a entrada que
+ * cobre product_id muda (ou a primeira, se ele passar a ser o menor). O indice
+ * e reconstruido quando o trecho passa de INDEX_MAX_SPAN produtos. Retorna 1
+ * se o indice foi reconstruido (e portanto ja inclui todos os registros
+ * gravados), ou 0.
+ */
+int index_note_insert(Storage *store, long long product_id, long long slot) {
+    IndexRecord entry;
+    if (store->index_header.entry_count == 0) {
+        entry.product_id = product_id;
+        entry.record_index = slot;
+        entry.count = 1;
+        write_index_entry(store, 0, &entry);
+        store->index_header.entry_count = 1;
+        write_index_header(store);
+        return 0;
+    }
+
+    long long position = binary_search_index(store, product_id, &entry);
+    if (position == -1 || entry.product_id > product_id) {
+        // Novo menor produto: passa a ser a ancora da primeira entrada
+        position = 0;
+        read_index_entry(store, 0, &entry);
+        entry.product_id = product_id;
+        entry.record_index = slot;
+    }
+    entry.count++;
+    write_index_entry(store, position, &entry);
+    if (entry.count > INDEX_MAX_SPAN) {
+        create_partial_index(store, RECORDS_PER_INDEX);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Atualiza o indice depois que o produto removed, na posicao slot, foi
+ * retirado dos elos (removed guarda o elo que ele tinha). Se ele era a ancora
+ * da entrada, a entrada passa para o proximo produto ativo nos elos; uma entrada sem produtos e retirada do indice. O
+ * indice e reconstruido quando um trecho que nao e o ultimo fica com menos de
+ * INDEX_MIN_SPAN produtos. Retorna 1 se o indice foi reconstruido, ou 0.
+ */
+int index_note_remove(Storage *store, const ProductRecord *removed, long long slot) {
+    IndexRecord entry;
+    long long position = binary_search_index(store, removed->product_id, &entry);
+    if (position == -1) {
+        create_partial_index(store, RECORDS_PER_INDEX);
+        return 1;
+    }
+
+    entry.count--;
+    if (entry.count == 0) {
+        IndexRecord next_entry;
+        for (long long i = position + 1; i < store->index_header.entry_count; i++) {
+            read_index_entry(store, i, &next_entry);
+            write_index_entry(store, i - 1, &next_entry);
+        }
+        store->index_header.entry_count--;
+        write_index_header(store);
+        return 0;
+    }
+
+    if (entry.record_index == slot) {
+        long long next_index = removed->elo;
+        ProductRecord copy;
+        const ProductRecord *next_record = NULL;
+        while (next_index != -1 && (next_record = product_at(store, next_index, &copy)) != NULL && !next_record->ativo) {
+            next_index = next_record->elo;
+        }
+        if (next_index == -1 || next_record == NULL) {
+            create_partial_index(store, RECORDS_PER_INDEX);
+            return 1;
+        }
+        entry.product_id = next_record->product_id;
+        entry.record_index = next_index;
+    }
+    write_index_entry(store, position, &entry);
+    if (entry.count < INDEX_MIN_SPAN && position < store->index_header.entry_count - 1) {
+        create_partial_index(store, RECORDS_PER_INDEX);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Carrega o cabecalho do indice parcial, reconstruindo o indice se ele nao
+ * existir, tiver outro espacamento ou for de uma versao anterior de
+ * products.bin.
+ */
+int index_open(Storage *store) {
+    DataStamp current;
+    stamp_data_file(&current);
+    if (pool_read(&store->index, 0, &store->index_header, sizeof(IndexHeader)) != 0 ||
+        memcmp(store->index_header.magic, INDEX_MAGIC, sizeof(store->index_header.magic)) != 0 ||
+        store->index_header.records_per_index != RECORDS_PER_INDEX ||
+        !same_data_stamp(&store->index_header.data, &current)) {
+        return store->reader ? -1 : create_partial_index(store, RECORDS_PER_INDEX);
+    }
+    return 0;
+}
+
+/*
+ * Registra o estado atual de products.bin no cabecalho do indice. Como
+ * tree_close, deve ser chamada depois que products.bin ja foi gravado.
+ */
+void index_close(Storage *store) {
+    stamp_data_file(&store->index_header.data);
+    write_index_header(store);
+}
+
+/*
+ * Reaplica em products.bin as transacoes confirmadas de products.wal, cortando
+ * o arquivo no tamanho da ultima delas. Um log nao vazio indica que o ultimo
+ * escritor nao publicou as suas paginas (ver storage_publish): products.bin e
+ * tocado para que os arquivos derivados, que podem ter paginas de transacoes
+ * perdidas, sejam reconstruidos.
+ */
+int wal_recover(Storage *store) {
+    WriteAheadLog *wal = &store->wal;
+    struct stat st;
+    if (fstat(wal->fd, &st) != 0) {
+        perror("Erro ao ler o log de escrita antecipada");
+        return -1;
+    }
+    if (st.st_size == 0) {
+        return 0;
+    }
+
+    char *log = malloc((size_t)st.st_size);
+    if (log == NULL || pread(wal->fd, log, (size_t)st.st_size, 0) != (ssize_t)st.st_size) {
+        perror("Erro ao ler o log de escrita antecipada");
+        free(log);
+        return -1;
+    }
+    size_t length = (size_t)st.st_size;
+    size_t position = 0;
+    size_t transaction = 0;
+    unsigned long long checksum = WAL_CHECKSUM_SEED;
+    long long file_size = -1;
+    long long applied = 0;
+    int failed = 0;
+    WalRecord record;
+
+    // Para no primeiro registro incompleto ou invalido: o fim do log pode ter
+    // sido gravado pela metade
+    while (!failed && position + sizeof(WalRecord) <= length) {
+        memcpy(&record, log + position, sizeof(WalRecord));
+        if (record.type == WAL_WRITE) {
+            if (record.length > length - position - sizeof(WalRecord)) {
+                break;
+            }
+            checksum = wal_checksum(checksum, &record, sizeof(WalRecord));
+            checksum = wal_checksum(checksum, log + position + sizeof(WalRecord), record.length);
+            position += sizeof(WalRecord) + record.length;
+            continue;
+        }
+        if (record.type == WAL_COMMIT && record.checksum == checksum) {
+            for (size_t p = transaction; p < position && !failed;) {
+                WalRecord write_record;
+                memcpy(&write_record, log + p, sizeof(WalRecord));
+                failed = pwrite(store->data.fd, log + p + sizeof(WalRecord), write_record.length, write_record.offset) !=
+                         (ssize_t)write_record.length;
+                p += sizeof(WalRecord) + write_record.length;
+            }
+            applied++;
+        } else if (record.type != WAL_START) {
+            break;
+        }
+        file_size = record.offset;
+        position += sizeof(WalRecord);
+        transaction = position;
+        checksum = WAL_CHECKSUM_SEED;
+    }
+    free(log);
+    if (failed || (file_size >= 0 && ftruncate(store->data.fd, file_size) != 0) ||
+        futimens(store->data.fd, NULL) != 0 || fsync(store->data.fd) != 0 || pool_refresh(&store->data) != 0) {
+        perror("Erro ao reaplicar o log de escrita antecipada");
+        return -1;
+    }
+    printf("Recuperacao: %lld transacoes reaplicadas a partir de %s.\n", applied, WAL_FILE_NAME);
+    return 0;
+}
+
+/*
+ * Abre products.wal, recupera o que ele tiver (ver wal_recover) e passa as
+ * escritas em products.bin pelo log. So deve ser chamada com o lock de
+ * escrita (ver lease_acquire).
+ */
+int wal_open(Storage *store) {
+    WriteAheadLog *wal = &store->wal;
+    memset(wal, 0, sizeof(WriteAheadLog));
+    wal->fd = open(WAL_FILE_NAME, O_RDWR | O_CREAT, 0644);
+    if (wal->fd < 0) {
+        perror("Erro ao abrir o log de escrita antecipada");
+        return -1;
+    }
+    if (wal_recover(store) != 0 || wal_restart(wal, store->data.file_size) != 0) {
+        close(wal->fd);
+        return -1;
+    }
+    store->data.wal = wal;
+    return 0;
+}
+
+/*
+ * Fecha o log sem mexer nele: o log so e esvaziado em storage_publish, depois
+ * que products.bin recebeu as paginas, e o que sobrar e recuperado pelo
+ * proximo escritor.
+ */
+void wal_close(WriteAheadLog *wal) {
+    close(wal->fd);
+    free(wal->buffer);
+}
+
+/*
+ * Abre o pool de products.bin e o seu log, recuperando o que o log tiver.
+ */
+int data_open(Storage *store) {
+    if (pool_open(&store->data, ORIGINAL_FILE_NAME, DATA_POOL_FRAMES, store->pool_flags) != 0) {
+        return -1;
+    }
+    if (wal_open(store) != 0) {
+        pool_close(&store->data);
+        return -1;
+    }
+    return 0;
+}
+
+void data_close(Storage *store) {
+    store->data.wal = NULL;
+    pool_close(&store->data);
+    wal_close(&store->wal);
+}
+
+/*
+ * Reabre o pool de products.bin se o arquivo foi trocado por uma compactacao
+ * feita por outro handle.
+ */
+int data_reload(Storage *store) {
+    struct stat named, opened;
+    if (stat(ORIGINAL_FILE_NAME, &named) != 0 || fstat(store->data.fd, &opened) != 0) {
+        return -1;
+    }
+    if (named.st_ino == opened.st_ino && named.st_dev == opened.st_dev) {
+        return 0;
+    }
+    pool_close(&store->data);
+    if (pool_open(&store->data, ORIGINAL_FILE_NAME, DATA_POOL_FRAMES, store->pool_flags) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    store->data.wal = store->reader ? NULL : &store->wal;
+    store->data.snapshot = store->reader ? &store->snapshot : NULL;
+    return 0;
+}
+
+/*
+ * Abre products.lock e mapeia o estado compartilhado. O arquivo so cresce ate
+ * sizeof(SharedState), entao abrir de novo nunca zera a versao.
+ */
+int lock_open(Storage *store) {
+    struct stat st;
+    store->lease = 0;
+    store->lock_fd = open(LOCK_FILE_NAME, O_RDWR | O_CREAT, 0644);
+    if (store->lock_fd < 0 || fstat(store->lock_fd, &st) != 0 ||
+        (st.st_size < (off_t)sizeof(SharedState) && ftruncate(store->lock_fd, sizeof(SharedState)) != 0)) {
+        perror("Erro ao abrir o arquivo de lock");
+        if (store->lock_fd >= 0) {
+            close(store->lock_fd);
+        }
+        return -1;
+    }
+    store->shared = mmap(NULL, sizeof(SharedState), PROT_READ | PROT_WRITE, MAP_SHARED, store->lock_fd, 0);
+    if (store->shared == MAP_FAILED) {
+        perror("Erro ao mapear o arquivo de lock");
+        close(store->lock_fd);
+        return -1;
+    }
+    store->snapshot.shared = store->shared;
+    return 0;
+}
+
+void lock_close(Storage *store) {
+    munmap(store->shared, sizeof(SharedState));
+    // Fechar o descritor tambem solta o lock de escrita
+    close(store->lock_fd);
+    store->lease = 0;
+}
+
+/*
+ * Obtem o lock de escrita, um lock de descricao de arquivo aberto (OFD) no
+ * primeiro byte de products.lock: ele e exclusivo entre processos e entre
+ * handles do mesmo processo, e o sistema o solta se o processo morrer.
+ * Enquanto espera, o escritor fica contado em writers_waiting, o que faz o
+ * dono do lock publicar e solta-lo no proximo commit; parado, o dono o solta
+ * em ate PUBLISH_DELAY_NS (ver storage_publisher).
+ */
+int lease_acquire(Storage *store) {
+    struct flock lock;
+    memset(&lock, 0, sizeof(struct flock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_len = 1;
+    __atomic_add_fetch(&store->shared->writers_waiting, 1, __ATOMIC_SEQ_CST);
+    int result;
+    while ((result = fcntl(store->lock_fd, F_OFD_SETLKW, &lock)) != 0 && errno == EINTR) {
+    }
+    __atomic_sub_fetch(&store->shared->writers_waiting, 1, __ATOMIC_SEQ_CST);
+    if (result != 0) {
+        perror("Erro ao obter o lock de escrita");
+        return -1;
+    }
+    store->lease = 1;
+    return 0;
+}
+
+void lease_release(Storage *store) {
+    struct flock lock;
+    memset(&lock, 0, sizeof(struct flock));
+    lock.l_type = F_UNLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_len = 1;
+    fcntl(store->lock_fd, F_OFD_SETLK, &lock);
+    store->lease = 0;
+}
+
+/*
+ * Indica se ha um escritor vivo com o lock de escrita.
+ */
+int lease_held_elsewhere(Storage *store) {
+    struct flock lock;
+    memset(&lock, 0, sizeof(struct flock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_len = 1;
+    return fcntl(store->lock_fd, F_OFD_GETLK, &lock) != 0 || lock.l_type != F_UNLCK;
+}
+
+/*
+ * A versao fica impar entre publish_begin e publish_end: leitores nao
+ * comecam uma leitura nesse intervalo e descartam as que o cruzarem.
+ */
+void publish_begin(Storage *store) {
+    __atomic_or_fetch(&store->shared->version, 1, __ATOMIC_SEQ_CST);
+}
+
+void publish_end(Storage *store) {
+    unsigned long long version = (__atomic_load_n(&store->shared->version, __ATOMIC_SEQ_CST) | 1) + 1;
+    __atomic_store_n(&store->shared->version, version, __ATOMIC_SEQ_CST);
+    store->snapshot.version = version;
+}
+
+/*
+ * Os pools de um handle, na ordem em que os arquivos sao abertos.
+ */
+#define STORAGE_POOL_COUNT 7
+
+void storage_pools(Storage *store, BufferPool **pools) {
+    pools[0] = &store->data;
+    pools[1] = &store->tree_pages;
+    pools[2] = &store->index;
+    pools[3] = &store->bloom;
+    pools[4] = &store->category_pages;
+    pools[5] = &store->brand_pages;
+    pools[6] = &store->columns;
+}
+
+/*
+ * Publica o que o escritor acumulou desde a ultima publicacao: o log recebe
+ * fsync, as paginas pendentes de products.bin vao para o arquivo, os
+ * arquivos derivados registram o novo estado de products.bin e recebem as
+ * suas paginas, e so entao a versao compartilhada avanca. Com release, o lock
+ * de escrita e solto no fim; senao o log e reiniciado para as proximas
+ * transacoes. Sem o lock de escrita, nao ha nada a publicar.
+ */
+int storage_publish(Storage *store, int release) {
+    if (!store->lease) {
+        return 0;
+    }
+    WriteAheadLog *wal = &store->wal;
+    BufferPool *pools[STORAGE_POOL_COUNT];
+    storage_pools(store, pools);
+    int changed = wal->in_transaction || (__atomic_load_n(&store->shared->version, __ATOMIC_SEQ_CST) & 1);
+    for (int i = 0; i < STORAGE_POOL_COUNT; i++) {
+        changed |= pools[i]->pending_count > 0 || pools[i]->stable_size != pools[i]->file_size;
+    }
+    if (!changed) {
+        if (release) {
+            if (ftruncate(wal->fd, 0) != 0) {
+                perror("Erro ao esvaziar o log de escrita antecipada");
+            }
+            lease_release(store);
+        }
+        return 0;
+    }
+    int failed = wal_end_transaction(wal, store->data.file_size) != 0 || wal_sync(wal) != 0;
+    if (!failed) {
+        publish_begin(store);
+        failed = pool_checkpoint(&store->data) != 0;
+    }
+    if (!failed) {
+        tree_close(&store->tree);
+        index_close(store);
+        bloom_close(store);
+        tree_close(&store->category_tree.btree);
+        tree_close(&store->brand_tree.btree);
+        column_close(store);
+        failed = pool_checkpoint(&store->tree_pages) != 0 || pool_checkpoint(&store->index) != 0 ||
+                 pool_checkpoint(&store->bloom) != 0 || pool_checkpoint(&store->category_pages) != 0 ||
+                 pool_checkpoint(&store->brand_pages) != 0 || pool_checkpoint(&store->columns) != 0;
+    }
+    // products.bin precisa estar no disco antes de o log ser descartado
+    if (!failed && fsync(store->data.fd) != 0) {
+        perror("Erro ao sincronizar o arquivo de dados");
+        failed = 1;
+    }
+    if (!failed) {
+        if (release) {
+            if (ftruncate(wal->fd, 0) != 0 || fdatasync(wal->fd) != 0) {
+                perror("Erro ao esvaziar o log de escrita antecipada");
+            }
+        } else {
+            wal_restart(wal, store->data.file_size);
+        }
+        publish_end(store);
+        stamp_file(INDEX_FILE_NAME, &store->index_cache.file);
+    }
+    if (release) {
+        lease_release(store);
+    }
+    return failed ? -1 : 0;
+}
+
+long long monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/*
+ * Confirma a transacao aberta em products.bin. As transacoes sao publicadas
+ * em grupo, com um so fsync do log: a cada WAL_GROUP_COMMITS transacoes,
+ * WAL_GROUP_BYTES bytes de log ou WAL_CHECKPOINT_PAGES paginas pendentes,
+ * quando vence o prazo do grupo (ver storage_end_write) ou logo que outro
+ * escritor estiver esperando o lock de escrita, que essa publicacao solta.
+ * Uma queda perde no maximo o grupo aberto, sempre em transacoes inteiras.
+ */
+void wal_commit(Storage *store) {
+    WriteAheadLog *wal = &store->wal;
+    if (wal_end_transaction(wal, store->data.file_size) != 0) {
+        return;
+    }
+    if (__atomic_load_n(&store->shared->writers_waiting, __ATOMIC_SEQ_CST) > 0 ||
+        wal->unsynced_commits >= WAL_GROUP_COMMITS || wal->used >= WAL_GROUP_BYTES ||
+        store->data.pending_count >= WAL_CHECKPOINT_PAGES ||
+        (store->publish_due != 0 && monotonic_ns() >= store->publish_due) ||
+        (__atomic_load_n(&store->shared->version, __ATOMIC_SEQ_CST) & 1)) {
+        storage_publish(store, 1);
+    }
+}
+
+/*
+ * Rele o estado publicado: products.bin (reaberto se foi trocado), o
+ * cabecalho e os arquivos derivados. Num escritor os derivados
+ * desatualizados sao reconstruidos; num leitor a funcao falha.
+ */
+int storage_refresh(Storage *store) {
+    BufferPool *pools[STORAGE_POOL_COUNT];
+    storage_pools(store, pools);
+    if (data_reload(store) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < STORAGE_POOL_COUNT; i++) {
+        pool_refresh(pools[i]);
+    }
+    if (pool_read(&store->data, 0, &store->header, sizeof(Header)) != 0 || delta_load(store) != 0) {
+        return -1;
+    }
+    index_cache_free(&store->index_cache);
+    if (bpt_open(store) != 0 || index_open(store) != 0 || bloom_open(store) != 0 ||
+        sidx_open(store, &store->category_tree, &store->category_pages, 0) != 0 ||
+        sidx_open(store, &store->brand_tree, &store->brand_pages, 1) != 0 ||
+        column_open(store) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Comeca uma escrita: serializa as threads do processo e obtem o lock de
+ * escrita, se este handle ainda nao o tiver. Se outro escritor publicou
+ * desde a ultima vez, o estado e relido; se ele morreu sem publicar, o seu
+ * log e recuperado antes, com a versao impar ate a proxima publicacao.
+ */
+int storage_begin_write(Storage *store) {
+    pthread_mutex_lock(&store->writer);
+    if (store->lease) {
+        return 0;
+    }
+    if (lease_acquire(store) != 0) {
+        pthread_mutex_unlock(&store->writer);
+        return -1;
+    }
+    struct stat st;
+    int crashed = fstat(store->wal.fd, &st) == 0 && st.st_size > 0;
+    int failed = data_reload(store) != 0;
+    if (!failed && crashed) {
+        publish_begin(store);
+        failed = wal_recover(store) != 0;
+    }
+    if (!failed && (crashed || __atomic_load_n(&store->shared->version, __ATOMIC_SEQ_CST) != store->snapshot.version)) {
+        failed = storage_refresh(store) != 0;
+    }
+    if (failed || wal_restart(&store->wal, store->data.file_size) != 0) {
+        lease_release(store);
+        pthread_mutex_unlock(&store->writer);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Termina uma escrita. Se o lock de escrita continuar com o handle, o grupo
+ * aberto ganha um prazo de PUBLISH_DELAY_NS, contado da sua primeira escrita,
+ * para ser publicado, o que storage_publisher faz mesmo com o handle parado.
+ * Sem essa thread, cada escrita publica.
+ */
+void storage_end_write(Storage *store) {
+    wal_commit(store);
+    if (!store->publisher_running) {
+        storage_publish(store, 1);
+    }
+    if (!store->lease) {
+        store->publish_due = 0;
+    } else if (store->publish_due == 0) {
+        store->publish_due = monotonic_ns() + PUBLISH_DELAY_NS;
+        pthread_cond_signal(&store->publish_wake);
+    }
+    pthread_mutex_unlock(&store->writer);
+}
+
+/*
+ * Thread de cada handle de escritor: publica o grupo aberto e solta o lock de
+ * escrita quando vence publish_due. Assim um escritor parado nao segura o lock
+ * por mais de PUBLISH_DELAY_NS, e um commit chega aos leitores no maximo esse
+ * tempo depois de storage_end_write.
+ */
+void *storage_publisher(void *arg) {
+    Storage *store = arg;
+    pthread_mutex_lock(&store->writer);
+    while (!store->closing) {
+        if (store->publish_due == 0) {
+            pthread_cond_wait(&store->publish_wake, &store->writer);
+        } else if (monotonic_ns() < store->publish_due) {
+            struct timespec due = {store->publish_due / 1000000000LL, store->publish_due % 1000000000LL};
+            pthread_cond_timedwait(&store->publish_wake, &store->writer, &due);
+        } else {
+            storage_publish(store, 1);
+            store->publish_due = 0;
+        }
+    }
+    pthread_mutex_unlock(&store->writer);
+    return NULL;
+}
+
+/*
+ * Abre os arquivos de um escritor; storage_open ja tem o lock de escrita.
+ */
+int storage_open_files(Storage *store) {
+    int flags = store->pool_flags;
+    if (data_open(store) != 0) {
+        return -1;
+    }
+    if (pool_read(&store->data, 0, &store->header, sizeof(Header)) != 0 ||
+        memcmp(store->header.magic, PRODUCT_FILE_MAGIC, sizeof(store->header.magic)) != 0 ||
+        store->header.version != PRODUCT_FILE_VERSION ||
+        store->header.record_size != sizeof(ProductRecord)) {
+        printf("Cabecalho invalido no arquivo de produtos.\n");
+        data_close(store);
+        return -1;
+    }
+    if (delta_load(store) != 0) {
+        data_close(store);
+        return -1;
+    }
+    if (pool_open(&store->tree_pages, BPT_FILE_NAME, TREE_POOL_FRAMES, flags) != 0) {
+        data_close(store);
+        return -1;
+    }
+    if (bpt_open(store) != 0 || pool_open(&store->index, INDEX_FILE_NAME, INDEX_POOL_FRAMES, flags) != 0) {
+        pool_close(&store->tree_pages);
+        data_close(store);
+        return -1;
+    }
+    // O filtro de Bloom e aberto antes do indice, que o remonta se for recriado
+    if (pool_open(&store->bloom, BLOOM_FILE_NAME, BLOOM_POOL_FRAMES, flags) != 0) {
+        pool_close(&store->index);
+        pool_close(&store->tree_pages);
+        data_close(store);
+        return -1;
+    }
+    memset(&store->index_cache, 0, sizeof(IndexCache));
+    if (index_open(store) != 0 || bloom_open(store) != 0) {
+        index_cache_free(&store->index_cache);
+        pool_close(&store->bloom);
+        pool_close(&store->index);
+        pool_close(&store->tree_pages);
+        data_close(store);
+        return -1;
+    }
+    int failed = pool_open(&store->category_pages, CATEGORY_INDEX_FILE_NAME, SIDX_POOL_FRAMES, flags) != 0;
+    if (!failed && (sidx_open(store, &store->category_tree, &store->category_pages, 0) != 0 ||
+                    pool_open(&store->brand_pages, BRAND_INDEX_FILE_NAME, SIDX_POOL_FRAMES, flags) != 0)) {
+        pool_close(&store->category_pages);
+        failed = 1;
+    }
+    if (!failed && sidx_open(store, &store->brand_tree, &store->brand_pages, 1) != 0) {
+        pool_close(&store->brand_pages);
+        pool_close(&store->category_pages);
+        failed = 1;
+    }
+    if (!failed && pool_open(&store->columns, COLUMN_FILE_NAME, COLUMN_POOL_FRAMES, flags) != 0) {
+        pool_close(&store->brand_pages);
+        pool_close(&store->category_pages);
+        failed = 1;
+    }
+    if (!failed && column_open(store) != 0) {
+        pool_close(&store->columns);
+        pool_close(&store->brand_pages);
+        pool_close(&store->category_pages);
+        failed = 1;
+    }
+    if (failed) {
+        index_cache_free(&store->index_cache);
+        pool_close(&store->bloom);
+        pool_close(&store->index);
+        pool_close(&store->tree_pages);
+        data_close(store);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Abre products.bin, a arvore B+, o indice parcial, o filtro de Bloom, os
+ * indices secundarios e products.col com os seus pools de buffers para
+ * escrita, reconstruindo os derivados se products.bin mudou por fora. O log
+ * products.wal e reaplicado antes de tudo (ver wal_recover). O arquivo de
+ * dados ja deve existir (ver initialize_file). mode escolhe entre quadros em
+ * memoria (STORAGE_BUFFERED) e os arquivos mapeados com mmap
+ * (STORAGE_MAPPED).
+ *
+ * Todos os pools do escritor sao adiados: o que ele grava so chega aos
+ * arquivos em storage_publish, com a versao de products.lock impar, e os
+ * leitores (ver storage_open_reader) sempre enxergam um estado publicado.
+ * Escritas de outros processos, ou de outros handles, esperam o lock de
+ * escrita, que o handle so segura entre a primeira escrita de um grupo e a
+ * publicacao dele (ver storage_end_write).
+ */
+int storage_open(Storage *store, int mode) {
+    store->reader = 0;
+    store->pool_flags = POOL_DEFERRED | (mode == STORAGE_MAPPED ? POOL_MAPPED : 0);
+    memset(&store->snapshot, 0, sizeof(Snapshot));
+    memset(&store->delta, 0, sizeof(DeltaIndex));
+    if (lock_open(store) != 0) {
+        return -1;
+    }
+    if (lease_acquire(store) != 0 || storage_open_files(store) != 0) {
+        delta_free(&store->delta);
+        lock_close(store);
+        return -1;
+    }
+    pthread_mutexattr_t mutex_attributes;
+    pthread_mutexattr_init(&mutex_attributes);
+    pthread_mutexattr_settype(&mutex_attributes, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&store->writer, &mutex_attributes);
+    pthread_mutexattr_destroy(&mutex_attributes);
+    pthread_condattr_t cond_attributes;
+    pthread_condattr_init(&cond_attributes);
+    pthread_condattr_setclock(&cond_attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&store->publish_wake, &cond_attributes);
+    pthread_condattr_destroy(&cond_attributes);
+    store->publish_due = 0;
+    store->closing = 0;
+    store->snapshot.version = __atomic_load_n(&store->shared->version, __ATOMIC_SEQ_CST);
+    store->snapshot.valid = 1;
+    // Publica os derivados reconstruidos na abertura (ou a recuperacao do log)
+    storage_publish(store, 1);
+    store->publisher_running = pthread_create(&store->publisher, NULL, storage_publisher, store) == 0;
+    if (!store->publisher_running) {
+        perror("Erro ao criar a thread de publicacao");
+    }
+    return 0;
+}
+
+/*
+ * Comeca uma leitura num handle de leitor: espera a publicacao em andamento
+ * terminar e, se a versao mudou, rele o estado publicado. Retorna -1 se o
+ * estado publicado nao puder ser lido (por exemplo, se o escritor morreu no
+ * meio de uma publicacao e nenhum outro a refez). Num escritor, nao faz nada.
+ */
+int snapshot_begin(Storage *store) {
+    if (!store->reader) {
+        return 0;
+    }
+    while (1) {
+        unsigned long long version = __atomic_load_n(&store->shared->version, __ATOMIC_SEQ_CST);
+        if (version & 1) {
+            if (!lease_held_elsewhere(store)) {
+                return -1;
+            }
+            sched_yield();
+            continue;
+        }
+        int result = 0;
+        if (!store->snapshot.valid || version != store->snapshot.version) {
+            store->snapshot.version = version;
+            result = storage_refresh(store);
+            store->snapshot.valid = result == 0;
+        }
+        if (__atomic_load_n(&store->shared->version, __ATOMIC_SEQ_CST) == version) {
+            return result;
+        }
+    }
+}
+
+/*
+ * Retorna 1 se tudo o que foi lido desde snapshot_begin pertence a mesma
+ * versao publicada; senao a leitura deve ser refeita.
+ */
+int snapshot_end(Storage *store) {
+    return !store->reader || __atomic_load_n(&store->shared->version, __ATOMIC_SEQ_CST) == store->snapshot.version;
+}
+
+/*
+ * Abre um handle so de leitura. Ele usa pools com quadros proprios e nunca
+ * escreve nem reconstroi arquivos, entao cada thread leitora pode ter o seu
+ * handle e consultar em paralelo com as outras e com o escritor; o estado
+ * lido e sempre o da ultima publicacao (ver snapshot_begin). Os arquivos ja
+ * devem ter sido criados por storage_open.
+ *
+ * Uma escrita so aparece aqui depois de publicada, ate PUBLISH_DELAY_NS
+ * depois de storage_end_write: so o handle do escritor le as proprias
+ * escritas logo em seguida, e um find_product num leitor logo depois de
+ * insert_record pode ainda nao achar o produto.
+ */
+int storage_open_reader(Storage *store) {
+    static const char *names[STORAGE_POOL_COUNT] = {ORIGINAL_FILE_NAME, BPT_FILE_NAME, INDEX_FILE_NAME, BLOOM_FILE_NAME,
+                                                    CATEGORY_INDEX_FILE_NAME, BRAND_INDEX_FILE_NAME, COLUMN_FILE_NAME};
+    static const int frames[STORAGE_POOL_COUNT] = {DATA_POOL_FRAMES, TREE_POOL_FRAMES, INDEX_POOL_FRAMES, BLOOM_POOL_FRAMES,
+                                                   SIDX_POOL_FRAMES, SIDX_POOL_FRAMES, COLUMN_POOL_FRAMES};
+    BufferPool *pools[STORAGE_POOL_COUNT];
+    memset(store, 0, sizeof(Storage));
+    store->reader = 1;
+    store->pool_flags = 0;
+    if (lock_open(store) != 0) {
+        return -1;
+    }
+    storage_pools(store, pools);
+    for (int i = 0; i < STORAGE_POOL_COUNT; i++) {
+        if (pool_open(pools[i], names[i], frames[i], store->pool_flags) != 0) {
+            while (--i >= 0) {
+                pool_close(pools[i]);
+            }
+            lock_close(store);
+            return -1;
+        }
+        pools[i]->snapshot = &store->snapshot;
+    }
+    if (snapshot_begin(store) != 0) {
+        index_cache_free(&store->index_cache);
+        delta_free(&store->delta);
+        for (int i = 0; i < STORAGE_POOL_COUNT; i++) {
+            pool_close(pools[i]);
+        }
+        lock_close(store);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Publica o que faltar e fecha os arquivos.
+ */
+void storage_close(Storage *store) {
+    BufferPool *pools[STORAGE_POOL_COUNT];
+    storage_pools(store, pools);
+    if (store->reader) {
+        for (int i = 0; i < STORAGE_POOL_COUNT; i++) {
+            pool_close(pools[i]);
+        }
+    } else {
+        if (store->publisher_running) {
+            pthread_mutex_lock(&store->writer);
+            store->closing = 1;
+            pthread_cond_signal(&store->publish_wake);
+            pthread_mutex_unlock(&store->writer);
+            pthread_join(store->publisher, NULL);
+        }
+        pthread_mutex_lock(&store->writer);
+        storage_publish(store, 1);
+        data_close(store);
+        for (int i = 1; i < STORAGE_POOL_COUNT; i++) {
+            pool_close(pools[i]);
+        }
+        pthread_mutex_unlock(&store->writer);
+        pthread_mutex_destroy(&store->writer);
+        pthread_cond_destroy(&store->publish_wake);
+    }
+    index_cache_free(&store->index_cache);
+    delta_free(&store->delta);
+    lock_close(store);
+}
+
+long long find_immediately_lower_product_id(Storage *store, long long target_product_id) {
+    long long previous_index;
+    if (bpt_predecessor(&store->tree, target_product_id, &previous_index)) {
+        return previous_index;
+    }
+    return -1;
+}
+
+/*
+ * Posicao inativa da regiao base onde product_id cabe sem tirar a regiao de
+ * ordem, ou -1. So a posicao do limite inferior e a anterior podem servir: a
+ * primeira fica entre um product_id menor e um maior que o seu, a segunda
+ * entre o menor anterior e o limite inferior, que e maior que product_id.
+ */
+long long take_base_slot(Storage *store, long long product_id) {
+    Header *header = &store->header;
+    if (header->base_free == 0) {
+        return -1;
+    }
+    long long position = base_lower_bound(store, product_id);
+    ProductRecord copy;
+    const ProductRecord *record;
+    for (long long slot = position; slot >= position - 1 && slot >= 0; slot--) {
+        if (slot < header->base_count && (record = product_at(store, slot, &copy)) != NULL && !record->ativo) {
+            if (header->base_free > 0) {
+                header->base_free--;
+            }
+            write_header(store);
+            return slot;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Posicoes de produtos removidos fora da regiao base formam uma lista ligada
+ * pelo campo elo, com inicio em header.free_head. Para um record ativo usa a
+ * posicao inativa da regiao base onde ele couber, se houver (ver
+ * take_base_slot); senao retira da lista a posicao mais proxima de near entre
+ * as FREE_SLOT_SCAN primeiras, para que o novo registro fique perto do seu
+ * predecessor nos elos. Retorna -1 se nenhuma posicao servir.
+ */
+long long take_free_slot(Storage *store, long long near, const ProductRecord *record) {
+    Header *header = &store->header;
+    long long best = record->ativo ? take_base_slot(store, record->product_id) : -1;
+    if (best != -1) {
+        return best;
+    }
+    long long best_previous = -1;
+    long long best_next = -1;
+    long long best_distance = 0;
+    long long previous = -1;
+    long long current = header->free_head;
+    ProductRecord copy;
+    const ProductRecord *free_record;
+
+    for (int scanned = 0; current != -1 && scanned < FREE_SLOT_SCAN; scanned++) {
+        if ((free_record = product_at(store, current, &copy)) == NULL) {
+            break;
+        }
+        long long distance = near == -1 ? 0 : llabs(current - near);
+        if (best == -1 || distance < best_distance) {
+            best = current;
+            best_previous = previous;
+            best_next = free_record->elo;
+            best_distance = distance;
+        }
+        previous = current;
+        current = free_record->elo;
+    }
+    if (best == -1) {
+        return -1;
+    }
+
+    if (best_previous == -1) {
+        header->free_head = best_next;
+        write_header(store);
+    } else {
+        ProductRecord previous_record;
+        read_product(store, best_previous, &previous_record);
+        previous_record.elo = best_next;
+        write_product(store, best_previous, &previous_record);
+    }
+    return best;
+}
+
+/*
+ * Grava record (ja fora dos elos) como inativo na posicao slot. Fora da
+ * regiao base a posicao vai para o inicio da lista livre; dentro dela fica no
+ * lugar, com o product_id antigo mantendo a ordem, e so e contada em
+ * header.base_free.
+ */
+void release_slot(Storage *store, long long slot, const ProductRecord *record) {
+    ProductRecord freed = *record;
+    freed.ativo = 0;
+    if (slot < store->header.base_count) {
+        freed.elo = -1;
+        store->header.base_free++;
+    } else {
+        freed.elo = store->header.free_head;
+        store->header.free_head = slot;
+    }
+    write_product(store, slot, &freed);
+    write_header(store);
+}
+
+/*
+ * Numero de posicoes livres (na lista e inativas na regiao base), isto e, as
+ * que uma compactacao descartaria.
+ */
+long long count_free_slots(Storage *store) {
+    storage_begin_read(store);
+    long long count = store->header.base_free;
+    long long limit = product_count(store);
+    long long current = store->header.free_head;
+    ProductRecord copy;
+    const ProductRecord *record;
+    while (current != -1 && count < limit && (record = product_at(store, current, &copy)) != NULL) {
+        count++;
+        current = record->elo;
+    }
+    storage_end_read(store);
+    return count;
+}
+
+/*
+ * Retorna a posicao do registro cujo elo aponta para slot, comecando pelo
+ * produto ativo anterior a product_id na arvore; -1 se slot for o inicio da
+ * lista, ou -2 se slot nao estiver nos elos.
+ */
+long long chain_predecessor(Storage *store, long long slot, long long product_id) {
+    long long current_index;
+    if (!bpt_predecessor(&store->tree, product_id, &current_index)) {
+        if (store->header.head_index == slot) {
+            return -1;
+        }
+        current_index = store->header.head_index;
+    }
+    ProductRecord copy;
+    const ProductRecord *record;
+    while (current_index != -1 && (record = product_at(store, current_index, &copy)) != NULL) {
+        if (record->elo == slot) {
+            return current_index;
+        }
+        current_index = record->elo;
+    }
+    return -2;
+}
+
+int insert_record_locked(Storage *store, const ProductEntry *entry) {
+    long long existing_index;
+    if (entry->ativo && bloom_may_contain(store, entry->product_id) &&
+        sorted_find(store, entry->product_id, &existing_index)) {
+        printf("Produto com product_id %lld ja existe.\n", entry->product_id);
+        return -1;
+    }
+
+    Header *header = &store->header;
+    long long category_code = dictionary_code(store, entry->category_code);
+    long long brand = dictionary_code(store, entry->brand);
+    if (category_code < 0 || brand < 0) {
+        return -1;
+    }
+    ProductRecord encoded;
+    memset(&encoded, 0, sizeof(ProductRecord));
+    encoded.product_id = entry->product_id;
+    encoded.category_id = entry->category_id;
+    encoded.price = entry->price;
+    encoded.category_code = (unsigned int)category_code;
+    encoded.brand = (unsigned int)brand;
+    encoded.ativo = entry->ativo;
+    const ProductRecord *record = &encoded;
+
+    long long lower_index = header->head_index == -1 ? -1 : find_immediately_lower_product_id(store, record->product_id);
+    long long new_record_index = take_free_slot(store, lower_index, record);
+    if (new_record_index == -1) {
+        new_record_index = product_count(store);
+    }
+    if (lower_index == -1) {
+
+        ProductRecord new_record = *record;
+        new_record.elo = header->head_index;
+        new_record.seq_key = new_record_index + 1;
+        write_product(store, new_record_index, &new_record);
+        header->head_index = new_record_index;
+        write_header(store);
+    } else {
+        ProductRecord low_record;
+        read_product(store, lower_index, &low_record);
+
+        ProductRecord new_record = *record;
+        new_record.elo = low_record.elo;
+        new_record.seq_key = new_record_index + 1;
+        write_product(store, new_record_index, &new_record);
+
+        low_record.elo = new_record_index;
+        write_product(store, lower_index, &low_record);
+    }
+
+    if (record->ativo) {
+        bpt_insert(&store->tree, record->product_id, new_record_index);
+        index_note_insert(store, record->product_id, new_record_index);
+        sidx_note(store, record, new_record_index, 1);
+        bloom_note_insert(store, record->product_id);
+    }
+    delta_note(store, record, new_record_index, 1);
+    column_note(store, new_record_index, record);
+    return 0;
+}
+
+typedef struct {
+    const ProductEntry *entry;
+    size_t position;
+} BatchItem;
+
+typedef struct {
+    long long index;
+    ProductRecord record;
+} PendingLink;
+
+int compare_strings(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+int compare_batch_items(const void *a, const void *b) {
+    const BatchItem *x = (const BatchItem *)a;
+    const BatchItem *y = (const BatchItem *)b;
+    if (x->entry->product_id != y->entry->product_id) {
+        return x->entry->product_id < y->entry->product_id ? -1 : 1;
+    }
+    return x->position < y->position ? -1 : (x->position > y->position);
+}
+
+int compare_pending_links(const void *a, const void *b) {
+    long long x = ((const PendingLink *)a)->index;
+    long long y = ((const PendingLink *)b)->index;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Codifica as strings de todos os itens de uma vez: o dicionario e lido uma
+ * unica vez e ordenado para busca binaria, e as strings novas sao acrescentadas
+ * com uma unica escrita.
+ */
+int dictionary_codes_batch(Storage *store, const BatchItem *items, size_t count, unsigned int *category_codes, unsigned int *brands) {
+    Header *header = &store->header;
+    char *entries = malloc((size_t)header->dict_capacity * DICTIONARY_ENTRY_LEN);
+    char **sorted = malloc(((size_t)header->dict_capacity + 1) * sizeof(char *));
+    const char **missing = malloc((2 * count + 1) * sizeof(char *));
+    if (entries == NULL || sorted == NULL || missing == NULL) {
+        free(entries);
+        free(sorted);
+        free(missing);
+        return -1;
+    }
+    if (header->dict_count > 0 &&
+        pool_read(&store->data, header->dict_offset, entries, (size_t)header->dict_count * DICTIONARY_ENTRY_LEN) != 0) {
+        free(entries);
+        free(sorted);
+        free(missing);
+        return -1;
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (unsigned int code = 0; code < header->dict_count; code++) {
+            sorted[code] = entries + (size_t)code * DICTIONARY_ENTRY_LEN;
+        }
+        qsort(sorted, header->dict_count, sizeof(char *), compare_strings);
+
+        size_t missing_count = 0;
+        for (size_t i = 0; i < count; i++) {
+            const char *texts[2] = {items[i].entry->category_code, items[i].entry->brand};
+            for (int t = 0; t < 2; t++) {
+                char **found = bsearch(&texts[t], sorted, header->dict_count, sizeof(char *), compare_strings);
+                if (found != NULL) {
+                    unsigned int code = (unsigned int)((*found - entries) / DICTIONARY_ENTRY_LEN);
+                    if (t == 0) category_codes[i] = code; else brands[i] = code;
+                } else {
+                    missing[missing_count++] = texts[t];
+                }
+            }
+        }
+        if (missing_count == 0) {
+            break;
+        }
+
+        // Primeira passada: acrescenta as strings novas, sem repeticoes, e busca de novo
+        qsort(missing, missing_count, sizeof(char *), compare_strings);
+        long long first_new = header->dict_count;
+        for (size_t i = 0; i < missing_count; i++) {
+            if (i > 0 && strcmp(missing[i], missing[i - 1]) == 0) {
+                continue;
+            }
+            if (header->dict_count >= header->dict_capacity) {
+                printf("Dicionario de strings cheio.\n");
+                free(entries);
+                free(sorted);
+                free(missing);
+                return -1;
+            }
+            char *entry = entries + (size_t)header->dict_count * DICTIONARY_ENTRY_LEN;
+            memset(entry, 0, DICTIONARY_ENTRY_LEN);
+            strncpy(entry, missing[i], DICTIONARY_ENTRY_LEN - 1);
+            header->dict_count++;
+        }
+        pool_write(&store->data, header->dict_offset + first_new * DICTIONARY_ENTRY_LEN,
+                   entries + first_new * DICTIONARY_ENTRY_LEN, (size_t)(header->dict_count - first_new) * DICTIONARY_ENTRY_LEN);
+        write_header(store);
+    }
+
+    free(entries);
+    free(sorted);
+    free(missing);
+    return 0;
+}
+
+/*
+ * Insere varios produtos de uma vez. O lote e ordenado por product_id e
+ * encaixado na lista com uma unica passada pelos elos: os registros novos sao
+ * acrescentados ao arquivo com uma so escrita e os predecessores alterados sao
+ * regravados em ordem de posicao no arquivo. product_ids ja existentes (ou
+ * repetidos no lote, exceto a primeira ocorrencia) sao ignorados. Retorna o
+ * numero de produtos inseridos, ou -1 em caso de erro.
+ */
+long long insert_records_batch_locked(Storage *store, const ProductEntry *entries, size_t count) {
+    Header *header = &store->header;
+    BatchItem *items = malloc((count > 0 ? count : 1) * sizeof(BatchItem));
+    if (items == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        items[i].entry = &entries[i];
+        items[i].position = i;
+    }
+    qsort(items, count, sizeof(BatchItem), compare_batch_items);
+
+    // Mantem a primeira ocorrencia de cada product_id que ainda nao existe
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        long long existing_index;
+        if (kept > 0 && items[kept - 1].entry->product_id == items[i].entry->product_id) {
+            continue;
+        }
+        if (items[i].entry->ativo && bloom_may_contain(store, items[i].entry->product_id) &&
+            sorted_find(store, items[i].entry->product_id, &existing_index)) {
+            printf("Produto com product_id %lld ja existe.\n", items[i].entry->product_id);
+            continue;
+        }
+        items[kept++] = items[i];
+    }
+
+    unsigned int *category_codes = malloc((kept > 0 ? kept : 1) * sizeof(unsigned int));
+    unsigned int *brands = malloc((kept > 0 ? kept : 1) * sizeof(unsigned int));
+    ProductRecord *new_records = malloc((kept > 0 ? kept : 1) * sizeof(ProductRecord));
+    PendingLink *links = malloc((kept > 0 ? kept : 1) * sizeof(PendingLink));
+    long long *slots = malloc((kept > 0 ? kept : 1) * sizeof(long long));
+    if (category_codes == NULL || brands == NULL || new_records == NULL || links == NULL || slots == NULL ||
+        dictionary_codes_batch(store, items, kept, category_codes, brands) != 0) {
+        free(items);
+        free(category_codes);
+        free(brands);
+        free(new_records);
+        free(links);
+        free(slots);
+        return -1;
+    }
+
+    // Os registros ocupam primeiro posicoes livres; o restante e acrescentado
+    // em sequencia a partir de first_appended_index
+    long long first_appended_index = product_count(store);
+    size_t first_appended = kept;
+
+    // Passada unica pelos elos: para cada novo registro, avanca ate o primeiro
+    // registro existente com product_id maior ou igual
+    long long previous_index = -1;          // Ultimo registro ja posicionado (existente ou novo)
+    int previous_is_new = 0;
+    ProductRecord previous_record;
+    long long current_index = header->head_index;
+    ProductRecord current_record;
+    int has_current = 0;
+    size_t link_count = 0;
+
+    for (size_t i = 0; i < kept; i++) {
+        long long product_id = items[i].entry->product_id;
+        while (current_index != -1) {
+            if (!has_current) {
+                read_product(store, current_index, &current_record);
+                has_current = 1;
+            }
+            if (current_record.product_id >= product_id) {
+                break;
+            }
+            previous_index = current_index;
+            previous_is_new = 0;
+            previous_record = current_record;
+            current_index = current_record.elo;
+            has_current = 0;
+        }
+
+        ProductRecord *record = &new_records[i];
+        memset(record, 0, sizeof(ProductRecord));
+        record->product_id = product_id;
+        record->category_id = items[i].entry->category_id;
+        record->price = items[i].entry->price;
+        record->category_code = category_codes[i];
+        record->brand = brands[i];
+        record->ativo = items[i].entry->ativo;
+        record->elo = current_index;
+
+        long long new_index = first_appended == kept ? take_free_slot(store, previous_index, record) : -1;
+        if (new_index == -1) {
+            if (first_appended == kept) {
+                first_appended = i;
+            }
+            new_index = first_appended_index + (long long)(i - first_appended);
+        }
+        slots[i] = new_index;
+        record->seq_key = new_index + 1;
+        if (i < first_appended) {
+            // Ja grava a posicao reaproveitada: take_base_slot procura os
+            // proximos do lote pela regiao base
+            write_product(store, new_index, record);
+        }
+
+        if (previous_index == -1) {
+            header->head_index = new_index;
+        } else if (previous_is_new) {
+            new_records[i - 1].elo = new_index;
+        } else {
+            previous_record.elo = new_index;
+            links[link_count].index = previous_index;
+            links[link_count].record = previous_record;
+            link_count++;
+        }
+        previous_index = new_index;
+        previous_is_new = 1;
+    }
+
+    // Posicoes reaproveitadas regravadas com os elos finais; uma escrita para os acrescentados
+    for (size_t i = 0; i < first_appended; i++) {
+        write_product(store, slots[i], &new_records[i]);
+    }
+    if (first_appended < kept) {
+        pool_write(&store->data, header->data_offset + first_appended_index * (long long)sizeof(ProductRecord),
+                   new_records + first_appended, (kept - first_appended) * sizeof(ProductRecord));
+    }
+
+    // Predecessores regravados em ordem de posicao no arquivo
+    qsort(links, link_count, sizeof(PendingLink), compare_pending_links);
+    for (size_t i = 0; i < link_count; i++) {
+        write_product(store, links[i].index, &links[i].record);
+    }
+    write_header(store);
+
+    for (size_t i = 0; i < kept; i++) {
+        if (new_records[i].ativo) {
+            bpt_insert(&store->tree, new_records[i].product_id, slots[i]);
+            sidx_note(store, &new_records[i], slots[i], 1);
+            bloom_note_insert(store, new_records[i].product_id);
+        }
+        delta_note(store, &new_records[i], slots[i], 1);
+        column_note(store, slots[i], &new_records[i]);
+    }
+    // Se o indice for reconstruido no meio do lote, ele ja inclui o restante
+    for (size_t i = 0; i < kept; i++) {
+        if (new_records[i].ativo && index_note_insert(store, new_records[i].product_id, slots[i])) {
+            break;
+        }
+    }
+
+    free(items);
+    free(category_codes);
+    free(brands);
+    free(new_records);
+    free(links);
+    free(slots);
+    return (long long)kept;
+}
+
+void remove_record_locked(Storage *store, long long target_product_id) {
+    long long current_index;
+    ProductRecord current_record;
+    if (sorted_find(store, target_product_id, &current_index)) {
+        read_product(store, current_index, &current_record);
+        if (current_record.product_id == target_product_id && current_record.ativo) {
+
+            // Retira o registro dos elos e devolve a posicao para a lista livre;
+            // se o predecessor nao for encontrado, o registro so e inativado
+            long long previous_index = chain_predecessor(store, current_index, target_product_id);
+            if (previous_index == -1) {
+                store->header.head_index = current_record.elo;
+                write_header(store);
+            } else if (previous_index >= 0) {
+                ProductRecord previous_record;
+                read_product(store, previous_index, &previous_record);
+                previous_record.elo = current_record.elo;
+                write_product(store, previous_index, &previous_record);
+            }
+            ProductRecord inactive = current_record;
+            inactive.ativo = 0;
+            if (previous_index == -2) {
+                write_product(store, current_index, &inactive);
             } else {
-                break;
+                release_slot(store, current_index, &current_record);
             }
-            current_index = current_record.elo;
+            column_note(store, current_index, &inactive);
+            bpt_delete(&store->tree, target_product_id);
+            index_note_remove(store, &current_record, current_index);
+            sidx_note(store, &current_record, current_index, 0);
+            delta_note(store, &current_record, current_index, 0);
+            bloom_note_remove(store);
+            printf("Produto com product_id %lld foi removido (inativado).\n", target_product_id);
+            return;
         }
     }
-    fclose(fp);
-    return previous_index;
+
+    printf("Produto com product_id %lld nao encontrado ou ja esta inativo.\n", target_product_id);
 }
 
-int insert_record(const ProductRecord *record) {
-    FILE *fp = fopen(ORIGINAL_FILE_NAME, "rb+");
-    if (fp == NULL) {
-        perror("Erro ao abrir o arquivo para insercao");
-        return -1;
+void remove_record(Storage *store, long long target_product_id) {
+    if (storage_begin_write(store) != 0) {
+        printf("Erro ao obter o lock de escrita.\n");
+        return;
     }
+    remove_record_locked(store, target_product_id);
+    storage_end_write(store);
+}
 
-    Header header;
-    fread(&header, sizeof(Header), 1, fp);
-    if (header.head_index == -1) {
 
-        fseek(fp, sizeof(Header), SEEK_SET);
-        ProductRecord new_record = *record;
-        new_record.elo = -1;
-        new_record.seq_key = 1;
-        fwrite(&new_record, sizeof(ProductRecord), 1, fp);
-        header.head_index = 0;
-        fseek(fp, 0, SEEK_SET);
-        fwrite(&header, sizeof(Header), 1, fp);
-        fclose(fp);
+/*
+ * Procura target_product_id pelo indice parcial, seguindo os elos a partir da
+ * entrada encontrada, e copia o produto para record. Retorna 1 se ele existe,
+ * 0 se nao, -1 se o indice nao tem entrada para ele ou -2 se um registro nao
+ * puder ser lido.
+ */
+int partial_index_lookup(Storage *store, long long target_product_id, ProductRecord *record) {
+    if (!bloom_may_contain(store, target_product_id)) {
         return 0;
     }
 
+    IndexRecord idx_record;
+    if (binary_search_index(store, target_product_id, &idx_record) == -1) {
+        return -1;
+    }
 
-    long long lower_index = find_immediately_lower_product_id(record->product_id);
-    if (lower_index == -1) {
+    long long current_index = idx_record.record_index;
+    ProductRecord copy;
+    const ProductRecord *current_record;
+    while (current_index != -1) {
+        if ((current_record = product_at(store, current_index, &copy)) == NULL) {
+            return -2;
+        }
 
-        fseek(fp, 0, SEEK_END);
-        long long new_record_index = (ftell(fp) - sizeof(Header)) / sizeof(ProductRecord);
-        ProductRecord new_record = *record;
-        new_record.elo = header.head_index;
-        new_record.seq_key = new_record_index + 1;
-        fwrite(&new_record, sizeof(ProductRecord), 1, fp);
-        header.head_index = new_record_index;
-        fseek(fp, 0, SEEK_SET);
-        fwrite(&header, sizeof(Header), 1, fp);
-        fclose(fp);
-        return 0;
+        if (current_record->product_id == target_product_id && current_record->ativo) {
+            *record = *current_record;
+            return 1;
+        } else if (current_record->product_id > target_product_id) {
+            break;
+        }
+
+        current_index = current_record->elo;
     }
+    return 0;
+}
 
-    fseek(fp, sizeof(Header) + lower_index * sizeof(ProductRecord), SEEK_SET);
-    ProductRecord low_record;
-    fread(&low_record, sizeof(ProductRecord), 1, fp);
+/*
+ * Exibe o produto encontrado por partial_index_lookup, numa so versao
+ * publicada.
+ */
+void query_using_partial_index(Storage *store, long long target_product_id) {
+    ProductRecord record;
+    char category_code[DICTIONARY_ENTRY_LEN];
+    char brand[DICTIONARY_ENTRY_LEN];
+    int found;
 
+    storage_begin_read(store);
+    do {
+        if (snapshot_begin(store) != 0) {
+            found = -2;
+            break;
+        }
+        found = partial_index_lookup(store, target_product_id, &record);
+        if (found == 1) {
+            dictionary_string(store, record.category_code, category_code);
+            dictionary_string(store, record.brand, brand);
+        }
+    } while (!snapshot_end(store));
+    storage_end_read(store);
 
-    fseek(fp, 0, SEEK_END);
-    long long new_record_index = (ftell(fp) - sizeof(Header)) / sizeof(ProductRecord);
-    ProductRecord new_record = *record;
-    new_record.elo = low_record.elo;
-    new_record.seq_key = new_record_index + 1;
-    fwrite(&new_record, sizeof(ProductRecord), 1, fp);
+    if (found == 1) {
+        printf("\nProduto encontrado via indice parcial:\n");
+        printf("  Product ID: %lld\n", record.product_id);
+        printf("  Category ID: %lld\n", record.category_id);
+        printf("  Category Code: %s\n", category_code);
+        printf("  Brand: %s\n", brand);
+        printf("  Price: %.2f\n", record.price);
+        printf("  Ativo: %s\n", record.ativo ? "Sim" : "Nao");
+        printf("  Seq Key: %lld\n", record.seq_key);
+    } else if (found == -1) {
+        printf("Produto com product_id %lld nao encontrado no indice.\n", target_product_id);
+    } else if (found == -2) {
+        printf("Erro ao ler o estado publicado.\n");
+    } else {
+        printf("\nProduto com product_id %lld nao encontrado.\n", target_product_id);
+    }
+}
 
-    low_record.elo = new_record_index;
-    fseek(fp, sizeof(Header) + lower_index * sizeof(ProductRecord), SEEK_SET);
-    fwrite(&low_record, sizeof(ProductRecord), 1, fp);
 
-    fclose(fp);
+/*
+ * rename substitui original_file de forma atomica: quem abrir o arquivo ve a
+ * versao antiga ou a nova, nunca um arquivo ausente ou pela metade.
+ */
+int replace_original_with_sorted(const char *original_file, const char *sorted_file) {
+    if (rename(sorted_file, original_file) != 0) {
+        perror("Erro ao substituir o arquivo de dados");
+        return -1;
+    }
     return 0;
 }
 
-void remove_record(long long target_product_id) {
-    FILE *fp = fopen(ORIGINAL_FILE_NAME, "r+b");
+/*
+ * Compacta products.bin: grava em SORTED_FILE_NAME so os produtos ativos, na
+ * ordem dos elos, com elo e seq_key renumerados, e troca os arquivos. Depois
+ * disso seguir os elos le o arquivo em sequencia e o arquivo todo vira a
+ * regiao base, com o delta vazio. A arvore B+, o indice parcial, os indices
+ * secundarios e products.col sao reconstruidos. Se o arquivo ja estiver
+ * compactado (sem posicoes livres e todo na regiao base, logo com os elos em
+ * sequencia), nada e regravado. Retorna o numero de produtos mantidos, ou -1
+ * em caso de erro (products.bin fica como estava).
+ */
+long long compact_records_locked(Storage *store) {
+    long long slot_count = product_count(store);
+    if (store->header.free_head == -1 && store->header.base_free == 0 && store->header.base_count == slot_count &&
+        store->header.head_index == (slot_count > 0 ? 0 : -1)) {
+        printf("Arquivo ja compactado: %lld produtos ativos.\n", slot_count);
+        return slot_count;
+    }
+
+    FILE *fp = fopen(SORTED_FILE_NAME, "wb");
     if (fp == NULL) {
-        perror("Erro ao abrir o arquivo para remocao");
-        return;
+        perror("Erro ao criar o arquivo compactado");
+        return -1;
     }
 
-    Header header;
-    fread(&header, sizeof(Header), 1, fp);
+    // Cabecalho e dicionario sao copiados como estao
+    Header header = store->header;
+    char *prefix = malloc(header.data_offset);
+    int failed = prefix == NULL || pool_read(&store->data, 0, prefix, header.data_offset) != 0 ||
+                 fwrite(prefix, header.data_offset, 1, fp) != 1;
+    free(prefix);
 
-    long long current_index = header.head_index;
-    ProductRecord current_record;
-    while (current_index != -1) {
-        fseek(fp, sizeof(Header) + current_index * sizeof(ProductRecord), SEEK_SET);
-        fread(&current_record, sizeof(ProductRecord), 1, fp);
-        if (current_record.product_id == target_product_id && current_record.ativo) {
+    static ProductRecord chunk[CHUNK_SIZE];
+    long long in_chunk = 0;
+    long long kept = 0;
+    long long current_index = store->header.head_index;
+    ProductRecord copy;
+    const ProductRecord *current_record;
 
-            current_record.ativo = 0;
-            fseek(fp, sizeof(Header) + current_index * sizeof(ProductRecord), SEEK_SET);
-            fwrite(&current_record, sizeof(ProductRecord), 1, fp);
-            printf("Produto com product_id %lld foi removido (inativado).\n", target_product_id);
-            fclose(fp);
-            return;
+    pool_advise(&store->data, MADV_SEQUENTIAL);
+    while (current_index != -1 && !failed) {
+        if ((current_record = product_at(store, current_index, &copy)) == NULL) {
+            failed = 1;
+            break;
+        }
+        if (current_record->ativo) {
+            // O bloco cheio so e gravado quando chega o proximo registro, para
+            // que o ultimo ainda esteja em memoria no fim
+            if (in_chunk == CHUNK_SIZE) {
+                failed = fwrite(chunk, sizeof(ProductRecord), in_chunk, fp) != (size_t)in_chunk;
+                in_chunk = 0;
+            }
+            chunk[in_chunk] = *current_record;
+            chunk[in_chunk].seq_key = kept + 1;
+            chunk[in_chunk].elo = kept + 1;
+            in_chunk++;
+            kept++;
         }
-        current_index = current_record.elo;
+        current_index = current_record->elo;
+    }
+    pool_advise(&store->data, MADV_RANDOM);
+    if (!failed && in_chunk > 0) {
+        chunk[in_chunk - 1].elo = -1;
+        failed = fwrite(chunk, sizeof(ProductRecord), in_chunk, fp) != (size_t)in_chunk;
     }
 
-    printf("Produto com product_id %lld nao encontrado ou ja esta inativo.\n", target_product_id);
-    fclose(fp);
-}
-
-int create_partial_index(const char *data_file, const char *index_file, int records_per_index) {
-    FILE *fp_data = fopen(data_file, "rb");
-    if (fp_data == NULL) {
-        perror("Erro ao abrir o arquivo de dados para criar o indice");
+    header.head_index = kept > 0 ? 0 : -1;
+    header.free_head = -1;
+    header.base_count = kept;
+    header.base_free = 0;
+    if (!failed) {
+        failed = fseek(fp, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(Header), 1, fp) != 1 ||
+                 fflush(fp) != 0 || fsync(fileno(fp)) != 0;
+    }
+    if (fclose(fp) != 0 || failed) {
+        printf("Erro ao gravar o arquivo compactado.\n");
+        remove(SORTED_FILE_NAME);
         return -1;
     }
 
-    FILE *fp_index = fopen(index_file, "wb");
-    if (fp_index == NULL) {
-        perror("Erro ao criar o arquivo de indice");
-        fclose(fp_data);
+    // O que estava pendente e publicado antes da troca; depois dela a versao
+    // fica impar ate os derivados serem reconstruidos e publicados
+    if (storage_publish(store, 0) != 0) {
+        remove(SORTED_FILE_NAME);
         return -1;
     }
+    publish_begin(store);
+    if (replace_original_with_sorted(ORIGINAL_FILE_NAME, SORTED_FILE_NAME) != 0) {
+        remove(SORTED_FILE_NAME);
+        return -1;
+    }
+    if (data_reload(store) != 0 || wal_restart(&store->wal, store->data.file_size) != 0) {
+        exit(EXIT_FAILURE);
+    }
+    store->header = header;
+    delta_load(store);
 
-    Header header;
-    fread(&header, sizeof(Header), 1, fp_data);
-
-    long long current_index = header.head_index;
-    ProductRecord current_record;
-    int count = 0;
-
-    while (current_index != -1) {
-        fseek(fp_data, sizeof(Header) + current_index * sizeof(ProductRecord), SEEK_SET);
-        fread(&current_record, sizeof(ProductRecord), 1, fp_data);
-
-        if (current_record.ativo) {
-            if (count % records_per_index == 0) {
-                IndexRecord idx_record;
-                idx_record.product_id = current_record.product_id;
-                idx_record.record_index = current_index;
-                fwrite(&idx_record, sizeof(IndexRecord), 1, fp_index);
-            }
-            count++;
-        }
-
-        current_index = current_record.elo;
+    pool_truncate(&store->tree_pages);
+    if (bpt_rebuild(store) != 0) {
+        printf("Erro ao reconstruir a arvore B+.\n");
+    }
+    create_partial_index(store, RECORDS_PER_INDEX);
+    if (sidx_rebuild(store, &store->category_tree) != 0 || sidx_rebuild(store, &store->brand_tree) != 0) {
+        printf("Erro ao reconstruir os indices secundarios.\n");
+    }
+    if (column_rebuild(store, kept + kept / 4 + 64) != 0) {
+        printf("Erro ao reconstruir %s.\n", COLUMN_FILE_NAME);
     }
 
-    fclose(fp_data);
-    fclose(fp_index);
+    printf("Arquivo compactado: %lld produtos ativos mantidos, %lld posicoes descartadas.\n", kept, slot_count - kept);
+    return kept;
+}
 
-    printf("Indice parcial criado com sucesso.\n");
-    return 0;
+long long compact_records(Storage *store) {
+    if (storage_begin_write(store) != 0) {
+        return -1;
+    }
+    long long kept = compact_records_locked(store);
+    storage_publish(store, 1);
+    pthread_mutex_unlock(&store->writer);
+    return kept;
 }
 
+/*
+ * Indica se as posicoes fora da regiao base (o delta e a lista livre)
+ * passaram de DELTA_MERGE_MIN e de base_count / DELTA_MERGE_FRACTION. Dai em
+ * diante a compactacao junta o delta a regiao base: o arquivo volta ao
+ * tamanho dos produtos ativos e as buscas voltam a ser so bissecao.
+ */
+int delta_needs_merge(Storage *store) {
+    long long outside = product_count(store) - store->header.base_count;
+    return outside > DELTA_MERGE_MIN && outside > store->header.base_count / DELTA_MERGE_FRACTION;
+}
 
-int binary_search_index(const char *index_file, long long target_product_id, IndexRecord *result) {
-    FILE *fp_index = fopen(index_file, "rb");
-    if (fp_index == NULL) {
-        perror("Erro ao abrir o arquivo de indice para pesquisa");
+int insert_record(Storage *store, const ProductEntry *entry) {
+    if (storage_begin_write(store) != 0) {
         return -1;
     }
+    int result = insert_record_locked(store, entry);
+    if (delta_needs_merge(store)) {
+        compact_records_locked(store);
+    }
+    storage_end_write(store);
+    return result;
+}
 
+long long insert_records_batch(Storage *store, const ProductEntry *entries, size_t count) {
+    if (storage_begin_write(store) != 0) {
+        return -1;
+    }
+    long long result = insert_records_batch_locked(store, entries, count);
+    if (delta_needs_merge(store)) {
+        compact_records_locked(store);
+    }
+    storage_end_write(store);
+    return result;
+}
 
-    fseek(fp_index, 0, SEEK_END);
-    long long file_size = ftell(fp_index);
-    long long num_records = file_size / sizeof(IndexRecord);
-    rewind(fp_index);
 
-    long long left = 0;
-    long long right = num_records - 1;
-    long long mid;
-    IndexRecord mid_record;
+/*
+ * Exibe ate RECORDS_PER_PAGE produtos ativos seguindo os elos a partir de
+ * current_index e, se next nao for NULL, guarda nele onde a pagina seguinte
+ * comeca. Retorna o numero de produtos exibidos.
+ */
+long long display_page_from(Storage *store, long long current_index, PageCursor *next) {
+    ProductRecord copy;
+    const ProductRecord *current_record;
+    char category_code[DICTIONARY_ENTRY_LEN];
+    char brand[DICTIONARY_ENTRY_LEN];
 
-    while (left <= right) {
-        mid = left + (right - left) / 2;
-        fseek(fp_index, mid * sizeof(IndexRecord), SEEK_SET);
-        fread(&mid_record, sizeof(IndexRecord), 1, fp_index);
+    long long records_displayed = 0;
+    while (current_index != -1 && (current_record = product_at(store, current_index, &copy)) != NULL) {
+        if (current_record->ativo) {
+            if (records_displayed == RECORDS_PER_PAGE) {
+                break;
+            }
+            printf("Registro %lld:\n", current_record->seq_key);
+            printf("  Product ID: %lld\n", current_record->product_id);
+            printf("  Category ID: %lld\n", current_record->category_id);
+            printf("  Category Code: %s\n", dictionary_string(store, current_record->category_code, category_code));
+            printf("  Brand: %s\n", dictionary_string(store, current_record->brand, brand));
+            printf("  Price: %.2f\n", current_record->price);
+            printf("  Ativo: %s\n", current_record->ativo ? "Sim" : "Nao");
+            printf("  Seq Key: %lld\n", current_record->seq_key);
+            printf("  Elo (Proximo Indice): %lld\n\n", current_record->elo);
 
-        if (mid_record.product_id == target_product_id) {
-            *result = mid_record;
-            fclose(fp_index);
-            return mid;
-        } else if (mid_record.product_id < target_product_id) {
-            left = mid + 1;
-        } else {
-            if (mid == 0) break;
-            right = mid - 1;
+            records_displayed++;
         }
-    }
 
-    if (right >= 0) {
-        fseek(fp_index, right * sizeof(IndexRecord), SEEK_SET);
-        fread(&mid_record, sizeof(IndexRecord), 1, fp_index);
-        *result = mid_record;
-        fclose(fp_index);
-        return right;
+        current_index = current_record->elo;
     }
 
-    fclose(fp_index);
-    return -1;
+    if (next != NULL) {
+        next->record_index = -1;
+        next->product_id = -1;
+        if (current_index != -1 && (current_record = product_at(store, current_index, &copy)) != NULL) {
+            next->record_index = current_index;
+            next->product_id = current_record->product_id;
+        }
+    }
+    if (records_displayed == 0) {
+        printf("Nenhum registro ativo encontrado nesta pagina.\n");
+    }
+    return records_displayed;
 }
 
-void query_using_partial_index(long long target_product_id) {
-    IndexRecord idx_record;
-    int idx = binary_search_index(INDEX_FILE_NAME, target_product_id, &idx_record);
-
-    if (idx == -1) {
-        printf("Produto com product_id %lld nao encontrado no indice.\n", target_product_id);
+/*
+ * Exibe a pagina pag. O indice parcial localiza a entrada que contem o
+ * primeiro produto da pagina, entao so o trecho dessa entrada e percorrido.
+ */
+void display_records_via_elo_locked(Storage *store, long long pag, PageCursor *next) {
+    if (next != NULL) {
+        next->record_index = -1;
+        next->product_id = -1;
+    }
+    if (store->header.head_index == -1) {
+        printf("Nenhum registro encontrado.\n");
         return;
     }
 
-    FILE *fp = fopen(ORIGINAL_FILE_NAME, "rb");
-    if (fp == NULL) {
-        printf("Erro ao abrir o arquivo de dados.\n");
+    IndexRecord entry;
+    long long before;
+    long long records_to_skip = (pag - 1) * RECORDS_PER_PAGE;
+    if (pag < 1 || index_seek_rank(store, records_to_skip, &entry, &before) == -1) {
+        printf("Pagina invalida ou sem registros suficientes.\n");
         return;
     }
 
-    long long current_index = idx_record.record_index;
-    ProductRecord current_record;
-
-    while (current_index != -1) {
-        fseek(fp, sizeof(Header) + current_index * sizeof(ProductRecord), SEEK_SET);
-        fread(&current_record, sizeof(ProductRecord), 1, fp);
-
-        if (current_record.product_id == target_product_id && current_record.ativo) {
-            printf("\nProduto encontrado via indice parcial:\n");
-            printf("  Product ID: %lld\n", current_record.product_id);
-            printf("  Category ID: %lld\n", current_record.category_id);
-            printf("  Category Code: %s\n", current_record.category_code);
-            printf("  Brand: %s\n", current_record.brand);
-            printf("  Price: %.2f\n", current_record.price);
-            printf("  Ativo: %s\n", current_record.ativo ? "Sim" : "Nao");
-            printf("  Seq Key: %lld\n", current_record.seq_key);
-            fclose(fp);
-            return;
-        } else if (current_record.product_id > target_product_id) {
+    long long current_index = entry.record_index;
+    long long skipped_records = before;
+    ProductRecord copy;
+    const ProductRecord *current_record;
+    while (skipped_records < records_to_skip && current_index != -1) {
+        if ((current_record = product_at(store, current_index, &copy)) == NULL) {
+            current_index = -1;
             break;
         }
+        if (current_record->ativo) {
+            skipped_records++;
+        }
+        current_index = current_record->elo;
+    }
 
-        current_index = current_record.elo;
+    if (current_index == -1) {
+        printf("Pagina invalida ou sem registros suficientes.\n");
+        return;
     }
 
-    printf("\nProduto com product_id %lld nao encontrado.\n", target_product_id);
-    fclose(fp);
+    printf("\nExibindo registros da pagina %lld seguindo os elos:\n", pag);
+    display_page_from(store, current_index, next);
 }
 
-
-int replace_original_with_sorted(const char *original_file, const char *sorted_file) {
-    remove(original_file);
-    rename(sorted_file, original_file);
-    return 0;
+void display_records_via_elo(Storage *store, long long pag, PageCursor *next) {
+    storage_begin_read(store);
+    display_records_via_elo_locked(store, pag, next);
+    storage_end_read(store);
 }
 
-
-void display_records_via_elo(long long pag) {
-    FILE *fp = fopen(ORIGINAL_FILE_NAME, "rb");
-    if (fp == NULL) {
-        printf("Erro ao abrir o arquivo.\n");
-        return;
+/*
+ * Exibe a pagina que comeca em cursor e o avanca para a seguinte. Se o
+ * registro do cursor foi removido ou mudou de posicao (por exemplo, depois de
+ * compact_records), a pagina recomeca no menor product_id maior ou igual ao
+ * do cursor. Retorna o numero de produtos exibidos.
+ */
+long long display_next_page(Storage *store, PageCursor *cursor) {
+    if (cursor->record_index == -1) {
+        printf("Nao ha mais paginas.\n");
+        return 0;
     }
 
-    Header header;
-    fread(&header, sizeof(Header), 1, fp);
-    if (header.head_index == -1) {
-        printf("Nenhum registro encontrado.\n");
-        fclose(fp);
-        return;
+    long long current_index = cursor->record_index;
+    ProductRecord copy;
+    storage_begin_read(store);
+    const ProductRecord *current_record = product_at(store, current_index, &copy);
+    if (current_record == NULL || !current_record->ativo || current_record->product_id != cursor->product_id) {
+        SortedCursor position;
+        ProductRecord successor;
+        sorted_seek(store, cursor->product_id, &position);
+        if (!sorted_next(store, &position, &successor, &current_index)) {
+            storage_end_read(store);
+            cursor->record_index = -1;
+            cursor->product_id = -1;
+            printf("Nao ha mais paginas.\n");
+            return 0;
+        }
     }
 
-    long long current_index = header.head_index;
-    ProductRecord current_record;
+    printf("\nExibindo a proxima pagina seguindo os elos:\n");
+    long long displayed = display_page_from(store, current_index, cursor);
+    storage_end_read(store);
+    return displayed;
+}
 
-    long long records_to_skip = (pag - 1) * RECORDS_PER_PAGE;
-    long long skipped_records = 0;
+/*
+ * Copia para page a pagina que comeca em cursor e o avanca para a seguinte,
+ * sem exibir nada. A pagina e uma varredura por faixa de product_id na regiao
+ * base e no delta (ver sorted_next), sem seguir os elos. Um cursor zerado
+ * comeca no primeiro produto. Retorna o numero de produtos copiados.
+ */
+long long read_page_from(Storage *store, PageCursor *cursor, ProductRecord *page) {
+    if (cursor->record_index == -1) {
+        return 0;
+    }
 
-    while (skipped_records < records_to_skip && current_index != -1) {
-        fseek(fp, sizeof(Header) + current_index * sizeof(ProductRecord), SEEK_SET);
-        fread(&current_record, sizeof(ProductRecord), 1, fp);
-        if (current_record.ativo) {
-            skipped_records++;
+    SortedCursor position;
+    ProductRecord record;
+    long long slot;
+    long long count = 0;
+    sorted_seek(store, cursor->product_id, &position);
+    cursor->record_index = -1;
+    cursor->product_id = -1;
+    while (sorted_next(store, &position, &record, &slot)) {
+        if (count == RECORDS_PER_PAGE) {
+            cursor->record_index = slot;
+            cursor->product_id = record.product_id;
+            break;
         }
-        current_index = current_record.elo;
+        page[count++] = record;
     }
+    return count;
+}
 
-    if (current_index == -1 && skipped_records < records_to_skip) {
-        printf("Pagina invalida ou sem registros suficientes.\n");
-        fclose(fp);
-        return;
-    }
+/*
+ * read_page_from numa so versao publicada: num leitor, a pagina e refeita a
+ * partir do mesmo cursor se um escritor publicar no meio dela. Retorna o
+ * numero de produtos, ou -1 se o estado publicado nao puder ser lido.
+ */
+long long read_page(Storage *store, PageCursor *cursor, ProductRecord *page) {
+    PageCursor start = *cursor;
+    long long count;
+    storage_begin_read(store);
+    do {
+        *cursor = start;
+        if (snapshot_begin(store) != 0) {
+            storage_end_read(store);
+            return -1;
+        }
+        count = read_page_from(store, cursor, page);
+    } while (!snapshot_end(store));
+    storage_end_read(store);
+    return count;
+}
 
-    printf("\nExibindo registros da pagina %lld seguindo os elos:\n", pag);
-    long long records_displayed = 0;
-    while (records_displayed < RECORDS_PER_PAGE && current_index != -1) {
-        fseek(fp, sizeof(Header) + current_index * sizeof(ProductRecord), SEEK_SET);
-        fread(&current_record, sizeof(ProductRecord), 1, fp);
-
-        if (current_record.ativo) {
-            printf("Registro %lld:\n", current_record.seq_key);
-            printf("  Product ID: %lld\n", current_record.product_id);
-            printf("  Category ID: %lld\n", current_record.category_id);
-            printf("  Category Code: %s\n", current_record.category_code);
-            printf("  Brand: %s\n", current_record.brand);
-            printf("  Price: %.2f\n", current_record.price);
-            printf("  Ativo: %s\n", current_record.ativo ? "Sim" : "Nao");
-            printf("  Seq Key: %lld\n", current_record.seq_key);
-            printf("  Elo (Proximo Indice): %lld\n\n", current_record.elo);
 
-            records_displayed++;
+/*
+ * Preenche page com ate RECORDS_PER_PAGE produtos que atendem filter, em
+ * ordem de preco, e avanca cursor para a pagina seguinte. Usa o indice por
+ * categoria (filtrando a marca pela chave) ou, sem categoria, o indice por
+ * marca; so os registros encontrados sao lidos de products.bin. slots pode
+ * ser NULL. Retorna o numero de produtos, ou -1 se o filtro nao tiver
+ * categoria nem marca ou se um indice ou registro nao puder ser lido.
+ */
+long long query_products_locked(Storage *store, const ProductFilter *filter, QueryCursor *cursor, ProductRecord *page, long long *slots) {
+    long long brand = -1;
+    if (filter->brand != NULL) {
+        brand = dictionary_find(store, filter->brand);
+        if (brand == -2) {
+            return -1;
+        }
+        if (brand < 0) {
+            cursor->done = 1;
+            return 0;
         }
+    }
+    if (filter->category_id == -1 && brand == -1) {
+        return -1;
+    }
+    SecondaryTree *tree = filter->category_id != -1 ? &store->category_tree : &store->brand_tree;
+    long long group = filter->category_id != -1 ? filter->category_id : brand;
+    unsigned int max_price = price_order_bits(filter->max_price);
 
-        current_index = current_record.elo;
+    if (!cursor->started) {
+        cursor->started = 1;
+        cursor->done = 0;
+        cursor->next.group = group;
+        cursor->next.price = price_order_bits(filter->min_price);
+        cursor->next.payload = 0;
+        cursor->next.slot = -1;
+    }
+    if (cursor->done) {
+        return 0;
     }
 
-    if (records_displayed == 0) {
-        printf("Nenhum registro ativo encontrado nesta pagina.\n");
+    SecondaryNode leaf;
+    long long found = 0;
+    if (tree_find_leaf(&tree->btree, &cursor->next, &leaf, NULL, NULL) == -1) {
+        if (tree->btree.meta.root != -1) {
+            return -1;
+        }
+        cursor->done = 1;
+        return 0;
+    }
+    int pos = tree_leaf_lower_bound(&SIDX_LAYOUT, &leaf, &cursor->next);
+    while (1) {
+        if (pos == leaf.count) {
+            if (leaf.next == -1) {
+                cursor->done = 1;
+                break;
+            }
+            if (sidx_read_node(tree, leaf.next, &leaf) != 0) {
+                return -1;
+            }
+            pos = 0;
+            continue;
+        }
+        const SecondaryKey *key = &leaf.keys[pos];
+        if (key->group != group || key->price > max_price) {
+            cursor->done = 1;
+            break;
+        }
+        if (found == RECORDS_PER_PAGE) {
+            cursor->next = *key;
+            break;
+        }
+        if (tree == &store->category_tree && brand != -1 && key->payload != (unsigned int)brand) {
+            pos++;
+            continue;
+        }
+        if (read_product(store, key->slot, &page[found]) != 0) {
+            return -1;
+        }
+        if (slots != NULL) {
+            slots[found] = key->slot;
+        }
+        found++;
+        pos++;
+    }
+    return found;
+}
+
+/*
+ * query_products_locked numa so versao publicada: num leitor, a pagina e
+ * refeita a partir do mesmo cursor se um escritor publicar no meio dela. Se
+ * a pagina nao puder ser lida, o cursor fica como estava e o retorno e -1.
+ */
+long long query_products(Storage *store, const ProductFilter *filter, QueryCursor *cursor, ProductRecord *page, long long *slots) {
+    QueryCursor start = *cursor;
+    long long found;
+    storage_begin_read(store);
+    do {
+        *cursor = start;
+        if (snapshot_begin(store) != 0) {
+            found = -1;
+            break;
+        }
+        found = query_products_locked(store, filter, cursor, page, slots);
+    } while (!snapshot_end(store));
+    storage_end_read(store);
+    if (found < 0) {
+        *cursor = start;
     }
+    return found;
+}
 
-    fclose(fp);
+/*
+ * Exibe a proxima pagina de query_products. Os nomes vem da mesma versao
+ * publicada que a pagina.
+ */
+long long display_query_page(Storage *store, const ProductFilter *filter, QueryCursor *cursor) {
+    if (filter->category_id == -1 && filter->brand == NULL) {
+        printf("Informe a categoria ou a marca.\n");
+        return -1;
+    }
+    ProductRecord page[RECORDS_PER_PAGE];
+    char category_codes[RECORDS_PER_PAGE][DICTIONARY_ENTRY_LEN];
+    char brands[RECORDS_PER_PAGE][DICTIONARY_ENTRY_LEN];
+    QueryCursor start = *cursor;
+    long long found;
+    storage_begin_read(store);
+    do {
+        *cursor = start;
+        if (snapshot_begin(store) != 0) {
+            found = -1;
+            break;
+        }
+        found = query_products_locked(store, filter, cursor, page, NULL);
+        for (long long i = 0; i < found; i++) {
+            dictionary_string(store, page[i].category_code, category_codes[i]);
+            dictionary_string(store, page[i].brand, brands[i]);
+        }
+    } while (!snapshot_end(store));
+    storage_end_read(store);
+    if (found < 0) {
+        *cursor = start;
+        printf("Erro ao ler o estado publicado.\n");
+        return found;
+    }
+    for (long long i = 0; i < found; i++) {
+        printf("  Product ID: %lld | Category ID: %lld | Category Code: %s | Brand: %s | Price: %.2f\n",
+               page[i].product_id, page[i].category_id, category_codes[i], brands[i], page[i].price);
+    }
+    if (found == 0) {
+        printf("Nenhum produto encontrado.\n");
+    }
+    return found;
 }
 
 
-void print_all_records_sequential(long long pag) {
-    FILE *fp = fopen(ORIGINAL_FILE_NAME, "rb");
-    if (fp == NULL) {
-        printf("Erro ao abrir o arquivo.\n");
-        return;
+/*
+ * Conta os produtos ativos com preco em [min_price, max_price] e, se
+ * category_id != -1, dessa categoria, e soma os seus precos (para a media).
+ * Le so as colunas category_id e price e o bitmap: direto do mapeamento no
+ * modo mmap, ou em blocos de COLUMN_BLOCK registros. Num leitor, a varredura
+ * e refeita se um escritor publicar no meio dela. Retorna -1 se as colunas
+ * nao puderem ser lidas.
+ */
+long long column_scan(Storage *store, long long category_id, float min_price, float max_price, double *sum) {
+    long long *categories = malloc(COLUMN_BLOCK * sizeof(long long));
+    float *prices = malloc(COLUMN_BLOCK * sizeof(float));
+    unsigned char *active = malloc(COLUMN_BLOCK / 8);
+    long long count = 0;
+    *sum = 0.0;
+    if (categories == NULL || prices == NULL || active == NULL) {
+        free(categories);
+        free(prices);
+        free(active);
+        return -1;
     }
 
-    Header header;
-    fread(&header, sizeof(Header), 1, fp);
+    int result;
+    storage_begin_read(store);
+    do {
+        if (snapshot_begin(store) != 0) {
+            result = -1;
+            break;
+        }
+        pool_advise(&store->columns, MADV_SEQUENTIAL);
+        result = column_scan_blocks(store, category_id, min_price, max_price, categories, prices, active, &count, sum);
+    } while (!snapshot_end(store));
+    pool_advise(&store->columns, MADV_RANDOM);
+    storage_end_read(store);
+    free(categories);
+    free(prices);
+    free(active);
+    return result == 0 ? count : -1;
+}
+
 
-    fseek(fp, 0, SEEK_END);
-    long long file_size = ftell(fp);
-    long long num_records = (file_size - sizeof(Header)) / sizeof(ProductRecord);
+void print_all_records_sequential(Storage *store, long long pag) {
+    long long num_records = product_count(store);
 
     if (pag < 1 || (pag - 1) * RECORDS_PER_PAGE >= num_records) {
         printf("Pagina invalida.\n");
-        fclose(fp);
         return;
     }
 
     long long start_record = (pag - 1) * RECORDS_PER_PAGE;
-    fseek(fp, sizeof(Header) + start_record * sizeof(ProductRecord), SEEK_SET);
 
+    storage_begin_read(store);
+    pool_advise(&store->data, MADV_SEQUENTIAL);
     printf("\nExibindo registros da pagina %lld:\n", pag);
-    ProductRecord record;
+    char category_code[DICTIONARY_ENTRY_LEN];
+    char brand[DICTIONARY_ENTRY_LEN];
     for (long long i = 0; i < RECORDS_PER_PAGE && (start_record + i) < num_records; i++) {
-        fread(&record, sizeof(ProductRecord), 1, fp);
+        ProductRecord copy;
+        const ProductRecord *record = product_at(store, start_record + i, &copy);
 
-        if (record.ativo) {
+        if (record != NULL && record->ativo) {
             printf("Registro %lld:\n", start_record + i + 1);
-            printf("  Product ID: %lld\n", record.product_id);
-            printf("  Category ID: %lld\n", record.category_id);
-            printf("  Category Code: %s\n", record.category_code);
-            printf("  Brand: %s\n", record.brand);
-            printf("  Price: %.2f\n", record.price);
-            printf("  Ativo: %s\n", record.ativo ? "Sim" : "Nao");
-            printf("  Seq Key: %lld\n\n", record.seq_key);
+            printf("  Product ID: %lld\n", record->product_id);
+            printf("  Category ID: %lld\n", record->category_id);
+            printf("  Category Code: %s\n", dictionary_string(store, record->category_code, category_code));
+            printf("  Brand: %s\n", dictionary_string(store, record->brand, brand));
+            printf("  Price: %.2f\n", record->price);
+            printf("  Ativo: %s\n", record->ativo ? "Sim" : "Nao");
+            printf("  Seq Key: %lld\n\n", record->seq_key);
         }
     }
-
-    fclose(fp);
+    pool_advise(&store->data, MADV_RANDOM);
+    storage_end_read(store);
 }
 
 
-void search_and_display_product(long long target_product_id) {
-    FILE *fp = fopen(ORIGINAL_FILE_NAME, "rb");
-    if (fp == NULL) {
-        printf("Erro ao abrir o arquivo de dados.\n");
-        return;
-    }
-
-    Header header;
-    fread(&header, sizeof(Header), 1, fp);
-
-    long long current_index = header.head_index;
-    ProductRecord current_record;
-
-    while (current_index != -1) {
-        fseek(fp, sizeof(Header) + current_index * sizeof(ProductRecord), SEEK_SET);
-        fread(&current_record, sizeof(ProductRecord), 1, fp);
+/*
+ * Exibe o produto ativo com target_product_id, lido numa so versao publicada.
+ */
+void search_and_display_product(Storage *store, long long target_product_id) {
+    long long current_index;
+    ProductRecord record;
+    char category_code[DICTIONARY_ENTRY_LEN];
+    char brand[DICTIONARY_ENTRY_LEN];
+    int found;
 
-        if (current_record.product_id == target_product_id && current_record.ativo) {
-            printf("\nProduto encontrado no indice %lld:\n", current_index + 1);
-            printf("  Product ID: %lld\n", current_record.product_id);
-            printf("  Category ID: %lld\n", current_record.category_id);
-            printf("  Category Code: %s\n", current_record.category_code);
-            printf("  Brand: %s\n", current_record.brand);
-            printf("  Price: %.2f\n", current_record.price);
-            printf("  Ativo: %s\n", current_record.ativo ? "Sim" : "Nao");
-            printf("  Seq Key: %lld\n", current_record.seq_key);
-            fclose(fp);
-            return;
+    storage_begin_read(store);
+    do {
+        if (snapshot_begin(store) != 0) {
+            found = -1;
+            break;
+        }
+        found = bloom_may_contain(store, target_product_id) && sorted_find(store, target_product_id, &current_index) &&
+                read_product(store, current_index, &record) == 0 && record.product_id == target_product_id && record.ativo;
+        if (found) {
+            dictionary_string(store, record.category_code, category_code);
+            dictionary_string(store, record.brand, brand);
         }
+    } while (!snapshot_end(store));
+    storage_end_read(store);
 
-        current_index = current_record.elo;
+    if (found < 0) {
+        printf("Erro ao ler o estado publicado.\n");
+    } else if (found) {
+        printf("\nProduto encontrado no indice %lld:\n", current_index + 1);
+        printf("  Product ID: %lld\n", record.product_id);
+        printf("  Category ID: %lld\n", record.category_id);
+        printf("  Category Code: %s\n", category_code);
+        printf("  Brand: %s\n", brand);
+        printf("  Price: %.2f\n", record.price);
+        printf("  Ativo: %s\n", record.ativo ? "Sim" : "Nao");
+        printf("  Seq Key: %lld\n", record.seq_key);
+    } else {
+        printf("\nProduto com product_id %lld nao encontrado.\n", target_product_id);
     }
+}
 
-    printf("\nProduto com product_id %lld nao encontrado.\n", target_product_id);
-    fclose(fp);
+/*
+ * Copia para record o produto ativo com product_id, numa so versao
+ * publicada. Retorna 1 se ele existe, 0 se nao, ou -1 se o estado publicado
+ * nao puder ser lido.
+ */
+int find_product(Storage *store, long long product_id, ProductRecord *record) {
+    int found;
+    storage_begin_read(store);
+    do {
+        if (snapshot_begin(store) != 0) {
+            storage_end_read(store);
+            return -1;
+        }
+        long long slot;
+        found = bloom_may_contain(store, product_id) && sorted_find(store, product_id, &slot) &&
+                read_product(store, slot, record) == 0 && record->product_id == product_id && record->ativo;
+    } while (!snapshot_end(store));
+    storage_end_read(store);
+    return found;
 }
 
 
-void update_partial_index() {
-    if (create_partial_index(ORIGINAL_FILE_NAME, INDEX_FILE_NAME, RECORDS_PER_INDEX) != 0) {
+void update_partial_index(Storage *store) {
+    if (storage_begin_write(store) != 0) {
+        printf("Erro ao atualizar o indice parcial.\n");
+        return;
+    }
+    if (create_partial_index(store, RECORDS_PER_INDEX) != 0) {
         printf("Erro ao atualizar o indice parcial.\n");
     }
+    // Sem transacao em products.bin, wal_commit nao publicaria o indice
+    storage_publish(store, 1);
+    pthread_mutex_unlock(&store->writer);
+}
+
+/*
+ * Leitor do exemplo: le as primeiras DEMO_READER_PAGES paginas com o seu
+ * proprio handle e confere alguns produtos de cada uma com find_product, que
+ * busca na base ordenada. So exibe algo se a leitura falhar ou divergir.
+ */
+void *reader_thread(void *arg) {
+    (void)arg;
+    Storage reader;
+    if (storage_open_reader(&reader) != 0) {
+        printf("Erro ao abrir um leitor concorrente.\n");
+        return NULL;
+    }
+    PageCursor cursor;
+    memset(&cursor, 0, sizeof(PageCursor));
+    ProductRecord page[RECORDS_PER_PAGE];
+    long long count = 0;
+    for (int pages = 0; pages < DEMO_READER_PAGES && (count = read_page(&reader, &cursor, page)) > 0; pages++) {
+        for (long long i = 0; i < count && i < DEMO_READER_LOOKUPS; i++) {
+            ProductRecord found;
+            if (find_product(&reader, page[i].product_id, &found) != 1 || found.price != page[i].price) {
+                printf("Leitor concorrente: divergencia no product_id %lld.\n", page[i].product_id);
+            }
+        }
+    }
+    if (count < 0) {
+        printf("Erro ao ler o estado publicado num leitor concorrente.\n");
+    }
+    storage_close(&reader);
+    return NULL;
 }
 
 int main() {
     initialize_file();
+    Storage store;
+    if (storage_open(&store, STORAGE_MODE) != 0) {
+        return EXIT_FAILURE;
+    }
     printf("Inserindo registros de exemplo...\n");
-    // ProductRecord records_to_insert[] = {
+    // ProductEntry records_to_insert[] = {
     //     create_sample_product(101, 1, "CAT01", "BrandA", 19.99, 1),
     //     create_sample_product(103, 2, "CAT02", "BrandB", 29.99, 1),
     //     create_sample_product(102, 1, "CAT01", "BrandC", 24.99, 1),
@@ -492,7 +4920,7 @@ int main() {
     // };
     // int num_records = sizeof(records_to_insert) / sizeof(records_to_insert[0]);
     // for (int i = 0; i < num_records; ++i) {
-    //     if (insert_record(&records_to_insert[i]) == 0) {
+    //     if (insert_record(&store, &records_to_insert[i]) == 0) {
     //         printf("Registro com product_id %lld inserido com sucesso.\n", records_to_insert[i].product_id);
     //     } else {
     //         printf("Falha ao inserir o registro com product_id %lld.\n", records_to_insert[i].product_id);
@@ -500,28 +4928,72 @@ int main() {
     // }
     printf("Insercao de registros concluida.\n");
 
-   
-    update_partial_index();
+    // Leitores em paralelo com o restante do exemplo, cada um com o seu handle
+    long long reader_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (reader_count < 1) reader_count = 1;
+    pthread_t *readers = malloc(reader_count * sizeof(pthread_t));
+    if (readers == NULL) {
+        return EXIT_FAILURE;
+    }
+    long long started = 0;
+    while (started < reader_count && pthread_create(&readers[started], NULL, reader_thread, NULL) == 0) {
+        started++;
+    }
 
-    display_records_via_elo(1);
+    PageCursor cursor;
+    display_records_via_elo(&store, 1, &cursor);
+    display_next_page(&store, &cursor);
 
   
     long long search_id = 102;
     printf("\nRealizando busca pelo product_id %lld utilizando o indice parcial...\n", search_id);
-    query_using_partial_index(search_id);
+    query_using_partial_index(&store, search_id);
 
 
-    print_all_records_sequential(1);
+    print_all_records_sequential(&store, 1);
 
+    ProductRecord first_product;
+    storage_begin_read(&store);
+    int has_first = store.header.head_index != -1 && read_product(&store, store.header.head_index, &first_product) == 0;
+    storage_end_read(&store);
+    if (has_first) {
+        ProductFilter filter = {first_product.category_id, NULL, 0.0f, 1000.0f};
+        QueryCursor query_cursor;
+        memset(&query_cursor, 0, sizeof(QueryCursor));
+        printf("\nProdutos da categoria %lld com preco entre %.2f e %.2f:\n", filter.category_id, filter.min_price, filter.max_price);
+        display_query_page(&store, &filter, &query_cursor);
 
-    printf("\nRemovendo o produto com product_id %lld...\n", search_id);
-    remove_record(search_id);
+        double price_sum;
+        long long in_category = column_scan(&store, filter.category_id, -FLT_MAX, FLT_MAX, &price_sum);
+        if (in_category > 0) {
+            printf("\nPreco medio da categoria %lld: %.2f (%lld produtos)\n", filter.category_id, price_sum / in_category, in_category);
+        }
+        long long below = column_scan(&store, -1, -FLT_MAX, 100.0f, &price_sum);
+        if (below >= 0) {
+            printf("Produtos com preco ate %.2f: %lld\n", 100.0f, below);
+        }
+    }
+
+    for (long long i = 0; i < started; i++) {
+        pthread_join(readers[i], NULL);
+    }
+    free(readers);
 
-    update_partial_index();
+    printf("\nRemovendo o produto com product_id %lld...\n", search_id);
+    remove_record(&store, search_id);
 
 
     printf("\nRealizando nova busca pelo product_id %lld apos remocao...\n", search_id);
-    query_using_partial_index(search_id);
+    query_using_partial_index(&store, search_id);
+
+    long long free_slots = count_free_slots(&store);
+    if (free_slots > 0 && free_slots * 100 >= product_count(&store) * COMPACT_FREE_PERCENT) {
+        printf("\nCompactando %s...\n", ORIGINAL_FILE_NAME);
+        compact_records(&store);
+    } else {
+        printf("\n%s tem %lld posicoes livres; compactacao dispensada.\n", ORIGINAL_FILE_NAME, free_slots);
+    }
 
+    storage_close(&store);
     return 0;
 }
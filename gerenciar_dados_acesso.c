@@ -1,6 +1,13 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define MAX_EVENT_TIME_LEN 64
 #define MAX_EVENT_TYPE_LEN 32
@@ -8,10 +15,74 @@
 
 #define ORIGINAL_FILE_NAME "access.bin"
 #define INDEX_FILE_NAME "access.idx"
+#define SESSIONS_FILE_NAME "access.sess"
 
 #define RECORDS_PER_INDEX 100000
+#define INDEX_MAGIC "AIDX"
+#define INDEX_MIN_SPAN (RECORDS_PER_INDEX / 2)
+#define INDEX_CHECK_INTERVAL_NS 10000000LL
 #define RECORDS_PER_PAGE 10
 
+#define ACCESS_FILE_MAGIC "ACCS"
+#define ACCESS_FILE_VERSION 2
+#define MAX_EVENT_TYPES 256
+#define EVENT_TIME_UNKNOWN LLONG_MIN
+#define SESSION_BYTES 16
+#define SESSION_UUID 0
+#define SESSION_TEXT 1
+#define SESSION_OVERFLOW 2
+
+#define POOL_PAGE_SIZE 4096
+#define POOL_MAP_EXTENT (1 << 20)
+#define DATA_POOL_FRAMES 256
+#define INDEX_POOL_FRAMES 16
+
+#define WAL_FILE_NAME "access.wal"
+#define WAL_START 1
+#define WAL_WRITE 2
+#define WAL_COMMIT 3
+#define WAL_GROUP_COMMITS 64
+#define WAL_GROUP_BYTES (1 << 20)
+#define WAL_CHECKPOINT_PAGES 2048
+#define WAL_CHECKSUM_SEED 14695981039346656037ull
+
+#define STORAGE_BUFFERED 0
+#define STORAGE_MAPPED 1
+#ifndef STORAGE_MODE
+#define STORAGE_MODE STORAGE_BUFFERED
+#endif
+
+/**
+ * Cabeçalho de access.bin (formato v2), seguido dos registros de tamanho fixo.
+ */
+typedef struct {
+    char magic[4];
+    unsigned int version;
+    unsigned int event_type_count;
+    unsigned int record_size;
+    char event_types[MAX_EVENT_TYPES][MAX_EVENT_TYPE_LEN];
+} AccessFileHeader;
+
+/**
+ * Registro gravado em access.bin: hora em segundos desde 1970 (UTC), tipo de
+ * evento como código do dicionário do cabeçalho e sessão como UUID binário,
+ * texto curto ou referência ao arquivo de sessões.
+ */
+typedef struct {
+    long long event_time;
+    long long product_id;
+    long long user_id;
+    long long seq_key;
+    unsigned char user_session[SESSION_BYTES];
+    unsigned char event_type;
+    unsigned char session_kind;
+    unsigned char ativo;
+    unsigned char reserved[5];
+} AccessRecord;
+
+/**
+ * Acesso em forma de texto, como é criado e exibido.
+ */
 typedef struct {
     char event_time[MAX_EVENT_TIME_LEN];
     char event_type[MAX_EVENT_TYPE_LEN];
@@ -20,13 +91,1268 @@ typedef struct {
     char user_session[MAX_USER_SESSION_LEN];
     long long seq_key;
     int ativo;
-} AccessRecord;
+} AccessEvent;
 
 typedef struct {
     long long seq_key;
     long long record_index;
+    long long count;            // Registros ativos de record_index até a próxima entrada
 } IndexRecord;
 
+typedef struct {
+    long long size;
+    long long mtime_sec;
+    long long mtime_nsec;
+} DataStamp;
+
+/**
+ * Cabeçalho de access.idx, seguido de entry_count entradas IndexRecord.
+ */
+typedef struct {
+    char magic[4];
+    int records_per_index;
+    long long entry_count;
+    DataStamp data;
+} IndexHeader;
+
+/**
+ * Registro do log de escrita antecipada (access.wal). WAL_WRITE é seguido dos
+ * length bytes gravados em offset de access.bin; WAL_COMMIT fecha a transação
+ * com a soma de verificação dos seus registros WAL_WRITE; WAL_START abre o log
+ * depois de cada checkpoint.
+ */
+typedef struct {
+    unsigned int type;
+    unsigned int length;
+    long long offset;           // WAL_START e WAL_COMMIT: tamanho de access.bin
+    unsigned long long checksum;
+} WalRecord;
+
+typedef struct {
+    int fd;
+    char *buffer;               // Registros ainda não gravados no log
+    size_t used;
+    size_t capacity;
+    int in_transaction;
+    unsigned long long checksum; // Da transação aberta
+    int unsynced_commits;       // Transações confirmadas desde o último fsync
+    int unsynced_sessions;      // access.sess recebeu sessões desde o último fsync
+} WriteAheadLog;
+
+typedef struct {
+    long long page;             // Página carregada no quadro (-1 se livre)
+    int dirty;
+    int referenced;
+    int next;                   // Próximo quadro na mesma lista da tabela hash
+    char *data;
+} Frame;
+
+typedef struct {
+    int fd;
+    Frame *frames;
+    char *memory;
+    int frame_count;
+    int clock_hand;
+    int *buckets;
+    int bucket_mask;
+    long long file_size;        // Tamanho lógico, incluindo páginas ainda não gravadas
+    int mapped;                 // Modo mmap: o arquivo inteiro mapeado, sem quadros
+    char *map;
+    long long map_capacity;
+    int advice;
+    WriteAheadLog *wal;         // Com log, as escritas ficam em páginas pendentes até o checkpoint
+    long long *pending_pages;   // Tabela hash com endereçamento aberto (-1 se livre)
+    char **pending_data;
+    int pending_mask;
+    int pending_count;
+} BufferPool;
+
+/**
+ * Cópia do índice parcial em memória. As chaves ficam em um vetor próprio na
+ * ordem de Eytzinger (em largura: os filhos de k estão em 2k e 2k + 1), para
+ * que a busca desça tocando poucas linhas de cache; os demais campos ficam em
+ * entries, na ordem do arquivo.
+ */
+typedef struct {
+    long long *keys;            // Posições 1..count
+    long long *ranks;           // Posição em entries de cada chave de keys
+    IndexRecord *entries;
+    long long count;
+    long long checked_at;       // Última verificação do arquivo (CLOCK_MONOTONIC, ns)
+    DataStamp file;             // Estado de access.idx quando foi carregado
+    int valid;
+} IndexCache;
+
+/**
+ * Handle de longa duração para access.bin e access.idx: o cabeçalho fica em
+ * memória e cada arquivo tem o seu pool de buffers.
+ */
+typedef struct {
+    BufferPool data;
+    WriteAheadLog wal;
+    AccessFileHeader header;
+    BufferPool index;
+    IndexHeader index_header;
+    IndexCache index_cache;
+} Storage;
+
+unsigned long long wal_checksum(unsigned long long hash, const void *data, size_t length) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+/**
+ * Grava no log os registros acumulados no buffer, sem fsync.
+ */
+int wal_write_out(WriteAheadLog *wal) {
+    size_t done = 0;
+    while (done < wal->used) {
+        ssize_t n = write(wal->fd, wal->buffer + done, wal->used - done);
+        if (n <= 0) {
+            perror("Erro ao gravar o log de escrita antecipada");
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    wal->used = 0;
+    return 0;
+}
+
+int wal_put(WriteAheadLog *wal, const void *data, size_t length) {
+    // Uma transação grande vai para o arquivo aos poucos; sem o WAL_COMMIT ela
+    // é ignorada na recuperação
+    if (wal->used + length > wal->capacity && wal->used >= WAL_GROUP_BYTES && wal_write_out(wal) != 0) {
+        return -1;
+    }
+    if (wal->used + length > wal->capacity) {
+        size_t capacity = wal->capacity > 0 ? wal->capacity : 4096;
+        while (capacity < wal->used + length) {
+            capacity *= 2;
+        }
+        char *buffer = realloc(wal->buffer, capacity);
+        if (buffer == NULL) {
+            perror("Erro ao alocar o buffer do log");
+            exit(EXIT_FAILURE);
+        }
+        wal->buffer = buffer;
+        wal->capacity = capacity;
+    }
+    memcpy(wal->buffer + wal->used, data, length);
+    wal->used += length;
+    return 0;
+}
+
+/**
+ * Acrescenta a escrita de length bytes em offset à transação aberta, abrindo
+ * uma se necessário.
+ */
+int wal_append(WriteAheadLog *wal, long long offset, const void *data, size_t length) {
+    WalRecord record = {WAL_WRITE, (unsigned int)length, offset, 0};
+    if (!wal->in_transaction) {
+        wal->in_transaction = 1;
+        wal->checksum = WAL_CHECKSUM_SEED;
+    }
+    wal->checksum = wal_checksum(wal->checksum, &record, sizeof(WalRecord));
+    wal->checksum = wal_checksum(wal->checksum, data, length);
+    if (wal_put(wal, &record, sizeof(WalRecord)) != 0) {
+        return -1;
+    }
+    return wal_put(wal, data, length);
+}
+
+/**
+ * Fecha a transação aberta. O WAL_COMMIT fica no buffer até o próximo
+ * wal_sync: as transações são confirmadas no disco em grupo.
+ */
+int wal_end_transaction(WriteAheadLog *wal, long long file_size) {
+    if (!wal->in_transaction) {
+        return 0;
+    }
+    WalRecord record = {WAL_COMMIT, 0, file_size, wal->checksum};
+    wal->in_transaction = 0;
+    wal->unsynced_commits++;
+    return wal_put(wal, &record, sizeof(WalRecord));
+}
+
+/**
+ * Grava o buffer e faz um único fsync para todas as transações confirmadas
+ * desde o anterior. As sessões longas que elas referenciam em access.sess são
+ * sincronizadas antes.
+ */
+int wal_sync(WriteAheadLog *wal) {
+    if (wal->unsynced_sessions) {
+        int fd = open(SESSIONS_FILE_NAME, O_RDONLY);
+        if (fd < 0 || fdatasync(fd) != 0) {
+            perror("Erro ao sincronizar o arquivo de sessões");
+            if (fd >= 0) {
+                close(fd);
+            }
+            return -1;
+        }
+        close(fd);
+        wal->unsynced_sessions = 0;
+    }
+    if (wal->used > 0 && wal_write_out(wal) != 0) {
+        return -1;
+    }
+    if (wal->unsynced_commits > 0) {
+        if (fdatasync(wal->fd) != 0) {
+            perror("Erro ao sincronizar o log de escrita antecipada");
+            return -1;
+        }
+        wal->unsynced_commits = 0;
+    }
+    return 0;
+}
+
+/**
+ * Reinicia o log depois de um checkpoint, deixando só o WAL_START com o
+ * tamanho atual de access.bin. O registro antigo é sobrescrito antes do corte:
+ * uma queda no meio só faz reaplicar transações já gravadas.
+ */
+int wal_restart(WriteAheadLog *wal, long long file_size) {
+    WalRecord record = {WAL_START, 0, file_size, 0};
+    if (pwrite(wal->fd, &record, sizeof(WalRecord), 0) != (ssize_t)sizeof(WalRecord) ||
+        ftruncate(wal->fd, sizeof(WalRecord)) != 0 ||
+        lseek(wal->fd, sizeof(WalRecord), SEEK_SET) < 0 ||
+        fdatasync(wal->fd) != 0) {
+        perror("Erro ao reiniciar o log de escrita antecipada");
+        return -1;
+    }
+    wal->used = 0;
+    return 0;
+}
+
+/**
+ * Abre o pool de buffers de um arquivo: quadros de POOL_PAGE_SIZE bytes com
+ * substituição CLOCK e escrita adiada das páginas alteradas, que só vão para o
+ * arquivo quando o quadro é substituído ou em pool_flush. Com mapped, o arquivo
+ * é mapeado com mmap e os quadros não são usados.
+ */
+int pool_open(BufferPool *pool, const char *filename, int frame_count, int mapped) {
+    pool->fd = open(filename, O_RDWR | O_CREAT, 0644);
+    if (pool->fd < 0) {
+        perror("Erro ao abrir o arquivo do pool de buffers");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(pool->fd, &st) != 0) {
+        perror("Erro ao obter o tamanho do arquivo");
+        close(pool->fd);
+        return -1;
+    }
+    pool->file_size = st.st_size;
+    pool->mapped = mapped;
+    pool->map = NULL;
+    pool->map_capacity = 0;
+    pool->advice = MADV_RANDOM;
+    pool->wal = NULL;
+    pool->pending_pages = NULL;
+    pool->pending_data = NULL;
+    pool->pending_mask = -1;
+    pool->pending_count = 0;
+    if (mapped) {
+        pool->frame_count = 0;
+        pool->frames = NULL;
+        pool->memory = NULL;
+        pool->buckets = NULL;
+        pool->bucket_mask = -1;
+        if (pool->file_size > 0) {
+            pool->map = mmap(NULL, pool->file_size, PROT_READ | PROT_WRITE, MAP_SHARED, pool->fd, 0);
+            if (pool->map == MAP_FAILED) {
+                perror("Erro ao mapear o arquivo");
+                close(pool->fd);
+                return -1;
+            }
+            pool->map_capacity = pool->file_size;
+            madvise(pool->map, pool->map_capacity, pool->advice);
+        }
+        return 0;
+    }
+    pool->frame_count = frame_count > 0 ? frame_count : 1;
+    pool->clock_hand = 0;
+    pool->bucket_mask = 1;
+    while (pool->bucket_mask < 2 * pool->frame_count) {
+        pool->bucket_mask *= 2;
+    }
+    pool->buckets = malloc(pool->bucket_mask * sizeof(int));
+    pool->bucket_mask--;
+    pool->frames = calloc(pool->frame_count, sizeof(Frame));
+    pool->memory = malloc((size_t)pool->frame_count * POOL_PAGE_SIZE);
+    if (pool->buckets == NULL || pool->frames == NULL || pool->memory == NULL) {
+        perror("Erro ao alocar o pool de buffers");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i <= pool->bucket_mask; i++) {
+        pool->buckets[i] = -1;
+    }
+    for (int i = 0; i < pool->frame_count; i++) {
+        pool->frames[i].page = -1;
+        pool->frames[i].next = -1;
+        pool->frames[i].data = pool->memory + (size_t)i * POOL_PAGE_SIZE;
+    }
+    return 0;
+}
+
+int pool_bucket(const BufferPool *pool, long long page) {
+    return (int)(((unsigned long long)page * 11400714819323198485ull) >> 40) & pool->bucket_mask;
+}
+
+/**
+ * Grava a página do quadro no arquivo, sem passar do tamanho lógico.
+ */
+int pool_write_back(BufferPool *pool, Frame *frame) {
+    long long offset = frame->page * POOL_PAGE_SIZE;
+    long long length = pool->file_size - offset;
+    if (length > POOL_PAGE_SIZE) length = POOL_PAGE_SIZE;
+    if (length > 0 && pwrite(pool->fd, frame->data, (size_t)length, offset) != (ssize_t)length) {
+        perror("Erro ao gravar página do pool de buffers");
+        return -1;
+    }
+    frame->dirty = 0;
+    return 0;
+}
+
+/**
+ * Retorna o quadro com a página, lendo-a do arquivo se necessário. A vítima é
+ * escolhida pelo algoritmo CLOCK: quadros com o bit de referência ligado ganham
+ * uma segunda chance.
+ */
+Frame *pool_fetch(BufferPool *pool, long long page) {
+    int bucket = pool_bucket(pool, page);
+    for (int i = pool->buckets[bucket]; i != -1; i = pool->frames[i].next) {
+        if (pool->frames[i].page == page) {
+            pool->frames[i].referenced = 1;
+            return &pool->frames[i];
+        }
+    }
+
+    int victim;
+    while (1) {
+        victim = pool->clock_hand;
+        pool->clock_hand = (pool->clock_hand + 1) % pool->frame_count;
+        Frame *candidate = &pool->frames[victim];
+        if (candidate->page == -1 || !candidate->referenced) {
+            break;
+        }
+        candidate->referenced = 0;
+    }
+
+    Frame *frame = &pool->frames[victim];
+    if (frame->page != -1) {
+        if (frame->dirty) {
+            pool_write_back(pool, frame);
+        }
+        int *link = &pool->buckets[pool_bucket(pool, frame->page)];
+        while (*link != victim) {
+            link = &pool->frames[*link].next;
+        }
+        *link = frame->next;
+    }
+
+    ssize_t n = pread(pool->fd, frame->data, POOL_PAGE_SIZE, page * POOL_PAGE_SIZE);
+    if (n < 0) {
+        n = 0;
+    }
+    memset(frame->data + n, 0, POOL_PAGE_SIZE - n);
+    frame->page = page;
+    frame->dirty = 0;
+    frame->referenced = 1;
+    frame->next = pool->buckets[bucket];
+    pool->buckets[bucket] = victim;
+    return frame;
+}
+
+/**
+ * Retorna a cópia pendente da página (alterada desde o último checkpoint), ou
+ * NULL. Com create, a cópia é criada com o conteúdo atual do arquivo.
+ */
+char *pool_pending(BufferPool *pool, long long page, int create) {
+    int slot = -1;
+    if (pool->pending_mask >= 0) {
+        slot = (int)(((unsigned long long)page * 11400714819323198485ull) >> 40) & pool->pending_mask;
+        while (pool->pending_pages[slot] != -1) {
+            if (pool->pending_pages[slot] == page) {
+                return pool->pending_data[slot];
+            }
+            slot = (slot + 1) & pool->pending_mask;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    if (2 * (pool->pending_count + 1) > pool->pending_mask + 1) {
+        // Dobra a tabela e reinsere as páginas
+        int old_mask = pool->pending_mask;
+        long long *old_pages = pool->pending_pages;
+        char **old_data = pool->pending_data;
+        pool->pending_mask = old_mask < 0 ? 63 : 2 * old_mask + 1;
+        pool->pending_pages = malloc((size_t)(pool->pending_mask + 1) * sizeof(long long));
+        pool->pending_data = malloc((size_t)(pool->pending_mask + 1) * sizeof(char *));
+        if (pool->pending_pages == NULL || pool->pending_data == NULL) {
+            perror("Erro ao alocar as páginas pendentes");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i <= pool->pending_mask; i++) {
+            pool->pending_pages[i] = -1;
+        }
+        for (int i = 0; i <= old_mask; i++) {
+            if (old_pages[i] == -1) {
+                continue;
+            }
+            int j = (int)(((unsigned long long)old_pages[i] * 11400714819323198485ull) >> 40) & pool->pending_mask;
+            while (pool->pending_pages[j] != -1) {
+                j = (j + 1) & pool->pending_mask;
+            }
+            pool->pending_pages[j] = old_pages[i];
+            pool->pending_data[j] = old_data[i];
+        }
+        free(old_pages);
+        free(old_data);
+        slot = (int)(((unsigned long long)page * 11400714819323198485ull) >> 40) & pool->pending_mask;
+        while (pool->pending_pages[slot] != -1) {
+            slot = (slot + 1) & pool->pending_mask;
+        }
+    }
+
+    // Com log, páginas de quadros e do mapeamento nunca ficam à frente do arquivo
+    char *data = malloc(POOL_PAGE_SIZE);
+    if (data == NULL) {
+        perror("Erro ao alocar as páginas pendentes");
+        exit(EXIT_FAILURE);
+    }
+    ssize_t n = pread(pool->fd, data, POOL_PAGE_SIZE, page * POOL_PAGE_SIZE);
+    if (n < 0) {
+        n = 0;
+    }
+    memset(data + n, 0, POOL_PAGE_SIZE - n);
+    pool->pending_pages[slot] = page;
+    pool->pending_data[slot] = data;
+    pool->pending_count++;
+    return data;
+}
+
+/**
+ * Garante que o mapeamento cubra size bytes. O arquivo cresce em extensões de
+ * pelo menos POOL_MAP_EXTENT (ou o dobro do tamanho atual), para que
+ * acrescentar registros não remapeie a cada escrita; o excesso é cortado em
+ * pool_close. Ponteiros obtidos com pool_pointer deixam de valer.
+ */
+int pool_reserve(BufferPool *pool, long long size) {
+    if (size <= pool->map_capacity) {
+        return 0;
+    }
+    long long capacity = pool->map_capacity * 2;
+    if (capacity < POOL_MAP_EXTENT) capacity = POOL_MAP_EXTENT;
+    if (capacity < size) capacity = size;
+    capacity = (capacity + POOL_PAGE_SIZE - 1) / POOL_PAGE_SIZE * POOL_PAGE_SIZE;
+    if (ftruncate(pool->fd, capacity) != 0) {
+        perror("Erro ao aumentar o arquivo mapeado");
+        return -1;
+    }
+    char *map;
+    if (pool->map == NULL) {
+        map = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, pool->fd, 0);
+    } else {
+        map = mremap(pool->map, pool->map_capacity, capacity, MREMAP_MAYMOVE);
+    }
+    if (map == MAP_FAILED) {
+        perror("Erro ao remapear o arquivo");
+        return -1;
+    }
+    pool->map = map;
+    pool->map_capacity = capacity;
+    madvise(pool->map, pool->map_capacity, pool->advice);
+    return 0;
+}
+
+/**
+ * No modo mmap, retorna um ponteiro direto para length bytes em offset (sem
+ * cópia nem chamada de sistema); no modo com quadros, ou fora do arquivo,
+ * retorna NULL. Uma página pendente só é devolvida se contiver o trecho
+ * inteiro.
+ */
+const void *pool_pointer(BufferPool *pool, long long offset, size_t length) {
+    if (!pool->mapped || offset < 0 || offset + (long long)length > pool->file_size) {
+        return NULL;
+    }
+    if (pool->pending_count > 0) {
+        long long first = offset / POOL_PAGE_SIZE;
+        long long last = (offset + (long long)length - 1) / POOL_PAGE_SIZE;
+        char *page = pool_pending(pool, first, 0);
+        if (page != NULL) {
+            return first == last ? page + offset % POOL_PAGE_SIZE : NULL;
+        }
+        for (long long p = first + 1; p <= last; p++) {
+            if (pool_pending(pool, p, 0) != NULL) {
+                return NULL;
+            }
+        }
+        if (offset + (long long)length > pool->map_capacity) {
+            return NULL;
+        }
+    }
+    return pool->map + offset;
+}
+
+/**
+ * Indica ao kernel o padrão de acesso esperado (MADV_SEQUENTIAL para
+ * varreduras, MADV_RANDOM para seguir os elos). Sem efeito no modo com quadros.
+ */
+void pool_advise(BufferPool *pool, int advice) {
+    pool->advice = advice;
+    if (pool->mapped && pool->map != NULL) {
+        madvise(pool->map, pool->map_capacity, advice);
+    }
+}
+
+int pool_read(BufferPool *pool, long long offset, void *buffer, size_t length) {
+    if (offset < 0 || offset + (long long)length > pool->file_size) {
+        return -1;
+    }
+    if (pool->mapped && pool->pending_count == 0) {
+        memcpy(buffer, pool->map + offset, length);
+        return 0;
+    }
+    char *out = (char *)buffer;
+    while (length > 0) {
+        long long page = offset / POOL_PAGE_SIZE;
+        size_t in_page = offset % POOL_PAGE_SIZE;
+        size_t chunk = POOL_PAGE_SIZE - in_page < length ? POOL_PAGE_SIZE - in_page : length;
+        const char *source = pool_pending(pool, page, 0);
+        if (source == NULL) {
+            source = pool->mapped ? pool->map + page * POOL_PAGE_SIZE : pool_fetch(pool, page)->data;
+        }
+        memcpy(out, source + in_page, chunk);
+        out += chunk;
+        offset += chunk;
+        length -= chunk;
+    }
+    return 0;
+}
+
+/**
+ * Com log, a escrita é acrescentada à transação aberta e aplicada só às
+ * páginas pendentes: o arquivo nunca recebe parte de uma transação.
+ */
+int pool_write(BufferPool *pool, long long offset, const void *buffer, size_t length) {
+    if (pool->wal != NULL) {
+        if (wal_append(pool->wal, offset, buffer, length) != 0) {
+            return -1;
+        }
+        const char *in = (const char *)buffer;
+        while (length > 0) {
+            char *page = pool_pending(pool, offset / POOL_PAGE_SIZE, 1);
+            size_t in_page = offset % POOL_PAGE_SIZE;
+            size_t chunk = POOL_PAGE_SIZE - in_page < length ? POOL_PAGE_SIZE - in_page : length;
+            memcpy(page + in_page, in, chunk);
+            in += chunk;
+            offset += chunk;
+            length -= chunk;
+            if (offset > pool->file_size) {
+                pool->file_size = offset;
+            }
+        }
+        return 0;
+    }
+    if (pool->mapped) {
+        if (pool_reserve(pool, offset + (long long)length) != 0) {
+            return -1;
+        }
+        memcpy(pool->map + offset, buffer, length);
+        if (offset + (long long)length > pool->file_size) {
+            pool->file_size = offset + (long long)length;
+        }
+        return 0;
+    }
+    const char *in = (const char *)buffer;
+    while (length > 0) {
+        Frame *frame = pool_fetch(pool, offset / POOL_PAGE_SIZE);
+        size_t in_page = offset % POOL_PAGE_SIZE;
+        size_t chunk = POOL_PAGE_SIZE - in_page < length ? POOL_PAGE_SIZE - in_page : length;
+        memcpy(frame->data + in_page, in, chunk);
+        frame->dirty = 1;
+        in += chunk;
+        offset += chunk;
+        length -= chunk;
+        if (offset > pool->file_size) {
+            pool->file_size = offset;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Leva as páginas pendentes para o arquivo: o log é sincronizado primeiro, as
+ * páginas são gravadas e sincronizadas, e só então o log é reiniciado. Uma
+ * queda em qualquer ponto deixa no log o que falta reaplicar.
+ */
+int pool_checkpoint(BufferPool *pool) {
+    WriteAheadLog *wal = pool->wal;
+    if (wal == NULL || pool->pending_count == 0) {
+        return 0;
+    }
+    if (wal_end_transaction(wal, pool->file_size) != 0 || wal_sync(wal) != 0) {
+        return -1;
+    }
+    if (pool->mapped && pool_reserve(pool, pool->file_size) != 0) {
+        return -1;
+    }
+    for (int i = 0; i <= pool->pending_mask; i++) {
+        long long page = pool->pending_pages[i];
+        if (page == -1) {
+            continue;
+        }
+        long long offset = page * POOL_PAGE_SIZE;
+        long long length = pool->file_size - offset;
+        if (length > POOL_PAGE_SIZE) length = POOL_PAGE_SIZE;
+        if (length <= 0) {
+            continue;
+        }
+        if (pool->mapped) {
+            memcpy(pool->map + offset, pool->pending_data[i], (size_t)length);
+            continue;
+        }
+        if (pwrite(pool->fd, pool->pending_data[i], (size_t)length, offset) != (ssize_t)length) {
+            perror("Erro ao gravar página do pool de buffers");
+            return -1;
+        }
+        for (int f = pool->buckets[pool_bucket(pool, page)]; f != -1; f = pool->frames[f].next) {
+            if (pool->frames[f].page == page) {
+                memcpy(pool->frames[f].data, pool->pending_data[i], POOL_PAGE_SIZE);
+                break;
+            }
+        }
+    }
+    if ((pool->mapped && msync(pool->map, pool->map_capacity, MS_SYNC) != 0) || fsync(pool->fd) != 0) {
+        perror("Erro ao sincronizar o arquivo de dados");
+        return -1;
+    }
+    for (int i = 0; i <= pool->pending_mask; i++) {
+        if (pool->pending_pages[i] != -1) {
+            free(pool->pending_data[i]);
+            pool->pending_pages[i] = -1;
+        }
+    }
+    pool->pending_count = 0;
+    return wal_restart(wal, pool->file_size);
+}
+
+int pool_flush(BufferPool *pool) {
+    if (pool->wal != NULL) {
+        return pool_checkpoint(pool);
+    }
+    int result = 0;
+    for (int i = 0; i < pool->frame_count; i++) {
+        if (pool->frames[i].page != -1 && pool->frames[i].dirty && pool_write_back(pool, &pool->frames[i]) != 0) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+void pool_drop_frames(BufferPool *pool) {
+    for (int i = 0; i < pool->frame_count; i++) {
+        pool->frames[i].page = -1;
+        pool->frames[i].dirty = 0;
+        pool->frames[i].referenced = 0;
+        pool->frames[i].next = -1;
+    }
+    for (int i = 0; i <= pool->bucket_mask; i++) {
+        pool->buckets[i] = -1;
+    }
+}
+
+/**
+ * Esvazia o arquivo, descartando todas as páginas em memória.
+ */
+int pool_truncate(BufferPool *pool) {
+    if (pool->mapped && pool->map != NULL) {
+        munmap(pool->map, pool->map_capacity);
+        pool->map = NULL;
+        pool->map_capacity = 0;
+    }
+    pool_drop_frames(pool);
+    pool->file_size = 0;
+    return ftruncate(pool->fd, 0);
+}
+
+/**
+ * Grava as páginas alteradas, descarta as demais e relê o tamanho do arquivo,
+ * para enxergar alterações feitas por outro processo. No modo mmap o
+ * conteúdo já é compartilhado e só um novo tamanho exige refazer o mapeamento.
+ */
+int pool_refresh(BufferPool *pool) {
+    struct stat st;
+    pool_flush(pool);
+    pool_drop_frames(pool);
+    if (fstat(pool->fd, &st) != 0) {
+        return -1;
+    }
+    if (pool->mapped && st.st_size != pool->map_capacity) {
+        // O arquivo foi redimensionado por fora: refaz o mapeamento
+        if (pool->map != NULL) {
+            munmap(pool->map, pool->map_capacity);
+        }
+        pool->map = NULL;
+        pool->map_capacity = 0;
+        if (st.st_size > 0) {
+            pool->map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, pool->fd, 0);
+            if (pool->map == MAP_FAILED) {
+                pool->map = NULL;
+                pool->file_size = 0;
+                return -1;
+            }
+            pool->map_capacity = st.st_size;
+            madvise(pool->map, pool->map_capacity, pool->advice);
+        }
+        pool->file_size = st.st_size;
+    } else if (!pool->mapped) {
+        pool->file_size = st.st_size;
+    }
+    return 0;
+}
+
+void pool_close(BufferPool *pool) {
+    pool_flush(pool);
+    if (pool->mapped) {
+        if (pool->map != NULL) {
+            munmap(pool->map, pool->map_capacity);
+        }
+        if (pool->map_capacity != pool->file_size && ftruncate(pool->fd, pool->file_size) != 0) {
+            perror("Erro ao ajustar o tamanho do arquivo mapeado");
+        }
+    }
+    close(pool->fd);
+    free(pool->frames);
+    free(pool->memory);
+    free(pool->buckets);
+    for (int i = 0; i <= pool->pending_mask; i++) {
+        if (pool->pending_pages[i] != -1) {
+            free(pool->pending_data[i]);
+        }
+    }
+    free(pool->pending_pages);
+    free(pool->pending_data);
+}
+
+int read_access_record(Storage *store, long long index, AccessRecord *record) {
+    return pool_read(&store->data, (long long)sizeof(AccessFileHeader) + index * (long long)sizeof(AccessRecord), record, sizeof(AccessRecord));
+}
+
+int write_access_record(Storage *store, long long index, const AccessRecord *record) {
+    return pool_write(&store->data, (long long)sizeof(AccessFileHeader) + index * (long long)sizeof(AccessRecord), record, sizeof(AccessRecord));
+}
+
+/**
+ * Retorna o registro index sem cópia no modo mmap; no modo com quadros, lê o
+ * registro para copy. Retorna NULL se index estiver fora do arquivo. O ponteiro
+ * só vale até a próxima escrita em access.bin.
+ */
+const AccessRecord *access_record_at(Storage *store, long long index, AccessRecord *copy) {
+    const AccessRecord *record = pool_pointer(&store->data, (long long)sizeof(AccessFileHeader) + index * (long long)sizeof(AccessRecord), sizeof(AccessRecord));
+    if (record != NULL) {
+        return record;
+    }
+    return read_access_record(store, index, copy) == 0 ? copy : NULL;
+}
+
+long long access_record_count(const Storage *store) {
+    return (store->data.file_size - (long long)sizeof(AccessFileHeader)) / (long long)sizeof(AccessRecord);
+}
+
+/**
+ * Tamanho e data de modificação de access.bin, guardados em access.idx para
+ * detectar alterações feitas por fora.
+ */
+void stamp_file(const char *filename, DataStamp *stamp) {
+    struct stat st;
+    stamp->size = -1;
+    stamp->mtime_sec = 0;
+    stamp->mtime_nsec = 0;
+    if (stat(filename, &st) == 0) {
+        stamp->size = st.st_size;
+        stamp->mtime_sec = st.st_mtim.tv_sec;
+        stamp->mtime_nsec = st.st_mtim.tv_nsec;
+    }
+}
+
+void stamp_data_file(DataStamp *stamp) {
+    stamp_file(ORIGINAL_FILE_NAME, stamp);
+}
+
+int same_data_stamp(const DataStamp *a, const DataStamp *b) {
+    return a->size == b->size && a->mtime_sec == b->mtime_sec && a->mtime_nsec == b->mtime_nsec;
+}
+
+int read_index_entry(Storage *store, long long position, IndexRecord *entry) {
+    return pool_read(&store->index, (long long)sizeof(IndexHeader) + position * (long long)sizeof(IndexRecord), entry, sizeof(IndexRecord));
+}
+
+int write_index_entry(Storage *store, long long position, const IndexRecord *entry) {
+    // Só o contador mudou: a cópia em memória é atualizada no lugar
+    IndexCache *cache = &store->index_cache;
+    if (cache->valid && position < cache->count && cache->entries[position].seq_key == entry->seq_key) {
+        cache->entries[position] = *entry;
+    } else {
+        cache->valid = 0;
+    }
+    return pool_write(&store->index, (long long)sizeof(IndexHeader) + position * (long long)sizeof(IndexRecord), entry, sizeof(IndexRecord));
+}
+
+int write_index_header(Storage *store) {
+    if (store->index_header.entry_count != store->index_cache.count) {
+        store->index_cache.valid = 0;
+    }
+    return pool_write(&store->index, 0, &store->index_header, sizeof(IndexHeader));
+}
+
+/**
+ * Cria o índice parcial: uma entrada a cada records_per_index registros ativos,
+ * com o número de registros ativos que ela cobre.
+ */
+int create_partial_index(Storage *store, int records_per_index) {
+    store->index_cache.valid = 0;
+    if (pool_truncate(&store->index) != 0) {
+        perror("Erro ao criar o arquivo de índice");
+        return -1;
+    }
+
+    AccessRecord copy;
+    const AccessRecord *record;
+    long long num_records = access_record_count(store);
+    long long index_count = 0;
+    long long count = 0;
+    IndexRecord idx_record;
+
+    pool_advise(&store->data, MADV_SEQUENTIAL);
+    for (long long record_index = 0; record_index < num_records; record_index++) {
+        if ((record = access_record_at(store, record_index, &copy)) == NULL) {
+            break;
+        }
+        if (record->ativo) {
+            if (count % records_per_index == 0) {
+                if (count > 0) {
+                    write_index_entry(store, index_count++, &idx_record);
+                }
+                idx_record.seq_key = record->seq_key;
+                idx_record.record_index = record_index;
+                idx_record.count = 0;
+            }
+            idx_record.count++;
+            count++;
+        }
+    }
+    if (count > 0) {
+        write_index_entry(store, index_count++, &idx_record);
+    }
+    pool_advise(&store->data, MADV_RANDOM);
+
+    IndexHeader *header = &store->index_header;
+    memset(header, 0, sizeof(IndexHeader));
+    memcpy(header->magic, INDEX_MAGIC, sizeof(header->magic));
+    header->records_per_index = records_per_index;
+    header->entry_count = index_count;
+    stamp_data_file(&header->data);
+    write_index_header(store);
+    pool_flush(&store->index);
+
+    printf("Índice parcial criado com sucesso.\n");
+    return 0;
+}
+
+long long index_cache_fill(IndexCache *cache, long long next, long long k) {
+    if (k <= cache->count) {
+        next = index_cache_fill(cache, next, 2 * k);
+        cache->keys[k] = cache->entries[next].seq_key;
+        cache->ranks[k] = next;
+        next = index_cache_fill(cache, next + 1, 2 * k + 1);
+    }
+    return next;
+}
+
+/**
+ * Carrega o índice em memória se ele foi alterado por este processo ou se
+ * access.idx mudou no disco (por exemplo, atualizado por outro processo). O
+ * disco é consultado no máximo a cada INDEX_CHECK_INTERVAL_NS.
+ */
+int index_cache_load(Storage *store) {
+    IndexCache *cache = &store->index_cache;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long now_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+    if (cache->valid && now_ns - cache->checked_at < INDEX_CHECK_INTERVAL_NS) {
+        return 0;
+    }
+    cache->checked_at = now_ns;
+
+    DataStamp current;
+    stamp_file(INDEX_FILE_NAME, &current);
+    if (!same_data_stamp(&cache->file, &current)) {
+        pool_refresh(&store->index);
+        if (pool_read(&store->index, 0, &store->index_header, sizeof(IndexHeader)) != 0) {
+            store->index_header.entry_count = 0;
+        }
+        stamp_file(INDEX_FILE_NAME, &current);
+        cache->valid = 0;
+    }
+    if (cache->valid) {
+        return 0;
+    }
+
+    long long count = store->index_header.entry_count;
+    free(cache->keys);
+    free(cache->ranks);
+    free(cache->entries);
+    cache->keys = NULL;
+    cache->valid = 0;
+    cache->count = 0;
+    cache->ranks = malloc((count + 1) * sizeof(long long));
+    cache->entries = malloc((count + 1) * sizeof(IndexRecord));
+    if (posix_memalign((void **)&cache->keys, 64, (count + 1) * sizeof(long long)) != 0 ||
+        cache->ranks == NULL || cache->entries == NULL ||
+        (count > 0 && pool_read(&store->index, sizeof(IndexHeader), cache->entries, count * sizeof(IndexRecord)) != 0)) {
+        return -1;
+    }
+    cache->count = count;
+    index_cache_fill(cache, 0, 1);
+    cache->file = current;
+    cache->valid = 1;
+    return 0;
+}
+
+void index_cache_free(IndexCache *cache) {
+    free(cache->keys);
+    free(cache->ranks);
+    free(cache->entries);
+    memset(cache, 0, sizeof(IndexCache));
+}
+
+/**
+ * Encontra a entrada com a maior chave menor ou igual ao alvo (ou a primeira,
+ * se o alvo for menor que todas). Retorna a posição da entrada, ou -1 se o
+ * índice estiver vazio.
+ */
+int binary_search_index(Storage *store, long long target_seq_key, IndexRecord *result) {
+    IndexCache *cache = &store->index_cache;
+    if (index_cache_load(store) != 0 || cache->count == 0) {
+        return -1;
+    }
+
+    // Desce sem desvios até abaixo das folhas; os bits de k guardam o caminho,
+    // e descartar os últimos passos à direita leva à primeira chave maior que o alvo
+    long long k = 1;
+    while (k <= cache->count) {
+        __builtin_prefetch(cache->keys + 8 * k);
+        k = 2 * k + (cache->keys[k] <= target_seq_key);
+    }
+    k >>= __builtin_ffsll(~k);
+    long long position = (k == 0 ? cache->count : cache->ranks[k]) - 1;
+    if (position < 0) {
+        position = 0;
+    }
+    *result = cache->entries[position];
+    return (int)position;
+}
+
+/**
+ * Atualiza o índice depois que um registro ativo foi acrescentado no fim do
+ * arquivo: ele entra na última entrada, ou abre uma nova quando a última já
+ * cobre RECORDS_PER_INDEX registros, como faria a reconstrução completa.
+ */
+void index_note_append(Storage *store, long long seq_key, long long slot) {
+    IndexRecord entry;
+    long long last = store->index_header.entry_count - 1;
+    if (last >= 0) {
+        read_index_entry(store, last, &entry);
+        if (entry.count < RECORDS_PER_INDEX) {
+            entry.count++;
+            write_index_entry(store, last, &entry);
+            return;
+        }
+    }
+    entry.seq_key = seq_key;
+    entry.record_index = slot;
+    entry.count = 1;
+    write_index_entry(store, last + 1, &entry);
+    store->index_header.entry_count++;
+    write_index_header(store);
+}
+
+/**
+ * Atualiza o índice depois que o registro removed, na posição slot, foi
+ * inativado. Se ele era a âncora da entrada, a entrada passa para o próximo
+ * registro ativo; uma entrada sem registros é retirada do índice. O índice é
+ * reconstruído quando uma entrada que não é a última fica com menos de
+ * INDEX_MIN_SPAN registros. Retorna 1 se o índice foi reconstruído, ou 0.
+ */
+int index_note_remove(Storage *store, const AccessRecord *removed, long long slot) {
+    IndexRecord entry;
+    long long position = binary_search_index(store, removed->seq_key, &entry);
+    if (position == -1) {
+        create_partial_index(store, RECORDS_PER_INDEX);
+        return 1;
+    }
+
+    entry.count--;
+    if (entry.count == 0) {
+        IndexRecord next_entry;
+        for (long long i = position + 1; i < store->index_header.entry_count; i++) {
+            read_index_entry(store, i, &next_entry);
+            write_index_entry(store, i - 1, &next_entry);
+        }
+        store->index_header.entry_count--;
+        write_index_header(store);
+        return 0;
+    }
+
+    if (entry.record_index == slot) {
+        long long num_records = access_record_count(store);
+        long long next_index = slot + 1;
+        AccessRecord copy;
+        const AccessRecord *next_record = NULL;
+        while (next_index < num_records && (next_record = access_record_at(store, next_index, &copy)) != NULL && !next_record->ativo) {
+            next_index++;
+        }
+        if (next_index >= num_records || next_record == NULL) {
+            create_partial_index(store, RECORDS_PER_INDEX);
+            return 1;
+        }
+        entry.seq_key = next_record->seq_key;
+        entry.record_index = next_index;
+    }
+    write_index_entry(store, position, &entry);
+    if (entry.count < INDEX_MIN_SPAN && position < store->index_header.entry_count - 1) {
+        create_partial_index(store, RECORDS_PER_INDEX);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Carrega o cabeçalho do índice parcial, reconstruindo o índice se ele não
+ * existir, tiver outro espaçamento ou for de uma versão anterior de access.bin.
+ */
+int index_open(Storage *store) {
+    DataStamp current;
+    stamp_data_file(&current);
+    if (pool_read(&store->index, 0, &store->index_header, sizeof(IndexHeader)) != 0 ||
+        memcmp(store->index_header.magic, INDEX_MAGIC, sizeof(store->index_header.magic)) != 0 ||
+        store->index_header.records_per_index != RECORDS_PER_INDEX ||
+        !same_data_stamp(&store->index_header.data, &current)) {
+        return create_partial_index(store, RECORDS_PER_INDEX);
+    }
+    return 0;
+}
+
+/**
+ * Registra o estado atual de access.bin no cabeçalho do índice. Deve ser
+ * chamada depois que access.bin já foi gravado.
+ */
+void index_close(Storage *store) {
+    stamp_data_file(&store->index_header.data);
+    write_index_header(store);
+}
+
+/**
+ * Abre access.wal e reaplica em access.bin as transações confirmadas que não
+ * passaram por checkpoint, cortando o arquivo no tamanho da última delas. Um
+ * log não vazio indica que o processo anterior não fechou os arquivos:
+ * access.bin é tocado para que access.idx, que pode ter páginas de transações
+ * perdidas, seja reconstruído. Depois disso as escritas em access.bin passam
+ * pelo log.
+ */
+int wal_open(Storage *store) {
+    WriteAheadLog *wal = &store->wal;
+    memset(wal, 0, sizeof(WriteAheadLog));
+    wal->fd = open(WAL_FILE_NAME, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (wal->fd < 0 || fstat(wal->fd, &st) != 0) {
+        perror("Erro ao abrir o log de escrita antecipada");
+        if (wal->fd >= 0) {
+            close(wal->fd);
+        }
+        return -1;
+    }
+
+    if (st.st_size > 0) {
+        char *log = malloc((size_t)st.st_size);
+        if (log == NULL || pread(wal->fd, log, (size_t)st.st_size, 0) != (ssize_t)st.st_size) {
+            perror("Erro ao ler o log de escrita antecipada");
+            free(log);
+            close(wal->fd);
+            return -1;
+        }
+        size_t length = (size_t)st.st_size;
+        size_t position = 0;
+        size_t transaction = 0;
+        unsigned long long checksum = WAL_CHECKSUM_SEED;
+        long long file_size = -1;
+        long long applied = 0;
+        int failed = 0;
+        WalRecord record;
+
+        // Para no primeiro registro incompleto ou inválido: o fim do log pode
+        // ter sido gravado pela metade
+        while (!failed && position + sizeof(WalRecord) <= length) {
+            memcpy(&record, log + position, sizeof(WalRecord));
+            if (record.type == WAL_WRITE) {
+                if (record.length > length - position - sizeof(WalRecord)) {
+                    break;
+                }
+                checksum = wal_checksum(checksum, &record, sizeof(WalRecord));
+                checksum = wal_checksum(checksum, log + position + sizeof(WalRecord), record.length);
+                position += sizeof(WalRecord) + record.length;
+                continue;
+            }
+            if (record.type == WAL_COMMIT && record.checksum == checksum) {
+                for (size_t p = transaction; p < position && !failed;) {
+                    WalRecord write_record;
+                    memcpy(&write_record, log + p, sizeof(WalRecord));
+                    failed = pwrite(store->data.fd, log + p + sizeof(WalRecord), write_record.length, write_record.offset) !=
+                             (ssize_t)write_record.length;
+                    p += sizeof(WalRecord) + write_record.length;
+                }
+                applied++;
+            } else if (record.type != WAL_START) {
+                break;
+            }
+            file_size = record.offset;
+            position += sizeof(WalRecord);
+            transaction = position;
+            checksum = WAL_CHECKSUM_SEED;
+        }
+        free(log);
+        if (failed || (file_size >= 0 && ftruncate(store->data.fd, file_size) != 0) ||
+            futimens(store->data.fd, NULL) != 0 || fsync(store->data.fd) != 0 || pool_refresh(&store->data) != 0) {
+            perror("Erro ao reaplicar o log de escrita antecipada");
+            close(wal->fd);
+            return -1;
+        }
+        printf("Recuperação: %lld transações reaplicadas a partir de %s.\n", applied, WAL_FILE_NAME);
+    }
+
+    if (wal_restart(wal, store->data.file_size) != 0) {
+        close(wal->fd);
+        return -1;
+    }
+    store->data.wal = wal;
+    return 0;
+}
+
+/**
+ * Esvazia e fecha o log. Só deve ser chamada depois que access.bin ficou com
+ * o seu conteúdo e tamanho finais; se o último checkpoint falhou
+ * (checkpointed == 0), o log é mantido para a recuperação.
+ */
+void wal_close(WriteAheadLog *wal, int checkpointed) {
+    if (checkpointed && (ftruncate(wal->fd, 0) != 0 || fdatasync(wal->fd) != 0)) {
+        perror("Erro ao esvaziar o log de escrita antecipada");
+    }
+    close(wal->fd);
+    free(wal->buffer);
+}
+
+/**
+ * Abre o pool de access.bin e o seu log, recuperando o que o log tiver.
+ */
+int data_open(Storage *store, int mapped) {
+    if (pool_open(&store->data, ORIGINAL_FILE_NAME, DATA_POOL_FRAMES, mapped) != 0) {
+        return -1;
+    }
+    if (wal_open(store) != 0) {
+        pool_close(&store->data);
+        return -1;
+    }
+    return 0;
+}
+
+void data_close(Storage *store) {
+    int checkpointed = pool_checkpoint(&store->data) == 0;
+    store->data.wal = NULL;
+    pool_close(&store->data);
+    wal_close(&store->wal, checkpointed);
+}
+
+/**
+ * Confirma a transação aberta em access.bin. O log só recebe fsync a cada
+ * WAL_GROUP_COMMITS transações ou WAL_GROUP_BYTES bytes (ou em wal_sync e no
+ * fechamento): uma queda perde no máximo esse grupo, sempre em transações
+ * inteiras. Com WAL_CHECKPOINT_PAGES páginas pendentes, faz um checkpoint.
+ */
+void wal_commit(Storage *store) {
+    WriteAheadLog *wal = &store->wal;
+    if (wal_end_transaction(wal, store->data.file_size) != 0) {
+        return;
+    }
+    if (wal->unsynced_commits >= WAL_GROUP_COMMITS || wal->used >= WAL_GROUP_BYTES) {
+        wal_sync(wal);
+    }
+    if (store->data.pending_count >= WAL_CHECKPOINT_PAGES) {
+        pool_checkpoint(&store->data);
+    }
+}
+
+/**
+ * Abre access.bin e o índice parcial com os seus pools de buffers. O arquivo de
+ * dados já deve existir (ver initialize_file); o índice é reconstruído se
+ * access.bin mudou por fora, e o log access.wal é reaplicado antes de tudo
+ * (ver wal_open). mode escolhe entre quadros em memória (STORAGE_BUFFERED) e
+ * os arquivos mapeados com mmap (STORAGE_MAPPED).
+ */
+int storage_open(Storage *store, int mode) {
+    if (data_open(store, mode == STORAGE_MAPPED) != 0) {
+        return -1;
+    }
+    if (pool_read(&store->data, 0, &store->header, sizeof(AccessFileHeader)) != 0 ||
+        memcmp(store->header.magic, ACCESS_FILE_MAGIC, sizeof(store->header.magic)) != 0 ||
+        store->header.version != ACCESS_FILE_VERSION ||
+        store->header.record_size != sizeof(AccessRecord)) {
+        printf("Cabeçalho inválido no arquivo de dados.\n");
+        data_close(store);
+        return -1;
+    }
+    if (pool_open(&store->index, INDEX_FILE_NAME, INDEX_POOL_FRAMES, mode == STORAGE_MAPPED) != 0) {
+        data_close(store);
+        return -1;
+    }
+    memset(&store->index_cache, 0, sizeof(IndexCache));
+    if (index_open(store) != 0) {
+        pool_close(&store->index);
+        data_close(store);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Grava as páginas alteradas e fecha os arquivos.
+ */
+void storage_close(Storage *store) {
+    data_close(store);
+    index_close(store);
+    pool_close(&store->index);
+    index_cache_free(&store->index_cache);
+}
+
+/**
+ * Lê e valida o cabeçalho do arquivo de dados. Deixa a posição no primeiro
+ * registro. Retorna -1 se o arquivo não estiver no formato v2.
+ */
+int read_access_header(FILE *fp, AccessFileHeader *header) {
+    fseek(fp, 0, SEEK_SET);
+    if (fread(header, sizeof(AccessFileHeader), 1, fp) != 1 ||
+        memcmp(header->magic, ACCESS_FILE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != ACCESS_FILE_VERSION ||
+        header->record_size != sizeof(AccessRecord)) {
+        return -1;
+    }
+    return 0;
+}
+
 void initialize_file() {
     FILE *fp = fopen(ORIGINAL_FILE_NAME, "rb");
     if (fp == NULL) {
@@ -35,16 +1361,30 @@ void initialize_file() {
             perror("Erro ao criar o arquivo de dados");
             exit(EXIT_FAILURE);
         }
+        AccessFileHeader header;
+        memset(&header, 0, sizeof(AccessFileHeader));
+        memcpy(header.magic, ACCESS_FILE_MAGIC, sizeof(header.magic));
+        header.version = ACCESS_FILE_VERSION;
+        header.record_size = sizeof(AccessRecord);
+        if (fwrite(&header, sizeof(AccessFileHeader), 1, fp) != 1) {
+            perror("Erro ao escrever o cabeçalho do arquivo de dados");
+            exit(EXIT_FAILURE);
+        }
         fclose(fp);
     } else {
+        AccessFileHeader header;
+        if (read_access_header(fp, &header) != 0) {
+            printf("O arquivo %s não está no formato v2; gere-o novamente com gerar_arquivos.\n", ORIGINAL_FILE_NAME);
+            exit(EXIT_FAILURE);
+        }
         fclose(fp);
     }
 }
 
-AccessRecord create_sample_access_record(const char *event_time, const char *event_type,
-                                         long long product_id, long long user_id,
-                                         const char *user_session) {
-    AccessRecord record;
+AccessEvent create_sample_access_record(const char *event_time, const char *event_type,
+                                        long long product_id, long long user_id,
+                                        const char *user_session) {
+    AccessEvent record;
     strncpy(record.event_time, event_time, MAX_EVENT_TIME_LEN - 1);
     record.event_time[MAX_EVENT_TIME_LEN - 1] = '\0';
     strncpy(record.event_type, event_type, MAX_EVENT_TYPE_LEN - 1);
@@ -58,69 +1398,242 @@ AccessRecord create_sample_access_record(const char *event_time, const char *eve
     return record;
 }
 
-long long get_next_seq_key() {
-    FILE *fp = fopen(ORIGINAL_FILE_NAME, "rb");
-    if (fp == NULL) {
-        perror("Erro ao abrir o arquivo de dados para leitura do seq_key");
-        exit(EXIT_FAILURE);
-    }
-
-    fseek(fp, 0, SEEK_END);
-    long long file_size = ftell(fp);
-    long long num_records = file_size / sizeof(AccessRecord);
+long long get_next_seq_key(Storage *store) {
+    long long num_records = access_record_count(store);
 
-    if (num_records == 0) {
-        fclose(fp);
+    if (num_records <= 0) {
         return 1;
     }
 
-    fseek(fp, -((long long)sizeof(AccessRecord)), SEEK_END);
     AccessRecord last_record;
-    fread(&last_record, sizeof(AccessRecord), 1, fp);
-    fclose(fp);
+    if (read_access_record(store, num_records - 1, &last_record) != 0) {
+        return 1;
+    }
 
     return last_record.seq_key + 1;
 }
 
-int insert_record(AccessRecord *record) {
-    FILE *fp = fopen(ORIGINAL_FILE_NAME, "ab");
-    if (fp == NULL) {
-        perror("Erro ao abrir o arquivo de dados para inserção");
-        return -1;
+int two_digits(const char *p) {
+    return (p[0] - '0') * 10 + (p[1] - '0');
+}
+
+/**
+ * Número de dias desde 1970-01-01 no calendário gregoriano proléptico.
+ */
+long long days_from_civil(long long year, unsigned month, unsigned day) {
+    year -= month <= 2;
+    long long era = (year >= 0 ? year : year - 399) / 400;
+    unsigned year_of_era = (unsigned)(year - era * 400);
+    unsigned day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    unsigned day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return era * 146097 + (long long)day_of_era - 719468;
+}
+
+/**
+ * Converte "AAAA-MM-DD HH:MM:SS" (o sufixo, como " UTC", é ignorado) em segundos
+ * desde 1970-01-01 UTC, ou EVENT_TIME_UNKNOWN fora desse formato. Aceita o
+ * mesmo formato que gerar_arquivos: só dígitos nas posições dos campos.
+ */
+long long parse_event_time(const char *text) {
+    static const char pattern[] = "dddd-dd-dd dd:dd:dd";
+    for (size_t i = 0; i < sizeof(pattern) - 1; i++) {
+        if (pattern[i] == 'd' ? (unsigned)(text[i] - '0') > 9 : text[i] != pattern[i]) {
+            return EVENT_TIME_UNKNOWN;
+        }
+    }
+    long long year = two_digits(text) * 100 + two_digits(text + 2);
+    unsigned month = two_digits(text + 5);
+    unsigned day = two_digits(text + 8);
+    int hour = two_digits(text + 11);
+    int minute = two_digits(text + 14);
+    int second = two_digits(text + 17);
+    if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 60) {
+        return EVENT_TIME_UNKNOWN;
     }
+    return days_from_civil(year, month, day) * 86400LL + hour * 3600 + minute * 60 + second;
+}
 
-    record->seq_key = get_next_seq_key();
+void format_event_time(long long event_time, char *buffer) {
+    if (event_time == EVENT_TIME_UNKNOWN) {
+        buffer[0] = '\0';
+        return;
+    }
+    time_t t = (time_t)event_time;
+    struct tm tm_value;
+    gmtime_r(&t, &tm_value);
+    strftime(buffer, MAX_EVENT_TIME_LEN, "%Y-%m-%d %H:%M:%S UTC", &tm_value);
+}
 
-    if (fwrite(record, sizeof(AccessRecord), 1, fp) != 1) {
-        perror("Erro ao escrever o registro no arquivo de dados");
-        fclose(fp);
-        return -1;
+/**
+ * Converte um UUID 8-4-4-4-12 com dígitos hexadecimais minúsculos em 16 bytes.
+ * Retorna 0 se o texto não estiver nesse formato.
+ */
+int parse_uuid(const char *text, unsigned char *out) {
+    unsigned char bytes[SESSION_BYTES];
+    int n = 0;
+    for (int i = 0; i < 36; i++) {
+        if (i == 8 || i == 13 || i == 18 || i == 23) {
+            if (text[i] != '-') return 0;
+            continue;
+        }
+        int value;
+        if (text[i] >= '0' && text[i] <= '9') value = text[i] - '0';
+        else if (text[i] >= 'a' && text[i] <= 'f') value = text[i] - 'a' + 10;
+        else return 0;
+        if (n % 2 == 0) bytes[n / 2] = (unsigned char)(value << 4);
+        else bytes[n / 2] |= (unsigned char)value;
+        n++;
     }
+    memcpy(out, bytes, SESSION_BYTES);
+    return 1;
+}
 
-    fclose(fp);
+/**
+ * Converte um acesso em texto para o formato gravado. Um tipo de evento novo é
+ * acrescentado ao dicionário do cabeçalho, e sessões que não são UUID nem cabem
+ * em 16 bytes são acrescentadas ao arquivo de sessões.
+ */
+int encode_access_event(Storage *store, const AccessEvent *event, AccessRecord *record) {
+    AccessFileHeader *header = &store->header;
+    memset(record, 0, sizeof(AccessRecord));
+    record->event_time = parse_event_time(event->event_time);
+    record->product_id = event->product_id;
+    record->user_id = event->user_id;
+    record->seq_key = event->seq_key;
+    record->ativo = (unsigned char)event->ativo;
+
+    unsigned int code = 0;
+    while (code < header->event_type_count && strcmp(header->event_types[code], event->event_type) != 0) {
+        code++;
+    }
+    if (code == header->event_type_count) {
+        if (code == MAX_EVENT_TYPES) {
+            printf("Dicionário de tipos de evento cheio.\n");
+            return -1;
+        }
+        size_t type_len = strlen(event->event_type);
+        if (type_len > MAX_EVENT_TYPE_LEN - 1) type_len = MAX_EVENT_TYPE_LEN - 1;
+        memcpy(header->event_types[code], event->event_type, type_len);
+        header->event_type_count++;
+        if (pool_write(&store->data, 0, header, sizeof(AccessFileHeader)) != 0) {
+            perror("Erro ao atualizar o cabeçalho do arquivo de dados");
+            return -1;
+        }
+    }
+    record->event_type = (unsigned char)code;
+
+    size_t len = strlen(event->user_session);
+    if (len == 36 && parse_uuid(event->user_session, record->user_session)) {
+        record->session_kind = SESSION_UUID;
+    } else if (len <= SESSION_BYTES) {
+        record->session_kind = SESSION_TEXT;
+        memcpy(record->user_session, event->user_session, len);
+    } else {
+        FILE *fp_sessions = fopen(SESSIONS_FILE_NAME, "ab");
+        if (fp_sessions == NULL) {
+            perror("Erro ao abrir o arquivo de sessões");
+            return -1;
+        }
+        fseek(fp_sessions, 0, SEEK_END);
+        long long offset = ftell(fp_sessions);
+        long long stored_len = (long long)len;
+        if (fwrite(event->user_session, 1, len, fp_sessions) != len) {
+            perror("Erro ao escrever no arquivo de sessões");
+            fclose(fp_sessions);
+            return -1;
+        }
+        fclose(fp_sessions);
+        store->wal.unsynced_sessions = 1;
+        record->session_kind = SESSION_OVERFLOW;
+        memcpy(record->user_session, &offset, sizeof(offset));
+        memcpy(record->user_session + 8, &stored_len, sizeof(stored_len));
+    }
     return 0;
 }
 
-void display_records_via_page(long long page) {
-    FILE *fp = fopen(ORIGINAL_FILE_NAME, "rb");
-    if (fp == NULL) {
-        printf("Erro ao abrir o arquivo de dados.\n");
-        return;
+/**
+ * Converte um registro gravado de volta para texto.
+ */
+void decode_access_record(const AccessFileHeader *header, const AccessRecord *record, AccessEvent *event) {
+    format_event_time(record->event_time, event->event_time);
+    if (record->event_type < header->event_type_count) {
+        strcpy(event->event_type, header->event_types[record->event_type]);
+    } else {
+        event->event_type[0] = '\0';
     }
+    event->product_id = record->product_id;
+    event->user_id = record->user_id;
+    event->seq_key = record->seq_key;
+    event->ativo = record->ativo;
+
+    if (record->session_kind == SESSION_UUID) {
+        static const char hex[] = "0123456789abcdef";
+        char *out = event->user_session;
+        for (int i = 0; i < SESSION_BYTES; i++) {
+            if (i == 4 || i == 6 || i == 8 || i == 10) *out++ = '-';
+            *out++ = hex[record->user_session[i] >> 4];
+            *out++ = hex[record->user_session[i] & 15];
+        }
+        *out = '\0';
+    } else if (record->session_kind == SESSION_TEXT) {
+        memcpy(event->user_session, record->user_session, SESSION_BYTES);
+        event->user_session[SESSION_BYTES] = '\0';
+    } else {
+        long long offset, len;
+        memcpy(&offset, record->user_session, sizeof(offset));
+        memcpy(&len, record->user_session + 8, sizeof(len));
+        event->user_session[0] = '\0';
+        FILE *fp_sessions = fopen(SESSIONS_FILE_NAME, "rb");
+        if (fp_sessions != NULL) {
+            if (len > MAX_USER_SESSION_LEN - 1) len = MAX_USER_SESSION_LEN - 1;
+            fseek(fp_sessions, offset, SEEK_SET);
+            size_t n = fread(event->user_session, 1, len, fp_sessions);
+            event->user_session[n] = '\0';
+            fclose(fp_sessions);
+        }
+    }
+}
+
+int insert_record(Storage *store, AccessEvent *event) {
+    event->seq_key = get_next_seq_key(store);
 
     AccessRecord record;
+    if (encode_access_event(store, event, &record) != 0) {
+        return -1;
+    }
+
+    long long slot = access_record_count(store);
+    if (write_access_record(store, slot, &record) != 0) {
+        perror("Erro ao escrever o registro no arquivo de dados");
+        return -1;
+    }
+    if (record.ativo) {
+        index_note_append(store, record.seq_key, slot);
+    }
+    wal_commit(store);
+
+    return 0;
+}
+
+void display_records_via_page(Storage *store, long long page) {
+    AccessRecord copy;
+    const AccessRecord *stored;
+    AccessEvent record;
     long long records_to_skip = (page - 1) * RECORDS_PER_PAGE;
     long long skipped = 0;
     long long records_displayed = 0;
+    long long num_records = access_record_count(store);
 
     printf("\nExibindo registros da página %lld:\n", page);
-    while (fread(&record, sizeof(AccessRecord), 1, fp) == 1) {
-        if (record.ativo) {
+    pool_advise(&store->data, MADV_SEQUENTIAL);
+    for (long long i = 0; i < num_records && (stored = access_record_at(store, i, &copy)) != NULL; i++) {
+        if (stored->ativo) {
             if (skipped < records_to_skip) {
                 skipped++;
                 continue;
             }
 
+            decode_access_record(&store->header, stored, &record);
             printf("Registro %lld:\n", record.seq_key);
             printf("  Event Time: %s\n", record.event_time);
             printf("  Event Type: %s\n", record.event_type);
@@ -137,127 +1650,42 @@ void display_records_via_page(long long page) {
         }
     }
 
+    pool_advise(&store->data, MADV_RANDOM);
+
     if (records_displayed == 0) {
         printf("Nenhum registro encontrado nesta página.\n");
     }
-
-    fclose(fp);
-}
-
-int create_partial_index(const char *data_file, const char *index_file, int records_per_index) {
-    FILE *fp_data = fopen(data_file, "rb");
-    if (fp_data == NULL) {
-        perror("Erro ao abrir o arquivo de dados para criar o índice");
-        return -1;
-    }
-
-    FILE *fp_index = fopen(index_file, "wb");
-    if (fp_index == NULL) {
-        perror("Erro ao criar o arquivo de índice");
-        fclose(fp_data);
-        return -1;
-    }
-
-    AccessRecord record;
-    long long record_index = 0;
-    int count = 0;
-
-    while (fread(&record, sizeof(AccessRecord), 1, fp_data) == 1) {
-        if (record.ativo) {
-            if (count % records_per_index == 0) {
-                IndexRecord idx_record;
-                idx_record.seq_key = record.seq_key;
-                idx_record.record_index = record_index;
-                fwrite(&idx_record, sizeof(IndexRecord), 1, fp_index);
-            }
-            count++;
-        }
-        record_index++;
-    }
-
-    fclose(fp_data);
-    fclose(fp_index);
-
-    printf("Índice parcial criado com sucesso.\n");
-    return 0;
 }
 
-int binary_search_index(const char *index_file, long long target_seq_key, IndexRecord *result) {
-    FILE *fp_index = fopen(index_file, "rb");
-    if (fp_index == NULL) {
-        perror("Erro ao abrir o arquivo de índice para pesquisa");
-        return -1;
-    }
-
-    fseek(fp_index, 0, SEEK_END);
-    long long file_size = ftell(fp_index);
-    long long num_records = file_size / sizeof(IndexRecord);
-    rewind(fp_index);
 
-    long long left = 0;
-    long long right = num_records - 1;
-    long long mid;
-    IndexRecord mid_record;
-
-    while (left <= right) {
-        mid = left + (right - left) / 2;
-        fseek(fp_index, mid * sizeof(IndexRecord), SEEK_SET);
-        fread(&mid_record, sizeof(IndexRecord), 1, fp_index);
-
-        if (mid_record.seq_key == target_seq_key) {
-            *result = mid_record;
-            fclose(fp_index);
-            return mid;
-        } else if (mid_record.seq_key < target_seq_key) {
-            left = mid + 1;
-        } else {
-            if (mid == 0) break;
-            right = mid - 1;
-        }
-    }
-
-    if (right >= 0) {
-        fseek(fp_index, right * sizeof(IndexRecord), SEEK_SET);
-        fread(&mid_record, sizeof(IndexRecord), 1, fp_index);
-        *result = mid_record;
-        fclose(fp_index);
-        return right;
-    }
 
-    fclose(fp_index);
-    return -1;
-}
-
-void query_using_partial_index_with_pagination(long long target_seq_key, long long page) {
+void query_using_partial_index_with_pagination(Storage *store, long long target_seq_key, long long page) {
     IndexRecord idx_record;
-    int idx = binary_search_index(INDEX_FILE_NAME, target_seq_key, &idx_record);
+    int idx = binary_search_index(store, target_seq_key, &idx_record);
 
     if (idx == -1) {
         printf("Seq Key %lld não encontrado no índice.\n", target_seq_key);
         return;
     }
 
-    FILE *fp = fopen(ORIGINAL_FILE_NAME, "rb");
-    if (fp == NULL) {
-        printf("Erro ao abrir o arquivo de dados.\n");
-        return;
-    }
-
-    fseek(fp, idx_record.record_index * sizeof(AccessRecord), SEEK_SET);
-    AccessRecord current_record;
+    AccessRecord copy;
+    const AccessRecord *stored;
+    AccessEvent current_record;
     long long records_to_skip = (page - 1) * RECORDS_PER_PAGE;
     long long skipped = 0;
     long long records_displayed = 0;
+    long long num_records = access_record_count(store);
 
     printf("\nBuscando por Seq Key %lld usando o índice parcial e exibindo a página %lld...\n", target_seq_key, page);
 
-    while (fread(&current_record, sizeof(AccessRecord), 1, fp) == 1) {
-        if (current_record.ativo) {
+    for (long long i = idx_record.record_index; i < num_records && (stored = access_record_at(store, i, &copy)) != NULL; i++) {
+        if (stored->ativo) {
             if (skipped < records_to_skip) {
                 skipped++;
                 continue;
             }
 
+            decode_access_record(&store->header, stored, &current_record);
             printf("\nRegistro Encontrado:\n");
             printf("  Event Time: %s\n", current_record.event_time);
             printf("  Event Type: %s\n", current_record.event_type);
@@ -277,43 +1705,46 @@ void query_using_partial_index_with_pagination(long long target_seq_key, long lo
     if (records_displayed == 0) {
         printf("\nNenhum registro ativo encontrado na página %lld.\n", page);
     }
-
-    fclose(fp);
 }
 
-void remove_record(long long target_seq_key) {
-    FILE *fp = fopen(ORIGINAL_FILE_NAME, "r+b");
-    if (fp == NULL) {
-        perror("Erro ao abrir o arquivo de dados para remoção");
-        return;
-    }
+void remove_record(Storage *store, long long target_seq_key) {
+    IndexRecord entry;
+    AccessRecord copy;
+    const AccessRecord *stored;
+    long long num_records = access_record_count(store);
+    long long start = binary_search_index(store, target_seq_key, &entry) == -1 ? num_records : entry.record_index;
 
-    AccessRecord record;
-
-    while (fread(&record, sizeof(AccessRecord), 1, fp) == 1) {
-        if (record.seq_key == target_seq_key && record.ativo) {
+    // Os seq_key crescem com a posição no arquivo: a busca começa na âncora
+    // da entrada do índice e para no primeiro seq_key maior
+    for (long long i = start; i < num_records && (stored = access_record_at(store, i, &copy)) != NULL &&
+                              stored->seq_key <= target_seq_key; i++) {
+        if (stored->seq_key == target_seq_key && stored->ativo) {
+            AccessRecord record = *stored;
             record.ativo = 0;
-            fseek(fp, -sizeof(AccessRecord), SEEK_CUR);
-            fwrite(&record, sizeof(AccessRecord), 1, fp);
+            write_access_record(store, i, &record);
+            index_note_remove(store, &record, i);
+            wal_commit(store);
             printf("Registro com Seq Key %lld foi inativado.\n", target_seq_key);
-            fclose(fp);
             return;
         }
     }
 
     printf("Registro com Seq Key %lld não encontrado ou já está inativo.\n", target_seq_key);
-    fclose(fp);
 }
 
-void update_partial_index() {
-    if (create_partial_index(ORIGINAL_FILE_NAME, INDEX_FILE_NAME, RECORDS_PER_INDEX) != 0) {
+void update_partial_index(Storage *store) {
+    if (create_partial_index(store, RECORDS_PER_INDEX) != 0) {
         printf("Erro ao atualizar o índice parcial.\n");
     }
 }
 
 int main() {
     initialize_file();
-    AccessRecord records_to_insert[] = {
+    Storage store;
+    if (storage_open(&store, STORAGE_MODE) != 0) {
+        return EXIT_FAILURE;
+    }
+    AccessEvent records_to_insert[] = {
         create_sample_access_record("2024-04-21 10:00:00", "LOGIN", 101, 1001, "SESSION_A"),
         create_sample_access_record("2024-04-21 10:05:00", "VIEW_PRODUCT", 102, 1002, "SESSION_B"),
         create_sample_access_record("2024-04-21 10:10:00", "ADD_TO_CART", 103, 1003, "SESSION_C"),
@@ -324,21 +1755,20 @@ int main() {
     int num_records = sizeof(records_to_insert) / sizeof(records_to_insert[0]);
 
     for (int i = 0; i < num_records; ++i) {
-        if (insert_record(&records_to_insert[i]) == 0) {
+        if (insert_record(&store, &records_to_insert[i]) == 0) {
             printf("Registro com Seq Key %lld inserido com sucesso.\n", records_to_insert[i].seq_key);
         } else {
             printf("Falha ao inserir o registro com Seq Key %lld.\n", records_to_insert[i].seq_key);
         }
     }
 
-    update_partial_index();
-    display_records_via_page(1);
+    display_records_via_page(&store, 1);
     long long search_seq_key = 3;
-    query_using_partial_index_with_pagination(search_seq_key, 1);
-    remove_record(search_seq_key);
-    update_partial_index();
-    query_using_partial_index_with_pagination(search_seq_key, 1);
-    display_records_via_page(1);
+    query_using_partial_index_with_pagination(&store, search_seq_key, 1);
+    remove_record(&store, search_seq_key);
+    query_using_partial_index_with_pagination(&store, search_seq_key, 1);
+    display_records_via_page(&store, 1);
 
+    storage_close(&store);
     return 0;
 }